@@ -0,0 +1,524 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sqlite3.h>
+#include <jansson.h>
+#include <zlib.h>
+#include <jemalloc/jemalloc.h>
+#include "defines.h"
+#include "doidata.h"
+#include "text.h"
+#include "recognize.h"
+#include "recognize_title.h"
+#include "recognize_various.h"
+#include "log.h"
+#include "word.h"
+#include "journal.h"
+#include "stats.h"
+
+// Each repetition runs enough iterations to take at least this long
+#define BENCH_MIN_TIME 20000000
+#define BENCH_MAX_ITERATIONS (1 << 24)
+#define BENCH_MAX_REPETITIONS 1000
+#define BENCH_MAX_KEYS 4096
+
+typedef struct bench {
+    char *name;
+    void (*fn)(uint32_t iterations);
+    // Needs a request body passed with -i
+    uint8_t needs_doc;
+} bench_t;
+
+int log_level = 2;
+
+// Keeps results alive so the compiler can't drop the benchmarked calls
+volatile uint64_t bench_sink;
+
+// Used when no request body is given
+uint8_t *default_text =
+        "Journal of Applied Physics 112, 043507 (2012); doi: 10.1063/1.4746795\n"
+        "Vol. 12, No. 4, pp. 1123-1140, ISSN 0021-8979, arXiv:1207.0123v2\n"
+        "Temperature dependence of the thermal conductivity of thin silicon membranes\n"
+        "John A. Smith, Maria Garcia-Lopez and Wei Zhang\n"
+        "Department of Physics, University of California, Berkeley, California 94720, USA\n"
+        "Abstract. We report measurements of the in-plane thermal conductivity of suspended "
+        "single-crystalline silicon membranes with thicknesses ranging from 9 to 1500 nm. "
+        "The thermal conductivity is reduced by up to an order of magnitude compared to bulk "
+        "silicon, which we attribute to phonon boundary scattering. A model based on the "
+        "Boltzmann transport equation reproduces the measured temperature dependence between "
+        "30 and 300 K without adjustable parameters. ISBN 978-3-16-148410-0\n"
+        "Keywords: thermal conductivity, phonons, silicon, membranes, nanostructures\n"
+        "I. INTRODUCTION\n"
+        "Heat conduction in semiconductor nanostructures has attracted considerable attention "
+        "because of its importance for thermal management in microelectronics and for "
+        "thermoelectric energy conversion. Received 12 April 2012; accepted 20 July 2012.\n";
+
+json_t *body;
+doc_t *doc;
+
+uint8_t text[MAX_LOOKUP_TEXT_LEN];
+uint32_t text_len;
+uint8_t processed_text[MAX_LOOKUP_TEXT_LEN];
+uint32_t processed_text_len;
+
+// Processed words, in text order
+uint8_t *words[BENCH_MAX_KEYS];
+uint32_t words_lens[BENCH_MAX_KEYS];
+uint32_t words_len;
+
+uint64_t word_hashes[BENCH_MAX_KEYS];
+uint64_t journal_hashes[BENCH_MAX_KEYS];
+uint32_t journal_hashes_len;
+
+// Title hashes and DOIs from doidata.sqlite (hits) mixed with ones from the text (mostly misses)
+uint64_t title_hashes[BENCH_MAX_KEYS];
+uint32_t title_hashes_len;
+uint8_t dois[BENCH_MAX_KEYS][DOI_LEN + 1];
+uint32_t dois_len;
+
+line_block_t *line_blocks;
+
+void bench_text_process(uint32_t iterations) {
+    uint8_t output[MAX_LOOKUP_TEXT_LEN];
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t output_len = MAX_LOOKUP_TEXT_LEN;
+        text_process(text, output, &output_len);
+        bench_sink += output_len;
+    }
+}
+
+void bench_text_char_len(uint32_t iterations) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        bench_sink += text_char_len(text);
+    }
+}
+
+void bench_text_hash64(uint32_t iterations) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t j = i % words_len;
+        bench_sink += text_hash64(words[j], words_lens[j]);
+    }
+}
+
+void bench_word_get(uint32_t iterations) {
+    uint32_t a, b, c;
+    for (uint32_t i = 0; i < iterations; i++) {
+        word_get(word_hashes[i % words_len], &a, &b, &c);
+        bench_sink += a + b + c;
+    }
+}
+
+void bench_journal_has(uint32_t iterations) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        bench_sink += journal_has(journal_hashes[i % journal_hashes_len]);
+    }
+}
+
+void bench_doidata_get(uint32_t iterations) {
+    doidata_t doidatas[11];
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t doidatas_len = 0;
+        doidata_get(title_hashes[i % title_hashes_len], doidatas, &doidatas_len);
+        bench_sink += doidatas_len;
+    }
+}
+
+void bench_doidata_has_doi(uint32_t iterations) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        bench_sink += doidata_has_doi(dois[i % dois_len]);
+    }
+}
+
+// An author missing from the text is the worst case, because the whole text is scanned
+void bench_find_author(uint32_t iterations) {
+    uint32_t author_hash = text_hash32("qqqqqqqqq", 9);
+    for (uint32_t i = 0; i < iterations; i++) {
+        bench_sink += find_author(processed_text, processed_text_len, author_hash, 9);
+    }
+}
+
+void bench_get_line_blocks(uint32_t iterations) {
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint32_t line_blocks_len = 0;
+        get_line_blocks(&doc->pages[i % doc->pages_len], line_blocks, &line_blocks_len);
+        bench_sink += line_blocks_len;
+    }
+}
+
+#define BENCH_EXTRACTOR(extractor, size) \
+void bench_##extractor(uint32_t iterations) { \
+    uint8_t output[size + 1]; \
+    for (uint32_t i = 0; i < iterations; i++) { \
+        *output = 0; \
+        bench_sink += extractor(text, output); \
+    } \
+}
+
+BENCH_EXTRACTOR(extract_doi, DOI_LEN)
+
+BENCH_EXTRACTOR(extract_isbn, ISBN_LEN)
+
+BENCH_EXTRACTOR(extract_arxiv, ARXIV_LEN)
+
+BENCH_EXTRACTOR(extract_issn, ISSN_LEN)
+
+BENCH_EXTRACTOR(extract_year, YEAR_LEN)
+
+BENCH_EXTRACTOR(extract_volume, VOLUME_LEN)
+
+BENCH_EXTRACTOR(extract_issue, ISSUE_LEN)
+
+BENCH_EXTRACTOR(extract_journal, CONTAINER_LEN)
+
+void bench_recognize(uint32_t iterations) {
+    res_metadata_t result;
+    for (uint32_t i = 0; i < iterations; i++) {
+        bench_sink += recognize(body, 0, &result);
+    }
+}
+
+bench_t benches[] = {
+        {"text_process",      bench_text_process,      0},
+        {"text_char_len",     bench_text_char_len,     0},
+        {"text_hash64",       bench_text_hash64,       0},
+        {"word_get",          bench_word_get,          0},
+        {"journal_has",       bench_journal_has,       0},
+        {"doidata_get",       bench_doidata_get,       0},
+        {"doidata_has_doi",   bench_doidata_has_doi,   0},
+        {"find_author",       bench_find_author,       0},
+        {"get_line_blocks",   bench_get_line_blocks,   1},
+        {"extract_doi",       bench_extract_doi,       0},
+        {"extract_isbn",      bench_extract_isbn,      0},
+        {"extract_arxiv",     bench_extract_arxiv,     0},
+        {"extract_issn",      bench_extract_issn,      0},
+        {"extract_year",      bench_extract_year,      0},
+        {"extract_volume",    bench_extract_volume,    0},
+        {"extract_issue",     bench_extract_issue,     0},
+        {"extract_journal",   bench_extract_journal,   0},
+        {"recognize",         bench_recognize,         1}
+};
+
+json_t *load_body(char *path) {
+    gzFile file = gzopen(path, "rb");
+    if (!file) return 0;
+
+    uint32_t data_len = 0;
+    uint32_t data_size = 1024 * 1024;
+    char *data = malloc(data_size);
+    int len;
+    while (data && (len = gzread(file, data + data_len, data_size - data_len)) > 0) {
+        data_len += len;
+        if (data_len == data_size) {
+            data_size *= 2;
+            data = realloc(data, data_size);
+        }
+    }
+    gzclose(file);
+    if (!data) return 0;
+
+    json_error_t error;
+    json_t *root = json_loadb(data, data_len, 0, &error);
+    free(data);
+
+    if (!root || !json_is_object(root)) {
+        if (root) json_decref(root);
+        return 0;
+    }
+    return root;
+}
+
+// Prepares benchmark inputs from the document text, the same way recognize() does
+uint32_t init_inputs(char *db_directory) {
+    if (doc) {
+        json_t *json_total_pages = json_object_get(body, "totalPages");
+        text_len = MAX_LOOKUP_TEXT_LEN;
+        doc_to_text(doc, text, &text_len, MAX_LOOKUP_TEXT_LEN - 1, json_integer_value(json_total_pages));
+    }
+
+    if (!text_len) {
+        text_len = strlen(default_text);
+        memcpy(text, default_text, text_len + 1);
+    }
+
+    processed_text_len = MAX_LOOKUP_TEXT_LEN;
+    text_process(text, processed_text, &processed_text_len);
+
+    // Words are processed one by one, like get_word_type() does for names
+    uint8_t *p = text;
+    while (*p && words_len < BENCH_MAX_KEYS) {
+        while (*p == ' ' || *p == '\n') p++;
+        if (!*p) break;
+        uint8_t *s = p;
+        while (*p && *p != ' ' && *p != '\n') p++;
+
+        uint8_t word[MAX_LOOKUP_TEXT_LEN];
+        uint8_t processed_word[MAX_LOOKUP_TEXT_LEN];
+        uint32_t processed_word_len = MAX_LOOKUP_TEXT_LEN;
+        memcpy(word, s, p - s);
+        word[p - s] = 0;
+        text_process(word, processed_word, &processed_word_len);
+        if (!processed_word_len) continue;
+
+        words[words_len] = malloc(processed_word_len + 1);
+        memcpy(words[words_len], processed_word, processed_word_len + 1);
+        words_lens[words_len] = processed_word_len;
+        word_hashes[words_len] = text_hash64(processed_word, processed_word_len);
+        words_len++;
+    }
+
+    if (!words_len) {
+        log_error("no words in the input text");
+        return 0;
+    }
+
+    // Windows of two to four words, like the journal name candidates in extract_journal()
+    for (uint32_t i = 0; i < words_len && journal_hashes_len < BENCH_MAX_KEYS; i++) {
+        uint8_t window[MAX_LOOKUP_TEXT_LEN];
+        uint32_t window_len = 0;
+        for (uint32_t j = i; j < words_len && j < i + 4 && journal_hashes_len < BENCH_MAX_KEYS; j++) {
+            if (window_len + words_lens[j] >= MAX_LOOKUP_TEXT_LEN) break;
+            memcpy(window + window_len, words[j], words_lens[j]);
+            window_len += words_lens[j];
+            if (j > i) journal_hashes[journal_hashes_len++] = text_hash64(window, window_len);
+        }
+    }
+
+    if (!journal_hashes_len) journal_hashes[journal_hashes_len++] = word_hashes[0];
+
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/doidata.sqlite", db_directory);
+
+    sqlite3 *sqlite;
+    sqlite3_stmt *stmt;
+    if (sqlite3_open_v2(path, &sqlite, SQLITE_OPEN_READONLY, 0) != SQLITE_OK) {
+        log_error("%s: %s", path, sqlite3_errmsg(sqlite));
+        return 0;
+    }
+
+    if (sqlite3_prepare_v2(sqlite, "SELECT title_hash, doi FROM doidata LIMIT ?", -1, &stmt, 0) == SQLITE_OK) {
+        sqlite3_bind_int(stmt, 1, BENCH_MAX_KEYS / 2);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            title_hashes[title_hashes_len++] = sqlite3_column_int64(stmt, 0);
+            const uint8_t *doi = sqlite3_column_text(stmt, 1);
+            if (doi && strlen(doi) <= DOI_LEN) strcpy(dois[dois_len++], doi);
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_close(sqlite);
+
+    // Title candidates of eight words, like the ones tried in title_to_doi()
+    for (uint32_t i = 0; i + 8 <= words_len && title_hashes_len < BENCH_MAX_KEYS; i += 8) {
+        uint8_t title[MAX_LOOKUP_TEXT_LEN];
+        uint32_t title_len = 0;
+        for (uint32_t j = i; j < i + 8 && title_len + words_lens[j] < MAX_LOOKUP_TEXT_LEN; j++) {
+            memcpy(title + title_len, words[j], words_lens[j]);
+            title_len += words_lens[j];
+        }
+        title_hashes[title_hashes_len++] = text_hash64(title, title_len);
+    }
+
+    if (dois_len < BENCH_MAX_KEYS) {
+        if (!extract_doi(text, dois[dois_len])) strcpy(dois[dois_len], "10.1000/missing");
+        dois_len++;
+    }
+
+    if (!title_hashes_len) title_hashes[title_hashes_len++] = word_hashes[0];
+
+    return 1;
+}
+
+void destroy_inputs() {
+    for (uint32_t i = 0; i < words_len; i++) {
+        free(words[i]);
+    }
+    if (doc) destroy_doc(doc);
+    if (body) json_decref(body);
+    free(line_blocks);
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+void run_bench(bench_t *bench, uint32_t warmups, uint32_t repetitions) {
+    // Calibrate the number of iterations so that each repetition takes at least BENCH_MIN_TIME
+    uint32_t iterations = 1;
+    while (iterations < BENCH_MAX_ITERATIONS) {
+        uint64_t t = stats_now();
+        bench->fn(iterations);
+        if (stats_now() - t >= BENCH_MIN_TIME) break;
+        iterations *= 2;
+    }
+
+    for (uint32_t i = 0; i < warmups; i++) {
+        bench->fn(iterations);
+    }
+
+    double samples[BENCH_MAX_REPETITIONS];
+    double sum = 0;
+    for (uint32_t i = 0; i < repetitions; i++) {
+        uint64_t t = stats_now();
+        bench->fn(iterations);
+        samples[i] = (double) (stats_now() - t) / iterations;
+        sum += samples[i];
+    }
+
+    qsort(samples, repetitions, sizeof(double), compare_doubles);
+
+    double mean = sum / repetitions;
+    double variance = 0;
+    for (uint32_t i = 0; i < repetitions; i++) {
+        variance += (samples[i] - mean) * (samples[i] - mean);
+    }
+    double stddev = repetitions > 1 ? sqrt(variance / (repetitions - 1)) : 0;
+    double median = repetitions % 2 ? samples[repetitions / 2] :
+                    (samples[repetitions / 2 - 1] + samples[repetitions / 2]) / 2;
+
+    printf("%-20s %12u %14.1f %14.1f %14.1f %10.1f\n",
+           bench->name, iterations, samples[0], median, mean, stddev);
+    fflush(stdout);
+}
+
+void print_usage() {
+    printf(
+            "Missing parameters.\n" \
+            "-d\tdata directory\n" \
+            "-i\trequest body used as input (optionally gzipped)\n" \
+            "-f\tonly run benchmarks whose name contains this string\n" \
+            "-w\twarm-up repetitions (default 2)\n" \
+            "-r\trepetitions (default 10)\n" \
+            "-l\tlog level\n" \
+            "Usage example:\n" \
+            "recognizer-bench -d /var/db -i body.json -r 20\n"
+    );
+}
+
+int main(int argc, char **argv) {
+    char *opt_db_directory = 0;
+    char *opt_input = 0;
+    char *opt_filter = 0;
+    uint32_t opt_warmups = 2;
+    uint32_t opt_repetitions = 10;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:f:w:r:l:")) != -1) {
+        switch (opt) {
+            case 'd':
+                opt_db_directory = optarg;
+                break;
+            case 'i':
+                opt_input = optarg;
+                break;
+            case 'f':
+                opt_filter = optarg;
+                break;
+            case 'w':
+                opt_warmups = strtoul(optarg, 0, 10);
+                break;
+            case 'r':
+                opt_repetitions = strtoul(optarg, 0, 10);
+                break;
+            case 'l':
+                if (optarg) {
+                    log_level = strtol(optarg, 0, 10);
+                }
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!opt_db_directory || !opt_repetitions || opt_repetitions > BENCH_MAX_REPETITIONS) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (!text_init()) {
+        log_error("failed to initialize text processor");
+        return EXIT_FAILURE;
+    }
+
+    if (!journal_init(opt_db_directory)) {
+        log_error("failed to initialize journal data");
+        return EXIT_FAILURE;
+    }
+
+    if (!word_init(opt_db_directory)) {
+        log_error("failed to initialize word data");
+        return EXIT_FAILURE;
+    }
+
+    if (!doidata_init(opt_db_directory)) {
+        log_error("failed to initialize doidata");
+        return EXIT_FAILURE;
+    }
+
+    if (opt_input) {
+        body = load_body(opt_input);
+        if (!body) {
+            log_error("failed to load %s", opt_input);
+            return EXIT_FAILURE;
+        }
+
+        doc = get_doc(body);
+        if (!doc || !doc->pages_len) {
+            log_error("no pages in %s", opt_input);
+            return EXIT_FAILURE;
+        }
+    }
+
+    line_blocks = malloc(sizeof(line_block_t) * MAX_LINE_BLOCKS);
+    if (!line_blocks) return EXIT_FAILURE;
+
+    if (!init_inputs(opt_db_directory)) {
+        log_error("failed to prepare inputs");
+        return EXIT_FAILURE;
+    }
+
+    printf("%u bytes of text, %u words, %u title hashes, %u DOIs\n",
+           text_len, words_len, title_hashes_len, dois_len);
+    printf("%-20s %12s %14s %14s %14s %10s\n",
+           "benchmark", "iterations", "min ns/op", "median ns/op", "mean ns/op", "stddev");
+
+    for (uint32_t i = 0; i < sizeof(benches) / sizeof(bench_t); i++) {
+        bench_t *bench = &benches[i];
+        if (opt_filter && !strstr(bench->name, opt_filter)) continue;
+        if (bench->needs_doc && !doc) continue;
+        run_bench(bench, opt_warmups, opt_repetitions);
+    }
+
+    destroy_inputs();
+
+    if (!doidata_close()) {
+        log_error("doidata close failed");
+    }
+
+    return EXIT_SUCCESS;
+}
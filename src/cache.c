@@ -0,0 +1,534 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+#include <jemalloc/jemalloc.h>
+#include "xxhash.h"
+#include "log.h"
+#include "stats.h"
+#include "result.h"
+#include "cache.h"
+
+// Results are cached by the hash of the decompressed request body. Identical
+// uploads skip parsing and recognition, which dominate the request time.
+// The memory tier is split into shards, each with its own lock and LRU list
+#define CACHE_SHARDS 16
+#define CACHE_MIN_BUCKETS 1024
+// Disk writes waiting for the writer thread, beyond which new results aren't written to disk
+#define CACHE_MAX_PENDING 4096
+// Bumped when the table changes, which drops the old table
+#define CACHE_SCHEMA_VERSION 2
+
+typedef struct cache_entry {
+    uint64_t hash;
+    // Next entry in the same bucket
+    struct cache_entry *chain;
+    // LRU list, most recently used first
+    struct cache_entry *prev;
+    struct cache_entry *next;
+    uint32_t data_len;
+    uint8_t data[];
+} cache_entry_t;
+
+// Packed result waiting to be written to disk
+typedef struct cache_write {
+    uint64_t hash;
+    struct cache_write *next;
+    uint32_t data_len;
+    uint8_t data[];
+} cache_write_t;
+
+typedef struct cache_shard {
+    pthread_mutex_t mutex;
+    cache_entry_t **buckets;
+    uint32_t buckets_len;
+    uint32_t entries_len;
+    uint64_t size;
+    cache_entry_t *head;
+    cache_entry_t *tail;
+} cache_shard_t;
+
+cache_shard_t cache_shards[CACHE_SHARDS];
+uint64_t cache_shard_max_size = 0;
+
+// Mixed into every hash, so results from other builds or data files are never used
+uint64_t cache_seed = 0;
+
+// Optional persistent tier. Requests only read from it, and results are written
+// in batches by the writer thread over its own connection, so a slow disk never
+// holds up a request. The table keeps at most cache_db_max_entries, and the
+// oldest entries are evicted first
+pthread_mutex_t cache_db_mutex = PTHREAD_MUTEX_INITIALIZER;
+sqlite3 *cache_db = 0;
+sqlite3_stmt *cache_get_stmt = 0;
+
+sqlite3 *cache_write_db = 0;
+sqlite3_stmt *cache_put_stmt = 0;
+sqlite3_stmt *cache_evict_stmt = 0;
+uint64_t cache_db_entries = 0;
+uint64_t cache_db_max_entries = 0;
+// Order of insertion, which eviction follows
+int64_t cache_db_seq = 0;
+
+// Writes waiting for the writer thread, in arrival order
+pthread_mutex_t cache_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cache_write_cond = PTHREAD_COND_INITIALIZER;
+cache_write_t *cache_write_head = 0;
+cache_write_t *cache_write_tail = 0;
+uint32_t cache_write_len = 0;
+uint8_t cache_write_stop = 0;
+pthread_t cache_write_thread;
+
+uint64_t cache_get_seed(char *db_directory) {
+    char path[PATH_MAX];
+    char *files[] = {"word.dat", "journal.dat", "doidata.sqlite"};
+    char buf[512];
+    uint32_t buf_len = 0;
+
+    // The executable itself, and the data files
+    for (uint32_t i = 0; i < 4; i++) {
+        if (!i) snprintf(path, sizeof(path), "/proc/self/exe");
+        else snprintf(path, sizeof(path), "%s/%s", db_directory, files[i - 1]);
+        struct stat st = {0};
+        stat(path, &st);
+        buf_len += snprintf(buf + buf_len, sizeof(buf) - buf_len, "%ld %ld ",
+                            (long) st.st_size, (long) st.st_mtime);
+    }
+
+    return XXH64(buf, buf_len, 0);
+}
+
+uint32_t cache_exec(sqlite3 *db, char *sql) {
+    char *err_msg = 0;
+    int rc = sqlite3_exec(db, sql, 0, 0, &err_msg);
+    if (rc != SQLITE_OK) {
+        log_error("%s (%d): %s", sql, rc, err_msg);
+        sqlite3_free(err_msg);
+        return 0;
+    }
+    return 1;
+}
+
+// Returns the first column of the first row, or -1
+int64_t cache_query_integer(sqlite3 *db, char *sql) {
+    sqlite3_stmt *stmt;
+    int64_t value = -1;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        log_error("%s: %s", sql, sqlite3_errmsg(db));
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+uint32_t cache_prepare(sqlite3 *db, char *sql, sqlite3_stmt **stmt) {
+    int rc = sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
+    if (rc != SQLITE_OK) {
+        log_error("%s (%i): %s", sql, rc, sqlite3_errmsg(db));
+        return 0;
+    }
+    return 1;
+}
+
+// Opens the writer's connection, and creates or cleans up the table
+uint32_t cache_open_write_db(char *path) {
+    int rc;
+
+    if ((rc = sqlite3_open(path, &cache_write_db)) != SQLITE_OK) {
+        log_error("%s (%d): %s", path, rc, sqlite3_errmsg(cache_write_db));
+        return 0;
+    }
+
+    // Losing the latest entries on a crash is fine for a cache
+    if (!cache_exec(cache_write_db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = OFF;")) return 0;
+
+    if (cache_query_integer(cache_write_db, "PRAGMA user_version") != CACHE_SCHEMA_VERSION) {
+        char sql[128];
+        snprintf(sql, sizeof(sql), "DROP TABLE IF EXISTS cache; PRAGMA user_version = %d;", CACHE_SCHEMA_VERSION);
+        if (!cache_exec(cache_write_db, sql)) return 0;
+    }
+
+    if (!cache_exec(cache_write_db,
+                    "CREATE TABLE IF NOT EXISTS cache (hash INTEGER PRIMARY KEY, seed INTEGER, seq INTEGER, data BLOB);"
+                    "CREATE INDEX IF NOT EXISTS cache_seq ON cache (seq);")) {
+        return 0;
+    }
+
+    char delete_sql[128];
+    snprintf(delete_sql, sizeof(delete_sql), "DELETE FROM cache WHERE seed != %lld", (long long) cache_seed);
+    if (!cache_exec(cache_write_db, delete_sql)) return 0;
+
+    int64_t entries = cache_query_integer(cache_write_db, "SELECT COUNT(*) FROM cache");
+    if (entries < 0) return 0;
+    cache_db_entries = entries;
+    cache_db_seq = cache_query_integer(cache_write_db, "SELECT IFNULL(MAX(seq), 0) FROM cache");
+
+    // Entries with the same hash have the same result, so an existing one is kept as is
+    if (!cache_prepare(cache_write_db, "INSERT OR IGNORE INTO cache (hash, seed, seq, data) VALUES (?, ?, ?, ?)",
+                       &cache_put_stmt)) {
+        return 0;
+    }
+
+    if (!cache_prepare(cache_write_db, "DELETE FROM cache WHERE hash IN (SELECT hash FROM cache ORDER BY seq LIMIT ?)",
+                       &cache_evict_stmt)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+uint32_t cache_open_db(char *path) {
+    int rc;
+
+    if (!cache_open_write_db(path)) return 0;
+
+    if ((rc = sqlite3_open(path, &cache_db)) != SQLITE_OK) {
+        log_error("%s (%d): %s", path, rc, sqlite3_errmsg(cache_db));
+        return 0;
+    }
+
+    return cache_prepare(cache_db, "SELECT data FROM cache WHERE hash = ?", &cache_get_stmt);
+}
+
+// Writes the queued results in one transaction, and evicts the oldest entries over the limit
+void cache_write_batch(cache_write_t *write) {
+    cache_exec(cache_write_db, "BEGIN");
+
+    while (write) {
+        sqlite3_bind_int64(cache_put_stmt, 1, (int64_t) write->hash);
+        sqlite3_bind_int64(cache_put_stmt, 2, (int64_t) cache_seed);
+        sqlite3_bind_int64(cache_put_stmt, 3, ++cache_db_seq);
+        sqlite3_bind_blob(cache_put_stmt, 4, write->data, write->data_len, SQLITE_STATIC);
+        int rc = sqlite3_step(cache_put_stmt);
+        if (rc == SQLITE_DONE) {
+            cache_db_entries += sqlite3_changes(cache_write_db);
+        } else {
+            log_error("(%i): %s", rc, sqlite3_errmsg(cache_write_db));
+        }
+        sqlite3_reset(cache_put_stmt);
+
+        cache_write_t *next = write->next;
+        free(write);
+        write = next;
+    }
+
+    if (cache_db_entries > cache_db_max_entries) {
+        sqlite3_bind_int64(cache_evict_stmt, 1, (int64_t) (cache_db_entries - cache_db_max_entries));
+        int rc = sqlite3_step(cache_evict_stmt);
+        if (rc == SQLITE_DONE) {
+            cache_db_entries -= sqlite3_changes(cache_write_db);
+        } else {
+            log_error("(%i): %s", rc, sqlite3_errmsg(cache_write_db));
+        }
+        sqlite3_reset(cache_evict_stmt);
+    }
+
+    cache_exec(cache_write_db, "COMMIT");
+}
+
+// Takes everything queued at once, so writes that arrive while a batch is
+// committed go out together in the next one
+void *cache_writer(void *arg) {
+    pthread_mutex_lock(&cache_write_mutex);
+
+    while (1) {
+        while (!cache_write_head && !cache_write_stop) {
+            pthread_cond_wait(&cache_write_cond, &cache_write_mutex);
+        }
+        // Stops only once everything queued is written
+        if (!cache_write_head) break;
+
+        cache_write_t *write = cache_write_head;
+        cache_write_head = cache_write_tail = 0;
+        cache_write_len = 0;
+        pthread_mutex_unlock(&cache_write_mutex);
+
+        cache_write_batch(write);
+
+        pthread_mutex_lock(&cache_write_mutex);
+    }
+
+    pthread_mutex_unlock(&cache_write_mutex);
+    return 0;
+}
+
+uint32_t cache_start_writer() {
+    // Shutdown signals must not interrupt the writer while it holds the database
+    sigset_t set, old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    int err = pthread_create(&cache_write_thread, 0, cache_writer, 0);
+    pthread_sigmask(SIG_SETMASK, &old_set, 0);
+    return !err;
+}
+
+// A zero max_size disables the memory tier, and a zero path the disk tier,
+// which keeps at most max_entries results
+uint32_t cache_init(uint64_t max_size, char *path, uint64_t max_entries, char *db_directory) {
+    cache_seed = cache_get_seed(db_directory);
+    cache_shard_max_size = max_size / CACHE_SHARDS;
+
+    for (uint32_t i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache_shards[i];
+        memset(shard, 0, sizeof(cache_shard_t));
+        pthread_mutex_init(&shard->mutex, 0);
+        if (!cache_shard_max_size) continue;
+
+        shard->buckets_len = CACHE_MIN_BUCKETS;
+        shard->buckets = calloc(shard->buckets_len, sizeof(cache_entry_t *));
+        if (!shard->buckets) return 0;
+    }
+
+    if (!path) return 1;
+
+    cache_db_max_entries = max_entries;
+    if (!cache_open_db(path)) return 0;
+    if (!cache_start_writer()) {
+        log_error("failed to start cache writer");
+        return 0;
+    }
+    return 1;
+}
+
+uint32_t cache_is_enabled() {
+    return cache_shard_max_size || cache_db;
+}
+
+uint64_t cache_get_hash(const char *data, uint32_t data_len) {
+    return XXH64(data, data_len, cache_seed);
+}
+
+cache_shard_t *cache_get_shard(uint64_t hash) {
+    // Buckets use the low bits
+    return &cache_shards[hash >> 60];
+}
+
+cache_entry_t **cache_find(cache_shard_t *shard, uint64_t hash) {
+    cache_entry_t **entry = &shard->buckets[hash & (shard->buckets_len - 1)];
+    while (*entry && (*entry)->hash != hash) entry = &(*entry)->chain;
+    return entry;
+}
+
+void cache_unlink(cache_shard_t *shard, cache_entry_t *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else shard->head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else shard->tail = entry->prev;
+}
+
+void cache_push_front(cache_shard_t *shard, cache_entry_t *entry) {
+    entry->prev = 0;
+    entry->next = shard->head;
+    if (shard->head) shard->head->prev = entry;
+    shard->head = entry;
+    if (!shard->tail) shard->tail = entry;
+}
+
+void cache_remove(cache_shard_t *shard, cache_entry_t *entry) {
+    *cache_find(shard, entry->hash) = entry->chain;
+    cache_unlink(shard, entry);
+    shard->entries_len--;
+    shard->size -= sizeof(cache_entry_t) + entry->data_len;
+    stats_gauge_add(STATS_CACHE_ENTRIES, -1);
+    stats_gauge_add(STATS_CACHE_BYTES, -(int64_t) (sizeof(cache_entry_t) + entry->data_len));
+    free(entry);
+}
+
+void cache_grow(cache_shard_t *shard) {
+    uint32_t buckets_len = shard->buckets_len * 2;
+    cache_entry_t **buckets = calloc(buckets_len, sizeof(cache_entry_t *));
+    if (!buckets) return;
+
+    for (uint32_t i = 0; i < shard->buckets_len; i++) {
+        cache_entry_t *entry = shard->buckets[i];
+        while (entry) {
+            cache_entry_t *chain = entry->chain;
+            uint32_t j = entry->hash & (buckets_len - 1);
+            entry->chain = buckets[j];
+            buckets[j] = entry;
+            entry = chain;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->buckets_len = buckets_len;
+}
+
+void cache_put_memory(uint64_t hash, uint8_t *data, uint32_t data_len) {
+    if (!cache_shard_max_size) return;
+
+    uint32_t entry_size = sizeof(cache_entry_t) + data_len;
+    if (entry_size > cache_shard_max_size) return;
+
+    cache_entry_t *entry = malloc(entry_size);
+    if (!entry) return;
+    entry->hash = hash;
+    entry->chain = 0;
+    entry->data_len = data_len;
+    memcpy(entry->data, data, data_len);
+
+    cache_shard_t *shard = cache_get_shard(hash);
+    pthread_mutex_lock(&shard->mutex);
+
+    cache_entry_t *existing = *cache_find(shard, hash);
+    if (existing) cache_remove(shard, existing);
+
+    while (shard->tail && shard->size + entry_size > cache_shard_max_size) {
+        cache_remove(shard, shard->tail);
+    }
+
+    if (shard->entries_len >= shard->buckets_len) cache_grow(shard);
+
+    cache_entry_t **slot = cache_find(shard, hash);
+    *slot = entry;
+    cache_push_front(shard, entry);
+    shard->entries_len++;
+    shard->size += entry_size;
+
+    pthread_mutex_unlock(&shard->mutex);
+
+    stats_gauge_add(STATS_CACHE_ENTRIES, 1);
+    stats_gauge_add(STATS_CACHE_BYTES, entry_size);
+}
+
+uint32_t cache_get_memory(uint64_t hash, res_metadata_t *result) {
+    if (!cache_shard_max_size) return 0;
+
+    cache_shard_t *shard = cache_get_shard(hash);
+    pthread_mutex_lock(&shard->mutex);
+
+    uint32_t ret = 0;
+    cache_entry_t *entry = *cache_find(shard, hash);
+    if (entry) {
+        cache_unlink(shard, entry);
+        cache_push_front(shard, entry);
+        ret = result_unpack(entry->data, entry->data_len, result);
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+    return ret;
+}
+
+uint32_t cache_get_disk(uint64_t hash, res_metadata_t *result) {
+    if (!cache_db) return 0;
+
+    uint32_t ret = 0;
+    pthread_mutex_lock(&cache_db_mutex);
+
+    sqlite3_bind_int64(cache_get_stmt, 1, (int64_t) hash);
+    if (sqlite3_step(cache_get_stmt) == SQLITE_ROW) {
+        uint8_t *data = (uint8_t *) sqlite3_column_blob(cache_get_stmt, 0);
+        uint32_t data_len = sqlite3_column_bytes(cache_get_stmt, 0);
+        if (data && result_unpack(data, data_len, result)) {
+            cache_put_memory(hash, data, data_len);
+            ret = 1;
+        }
+    }
+    sqlite3_reset(cache_get_stmt);
+
+    pthread_mutex_unlock(&cache_db_mutex);
+    return ret;
+}
+
+// Returns 1 and fills the result on a hit
+uint32_t cache_get(uint64_t hash, res_metadata_t *result) {
+    if (cache_get_memory(hash, result)) {
+        stats_count(STATS_CACHE_HITS, 1);
+        return 1;
+    }
+
+    if (cache_get_disk(hash, result)) {
+        stats_count(STATS_CACHE_HITS, 1);
+        stats_count(STATS_CACHE_DISK_HITS, 1);
+        return 1;
+    }
+
+    stats_count(STATS_CACHE_MISSES, 1);
+    return 0;
+}
+
+void cache_put(uint64_t hash, res_metadata_t *result) {
+    uint8_t data[sizeof(res_metadata_t)];
+    uint32_t data_len = result_pack(result, data, sizeof(data));
+    if (!data_len) return;
+
+    cache_put_memory(hash, data, data_len);
+
+    if (!cache_db) return;
+
+    cache_write_t *write = malloc(sizeof(cache_write_t) + data_len);
+    if (!write) return;
+    write->hash = hash;
+    write->next = 0;
+    write->data_len = data_len;
+    memcpy(write->data, data, data_len);
+
+    pthread_mutex_lock(&cache_write_mutex);
+    // When the disk can't keep up, results are only kept in memory
+    if (cache_write_len >= CACHE_MAX_PENDING) {
+        pthread_mutex_unlock(&cache_write_mutex);
+        free(write);
+        return;
+    }
+    if (cache_write_tail) cache_write_tail->next = write;
+    else cache_write_head = write;
+    cache_write_tail = write;
+    cache_write_len++;
+    pthread_cond_signal(&cache_write_cond);
+    pthread_mutex_unlock(&cache_write_mutex);
+}
+
+// Writes out the queued results before closing
+uint32_t cache_close() {
+    if (!cache_db) return 1;
+
+    pthread_mutex_lock(&cache_write_mutex);
+    cache_write_stop = 1;
+    pthread_cond_signal(&cache_write_cond);
+    pthread_mutex_unlock(&cache_write_mutex);
+    pthread_join(cache_write_thread, 0);
+
+    sqlite3_finalize(cache_put_stmt);
+    sqlite3_finalize(cache_evict_stmt);
+    int write_rc = sqlite3_close(cache_write_db);
+    cache_write_db = 0;
+
+    pthread_mutex_lock(&cache_db_mutex);
+    sqlite3_finalize(cache_get_stmt);
+    int rc = sqlite3_close(cache_db);
+    cache_db = 0;
+    pthread_mutex_unlock(&cache_db_mutex);
+
+    return rc == SQLITE_OK && write_rc == SQLITE_OK;
+}
@@ -0,0 +1,19 @@
+#ifndef RECOGNIZER_SERVER_CACHE_H
+#define RECOGNIZER_SERVER_CACHE_H
+
+#include <stdint.h>
+#include "recognize.h"
+
+uint32_t cache_init(uint64_t max_size, char *path, uint64_t max_entries, char *db_directory);
+
+uint32_t cache_is_enabled();
+
+uint64_t cache_get_hash(const char *data, uint32_t data_len);
+
+uint32_t cache_get(uint64_t hash, res_metadata_t *result);
+
+void cache_put(uint64_t hash, res_metadata_t *result);
+
+uint32_t cache_close();
+
+#endif //RECOGNIZER_SERVER_CACHE_H
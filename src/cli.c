@@ -0,0 +1,467 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <jansson.h>
+#include <zlib.h>
+#include <jemalloc/jemalloc.h>
+#include "doidata.h"
+#include "text.h"
+#include "recognize.h"
+#include "log.h"
+#include "word.h"
+#include "journal.h"
+#include "stats.h"
+#include "result.h"
+#include "golden.h"
+#include "writer.h"
+
+// recognize() keeps several large line block arrays on the stack
+#define CLI_STACK_SIZE (16 * 1024 * 1024)
+
+typedef struct cli_input {
+    pthread_mutex_t mutex;
+    // JSONL mode: one request body per line
+    gzFile file;
+    uint64_t line_i;
+    // Directory mode: one request body per file
+    char *dir;
+    struct dirent **entries;
+    int entries_len;
+    int entries_i;
+    // Number of items read so far
+    uint32_t items_len;
+} cli_input_t;
+
+typedef struct cli_item {
+    char *data;
+    uint32_t data_len;
+    uint32_t data_size;
+    json_t *id;
+    // Position in the input
+    uint32_t seq;
+} cli_item_t;
+
+typedef struct cli_worker {
+    pthread_t thread;
+    uint64_t *latencies;
+    uint32_t latencies_len;
+    uint32_t latencies_size;
+    uint32_t errors;
+} cli_worker_t;
+
+int log_level = 1;
+
+cli_input_t input = {PTHREAD_MUTEX_INITIALIZER};
+pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+FILE *output;
+char *opt_golden_write = 0;
+char *opt_golden_check = 0;
+
+uint32_t item_reserve(cli_item_t *item, uint32_t size) {
+    if (item->data_size >= size) return 1;
+    uint32_t data_size = item->data_size ? item->data_size : 65536;
+    while (data_size < size) data_size *= 2;
+    char *data = realloc(item->data, data_size);
+    if (!data) return 0;
+    item->data = data;
+    item->data_size = data_size;
+    return 1;
+}
+
+// Reads a line without the trailing newline. Returns 0 at the end of the file
+uint32_t read_line(gzFile file, cli_item_t *item) {
+    item->data_len = 0;
+    while (1) {
+        if (!item_reserve(item, item->data_len + 4096)) return 0;
+        if (!gzgets(file, item->data + item->data_len, item->data_size - item->data_len)) {
+            return item->data_len > 0;
+        }
+        item->data_len += strlen(item->data + item->data_len);
+        if (item->data_len && item->data[item->data_len - 1] == '\n') {
+            item->data[--item->data_len] = 0;
+            return 1;
+        }
+    }
+}
+
+uint32_t read_file(char *path, cli_item_t *item) {
+    gzFile file = gzopen(path, "rb");
+    if (!file) return 0;
+
+    item->data_len = 0;
+    while (1) {
+        if (!item_reserve(item, item->data_len + 65536)) {
+            gzclose(file);
+            return 0;
+        }
+        int len = gzread(file, item->data + item->data_len, item->data_size - item->data_len - 1);
+        if (len < 0) {
+            gzclose(file);
+            return 0;
+        }
+        if (!len) break;
+        item->data_len += len;
+    }
+    item->data[item->data_len] = 0;
+    gzclose(file);
+    return 1;
+}
+
+int filter_entry(const struct dirent *entry) {
+    return entry->d_name[0] != '.';
+}
+
+uint32_t input_open(char *path) {
+    struct stat st;
+    if (stat(path, &st)) return 0;
+
+    if (S_ISDIR(st.st_mode)) {
+        input.dir = path;
+        input.entries_len = scandir(path, &input.entries, filter_entry, alphasort);
+        return input.entries_len >= 0;
+    }
+
+    // zlib transparently reads uncompressed files too
+    input.file = gzopen(path, "rb");
+    if (!input.file) return 0;
+    gzbuffer(input.file, 1024 * 1024);
+    return 1;
+}
+
+void input_close() {
+    if (input.file) gzclose(input.file);
+    for (int i = 0; i < input.entries_len; i++) {
+        free(input.entries[i]);
+    }
+    free(input.entries);
+}
+
+// Reads the next request body into item. Returns 0 when the input is exhausted
+uint32_t input_next(cli_item_t *item) {
+    uint32_t rc = 0;
+    pthread_mutex_lock(&input.mutex);
+
+    if (input.file) {
+        while (read_line(input.file, item)) {
+            input.line_i++;
+            // Skip empty lines
+            if (!item->data_len) continue;
+            item->id = json_integer(input.line_i);
+            rc = 1;
+            break;
+        }
+    } else {
+        while (input.entries_i < input.entries_len) {
+            char path[PATH_MAX];
+            char *name = input.entries[input.entries_i++]->d_name;
+            snprintf(path, PATH_MAX, "%s/%s", input.dir, name);
+            if (!read_file(path, item)) {
+                log_error("failed to read %s", path);
+                continue;
+            }
+            item->id = json_string(name);
+            rc = 1;
+            break;
+        }
+    }
+
+    if (rc) item->seq = input.items_len++;
+
+    pthread_mutex_unlock(&input.mutex);
+    return rc;
+}
+
+uint32_t add_latency(cli_worker_t *worker, uint64_t latency) {
+    if (worker->latencies_len == worker->latencies_size) {
+        uint32_t latencies_size = worker->latencies_size ? worker->latencies_size * 2 : 1024;
+        uint64_t *latencies = realloc(worker->latencies, sizeof(uint64_t) * latencies_size);
+        if (!latencies) return 0;
+        worker->latencies = latencies;
+        worker->latencies_size = latencies_size;
+    }
+    worker->latencies[worker->latencies_len++] = latency;
+    return 1;
+}
+
+void write_result(writer_t *writer) {
+    if (!output || writer->failed) return;
+    pthread_mutex_lock(&output_mutex);
+    fwrite(writer->data, 1, writer->len, output);
+    fputc('\n', output);
+    pthread_mutex_unlock(&output_mutex);
+}
+
+void process_golden(cli_item_t *item, res_metadata_t *result, cli_worker_t *worker) {
+    if (opt_golden_write && !golden_add(item->seq, item->id, result)) {
+        log_error("failed to add golden result");
+    }
+    if (opt_golden_check) golden_check(item->id, result);
+}
+
+void *worker_thread(void *arg) {
+    cli_worker_t *worker = arg;
+    cli_item_t item = {0};
+
+    while (input_next(&item)) {
+        writer_t *writer = writer_get_thread(0);
+        if (!writer) break;
+
+        writer_begin_object(writer);
+        writer_key(writer, "id");
+        writer_json(writer, item.id);
+
+        uint64_t t = stats_now();
+
+        json_error_t error;
+        json_t *root = json_loadb(item.data, item.data_len, 0, &error);
+        if (!root || !json_is_object(root)) {
+            if (root) json_decref(root);
+            worker->errors++;
+            writer_key(writer, "error");
+            writer_string(writer, "invalid json", strlen("invalid json"));
+            writer_end_object(writer);
+            write_result(writer);
+            // Invalid bodies are golden as an empty result
+            res_metadata_t result = {0};
+            process_golden(&item, &result, worker);
+            json_decref(item.id);
+            continue;
+        }
+
+        res_metadata_t result = {0};
+        recognize(root, 0, &result);
+        json_decref(root);
+
+        uint64_t latency = stats_now() - t;
+        add_latency(worker, latency);
+
+        writer_key(writer, "time");
+        writer_integer(writer, latency / 1000);
+        result_write(&result, FIELDS_ALL, writer);
+        writer_end_object(writer);
+        write_result(writer);
+        process_golden(&item, &result, worker);
+        json_decref(item.id);
+    }
+
+    free(item.data);
+    return 0;
+}
+
+void print_summary(cli_worker_t *workers, uint32_t workers_len, uint64_t elapsed) {
+    uint32_t latencies_len = 0;
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < workers_len; i++) {
+        latencies_len += workers[i].latencies_len;
+        errors += workers[i].errors;
+    }
+
+    uint64_t *latencies = malloc(sizeof(uint64_t) * (latencies_len + 1));
+    if (!latencies) return;
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < workers_len; i++) {
+        memcpy(latencies + n, workers[i].latencies, sizeof(uint64_t) * workers[i].latencies_len);
+        n += workers[i].latencies_len;
+    }
+    stats_sort_latencies(latencies, latencies_len);
+
+    double seconds = elapsed / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(stderr, "documents:   %u (%u errors)\n", latencies_len + errors, errors);
+    fprintf(stderr, "threads:     %u\n", workers_len);
+    fprintf(stderr, "elapsed:     %.3f s\n", seconds);
+    fprintf(stderr, "throughput:  %.1f docs/s\n", seconds > 0 ? latencies_len / seconds : 0);
+    fprintf(stderr, "latency:     p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            stats_get_percentile(latencies, latencies_len, 0.50) / 1e6,
+            stats_get_percentile(latencies, latencies_len, 0.95) / 1e6,
+            stats_get_percentile(latencies, latencies_len, 0.99) / 1e6,
+            latencies_len ? latencies[latencies_len - 1] / 1e6 : 0);
+    // ru_maxrss is in kilobytes on Linux
+    fprintf(stderr, "peak rss:    %.1f MB\n", usage.ru_maxrss / 1024.0);
+
+    free(latencies);
+}
+
+void print_usage() {
+    printf(
+            "Missing parameters.\n" \
+            "-d\tdata directory\n" \
+            "-i\tinput JSONL file or directory with one request body per file (optionally gzipped)\n" \
+            "-o\toutput JSONL file (default stdout)\n" \
+            "-t\tworker threads (default number of CPUs)\n" \
+            "-g\twrite golden results to this file\n" \
+            "-c\tcompare with golden results in this file, and fail on any difference\n" \
+            "-l\tlog level\n" \
+            "Usage example:\n" \
+            "recognizer-cli -d /var/db -i requests.jsonl -o results.jsonl -t 8\n" \
+            "recognizer-cli -d /var/db -i requests.jsonl -c golden.jsonl\n"
+    );
+}
+
+int main(int argc, char **argv) {
+    char *opt_db_directory = 0;
+    char *opt_input = 0;
+    char *opt_output = 0;
+    uint32_t opt_threads = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:o:t:g:c:l:")) != -1) {
+        switch (opt) {
+            case 'd':
+                opt_db_directory = optarg;
+                break;
+            case 'i':
+                opt_input = optarg;
+                break;
+            case 'o':
+                opt_output = optarg;
+                break;
+            case 't':
+                opt_threads = strtoul(optarg, 0, 10);
+                break;
+            case 'g':
+                opt_golden_write = optarg;
+                break;
+            case 'c':
+                opt_golden_check = optarg;
+                break;
+            case 'l':
+                if (optarg) {
+                    log_level = strtol(optarg, 0, 10);
+                }
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!opt_db_directory || !opt_input) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (!opt_threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opt_threads = cpus > 0 ? cpus : 1;
+    }
+
+    if (!text_init()) {
+        log_error("failed to initialize text processor");
+        return EXIT_FAILURE;
+    }
+
+    log_info("initializing journals");
+    if (!journal_init(opt_db_directory)) {
+        log_error("failed to initialize journal data");
+        return EXIT_FAILURE;
+    }
+
+    log_info("initializing words");
+    if (!word_init(opt_db_directory)) {
+        log_error("failed to initialize word data");
+        return EXIT_FAILURE;
+    }
+
+    log_info("initializing doidata");
+    if (!doidata_init(opt_db_directory)) {
+        log_error("failed to initialize doidata");
+        return EXIT_FAILURE;
+    }
+
+    if (!input_open(opt_input)) {
+        log_error("failed to open input %s", opt_input);
+        return EXIT_FAILURE;
+    }
+
+    if (opt_golden_check && !golden_load(opt_golden_check)) {
+        return EXIT_FAILURE;
+    }
+
+    // Results go to stdout unless only golden results were asked for
+    output = opt_output ? fopen(opt_output, "w") :
+             opt_golden_write || opt_golden_check ? 0 : stdout;
+    if (opt_output && !output) {
+        log_error("failed to open output %s", opt_output);
+        return EXIT_FAILURE;
+    }
+
+    cli_worker_t *workers = calloc(opt_threads, sizeof(cli_worker_t));
+    if (!workers) return EXIT_FAILURE;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CLI_STACK_SIZE);
+
+    uint64_t t = stats_now();
+
+    uint32_t workers_len = 0;
+    for (; workers_len < opt_threads; workers_len++) {
+        if (pthread_create(&workers[workers_len].thread, &attr, worker_thread, &workers[workers_len])) {
+            log_error("failed to create worker thread");
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < workers_len; i++) {
+        pthread_join(workers[i].thread, 0);
+    }
+
+    uint64_t elapsed = stats_now() - t;
+
+    pthread_attr_destroy(&attr);
+
+    if (output && output != stdout) fclose(output);
+    else if (output) fflush(output);
+
+    print_summary(workers, workers_len, elapsed);
+
+    uint32_t golden_failures = 0;
+    if (opt_golden_write && !golden_write(opt_golden_write)) golden_failures++;
+    if (opt_golden_check) golden_failures += golden_finish();
+
+    for (uint32_t i = 0; i < opt_threads; i++) {
+        free(workers[i].latencies);
+    }
+    free(workers);
+
+    input_close();
+
+    if (!doidata_close()) {
+        log_error("doidata close failed");
+    }
+
+    return workers_len && !golden_failures ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,73 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdint.h>
+#include "deadline.h"
+
+// The deadline of the request recognized by the current thread, in stats_now() time, or 0 for none
+static __thread uint64_t deadline_at = 0;
+static __thread uint8_t deadline_exhausted_own = 0;
+// Task helpers point this at the flag of the thread they help, so exhaustion
+// noticed on either side is seen by both and counted once
+static __thread uint8_t *deadline_exhausted = 0;
+
+void deadline_begin(uint64_t at) {
+    deadline_at = at;
+    deadline_exhausted_own = 0;
+    deadline_exhausted = &deadline_exhausted_own;
+}
+
+// Takes over the deadline of another thread, which has to stay in
+// its request until the current thread calls deadline_end
+void deadline_join(uint64_t at, uint8_t *exhausted) {
+    deadline_at = at;
+    deadline_exhausted = exhausted ? exhausted : &deadline_exhausted_own;
+}
+
+void deadline_end() {
+    deadline_at = 0;
+    deadline_exhausted = &deadline_exhausted_own;
+}
+
+uint64_t deadline_get() {
+    return deadline_at;
+}
+
+uint8_t *deadline_get_exhausted() {
+    return deadline_at ? deadline_exhausted : 0;
+}
+
+// Stages call this between steps, and return what they have so far once it's true.
+// The stage that notices the exhaustion first is counted
+uint32_t deadline_check(stats_stage_t stage) {
+    if (!deadline_at) return 0;
+    if (__atomic_load_n(deadline_exhausted, __ATOMIC_RELAXED)) return 1;
+    if (stats_now() < deadline_at) return 0;
+
+    if (!__atomic_exchange_n(deadline_exhausted, 1, __ATOMIC_RELAXED)) stats_exhaust(stage);
+    return 1;
+}
+
+// Whether the current request ran out of time, so its result is partial
+uint32_t deadline_is_exhausted() {
+    return deadline_at && __atomic_load_n(deadline_exhausted, __ATOMIC_RELAXED);
+}
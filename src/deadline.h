@@ -0,0 +1,21 @@
+#ifndef RECOGNIZER_SERVER_DEADLINE_H
+#define RECOGNIZER_SERVER_DEADLINE_H
+
+#include <stdint.h>
+#include "stats.h"
+
+void deadline_begin(uint64_t at);
+
+void deadline_join(uint64_t at, uint8_t *exhausted);
+
+void deadline_end();
+
+uint64_t deadline_get();
+
+uint8_t *deadline_get_exhausted();
+
+uint32_t deadline_check(stats_stage_t stage);
+
+uint32_t deadline_is_exhausted();
+
+#endif //RECOGNIZER_SERVER_DEADLINE_H
@@ -19,4 +19,7 @@
 #define URL_LEN 1024
 #define MAX_PAGES 5
 #define MAX_FONTS 50
-#define MAX_LINE_BLOCKS 500
\ No newline at end of file
+#define MAX_LINE_BLOCKS 500
+#define MAX_JOURNAL_TOKENS 16
+#define HF_CELL_SIZE 10
+#define PAGE_NUMBER_BUCKETS 64
\ No newline at end of file
@@ -29,6 +29,7 @@
 #include <pthread.h>
 #include "defines.h"
 #include "log.h"
+#include "stats.h"
 #include "doidata.h"
 
 pthread_rwlock_t doidata_rwlock;
@@ -74,6 +75,9 @@ uint32_t doidata_get(uint64_t title_hash, doidata_t *doidatas, uint32_t *doidata
     int rc;
     char *sql;
 
+    uint64_t t = stats_now();
+    stats_count(STATS_DOIDATA_GET_CALLS, 1);
+
     pthread_rwlock_wrlock(&doidata_rwlock);
     if ((rc = sqlite3_bind_int64(doidata_stmt, 1, title_hash)) != SQLITE_OK) {
         log_error("(%i): %s", rc, sqlite3_errmsg(doidata_sqlite));
@@ -111,6 +115,8 @@ uint32_t doidata_get(uint64_t title_hash, doidata_t *doidatas, uint32_t *doidata
 
     pthread_rwlock_unlock(&doidata_rwlock);
 
+    stats_lap(STATS_DOIDATA_GET, t);
+
     return ret;
 }
 
@@ -118,6 +124,9 @@ uint32_t doidata_has_doi(uint8_t *doi) {
     int rc;
     uint32_t ret = 0;
 
+    uint64_t t = stats_now();
+    stats_count(STATS_DOIDATA_HAS_DOI_CALLS, 1);
+
     pthread_rwlock_wrlock(&doidata_rwlock);
     if ((rc = sqlite3_bind_text(doidata_has_doi_stmt, 1, doi, strlen(doi), SQLITE_STATIC)) != SQLITE_OK) {
         log_error("(%i): %s", rc, sqlite3_errmsg(doidata_sqlite));
@@ -135,6 +144,8 @@ uint32_t doidata_has_doi(uint8_t *doi) {
 
     pthread_rwlock_unlock(&doidata_rwlock);
 
+    stats_lap(STATS_DOIDATA_HAS_DOI, t);
+
     return ret;
 }
 
@@ -147,6 +158,10 @@ uint32_t doidata_close() {
         fprintf(stderr, "sqlite3_finalize: (%d):\n", rc);
     }
 
+    if ((rc = sqlite3_finalize(doidata_has_doi_stmt)) != SQLITE_OK) {
+        fprintf(stderr, "sqlite3_finalize: (%d):\n", rc);
+    }
+
     if ((rc = sqlite3_close(doidata_sqlite)) != SQLITE_OK) {
         log_error("(%d): %s", rc, sqlite3_errmsg(doidata_sqlite));
         return 0;
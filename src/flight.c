@@ -0,0 +1,103 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "stats.h"
+#include "flight.h"
+
+// Identical requests that arrive while the first one is still being recognized
+// wait for its result instead of recognizing the same document again
+#define FLIGHT_BUCKETS 256
+
+pthread_mutex_t flight_mutex = PTHREAD_MUTEX_INITIALIZER;
+flight_t *flight_buckets[FLIGHT_BUCKETS] = {0};
+
+// Returns the leader already in flight with the same hash, after registering
+// the caller as its follower. Otherwise registers the given flight as the
+// leader and returns 0, and the caller must end it with flight_finish
+flight_t *flight_join(flight_t *flight, uint64_t hash, uint64_t deadline) {
+    flight_t **bucket = &flight_buckets[hash % FLIGHT_BUCKETS];
+
+    pthread_mutex_lock(&flight_mutex);
+
+    for (flight_t *leader = *bucket; leader; leader = leader->next) {
+        if (leader->hash == hash) {
+            leader->followers++;
+            pthread_mutex_unlock(&flight_mutex);
+            stats_count(STATS_COALESCED_REQUESTS, 1);
+            return leader;
+        }
+    }
+
+    memset(flight, 0, sizeof(flight_t));
+    flight->hash = hash;
+    flight->deadline = deadline;
+    pthread_cond_init(&flight->cond, 0);
+    flight->next = *bucket;
+    *bucket = flight;
+
+    pthread_mutex_unlock(&flight_mutex);
+    return 0;
+}
+
+// Waits for the leader and copies its result. Returns the status the leader
+// finished with, which is 0 if it failed
+uint32_t flight_wait(flight_t *leader, res_metadata_t *result) {
+    pthread_mutex_lock(&flight_mutex);
+
+    while (!leader->done) {
+        pthread_cond_wait(&leader->cond, &flight_mutex);
+    }
+
+    uint32_t ok = leader->ok;
+    if (ok) memcpy(result, leader->result, sizeof(res_metadata_t));
+
+    // The leader waits for the last follower, because the flight
+    // and the result belong to it
+    if (!--leader->followers) pthread_cond_broadcast(&leader->cond);
+
+    pthread_mutex_unlock(&flight_mutex);
+    return ok;
+}
+
+void flight_finish(flight_t *flight, res_metadata_t *result, uint32_t ok) {
+    pthread_mutex_lock(&flight_mutex);
+
+    // Requests arriving from now on start a new flight
+    flight_t **entry = &flight_buckets[flight->hash % FLIGHT_BUCKETS];
+    while (*entry != flight) entry = &(*entry)->next;
+    *entry = flight->next;
+
+    flight->result = result;
+    flight->ok = ok;
+    flight->done = 1;
+    pthread_cond_broadcast(&flight->cond);
+
+    while (flight->followers) {
+        pthread_cond_wait(&flight->cond, &flight_mutex);
+    }
+
+    pthread_mutex_unlock(&flight_mutex);
+    pthread_cond_destroy(&flight->cond);
+}
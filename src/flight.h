@@ -0,0 +1,27 @@
+#ifndef RECOGNIZER_SERVER_FLIGHT_H
+#define RECOGNIZER_SERVER_FLIGHT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "recognize.h"
+
+// A request in flight, owned by its leader (usually on the leader's stack)
+typedef struct flight {
+    uint64_t hash;
+    // The leader's deadline, 0 for none
+    uint64_t deadline;
+    pthread_cond_t cond;
+    uint32_t followers;
+    uint8_t done;
+    uint8_t ok;
+    res_metadata_t *result;
+    struct flight *next;
+} flight_t;
+
+flight_t *flight_join(flight_t *flight, uint64_t hash, uint64_t deadline);
+
+uint32_t flight_wait(flight_t *leader, res_metadata_t *result);
+
+void flight_finish(flight_t *flight, res_metadata_t *result, uint32_t ok);
+
+#endif //RECOGNIZER_SERVER_FLIGHT_H
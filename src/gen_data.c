@@ -0,0 +1,306 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sqlite3.h>
+#include "defines.h"
+#include "log.h"
+#include "text.h"
+#include "synth.h"
+
+// Rows inserted per transaction
+#define GEN_BATCH_SIZE 1000000
+
+int log_level = 1;
+
+// Writes a word.dat record: u64 hash followed by three u32 counters
+uint32_t write_word(FILE *fp, uint8_t *word, uint32_t a, uint32_t b, uint32_t c) {
+    uint8_t processed[256];
+    uint32_t processed_len = sizeof(processed);
+    if (!text_process(word, processed, &processed_len) || !processed_len) return 0;
+
+    uint8_t record[20];
+    uint64_t hash = text_hash64(processed, processed_len);
+    memcpy(record, &hash, 8);
+    memcpy(record + 8, &a, 4);
+    memcpy(record + 12, &b, 4);
+    memcpy(record + 16, &c, 4);
+    return fwrite(record, sizeof(record), 1, fp) == 1;
+}
+
+// Word frequencies follow Zipf's law. Names are counted as first (b) or last (c) names,
+// and some of them also as ordinary words (a), like "White" or "Young"
+uint32_t gen_words(synth_config_t *config, char *directory) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/word.dat", directory);
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        log_error("failed to open %s", path);
+        return 0;
+    }
+
+    synth_rng_t rng;
+    synth_seed(&rng, config->seed);
+
+    uint8_t word[SYNTH_NAME_LEN];
+    uint64_t records_len = 0;
+
+    for (uint64_t i = 0; i < config->words_len; i++) {
+        synth_word(config->seed, i, word, sizeof(word));
+        records_len += write_word(fp, word, 1 + 100000000 / (i + 1), 0, 0);
+    }
+
+    for (uint64_t i = 0; i < 5000; i++) {
+        synth_first_name(config->seed, i, word, sizeof(word));
+        uint32_t a = synth_uniform(&rng) < 0.05 ? synth_below(&rng, 1000) : 0;
+        records_len += write_word(fp, word, a, 1 + 1000000 / (i + 1), 0);
+    }
+
+    for (uint64_t i = 0; i < 500000; i++) {
+        synth_last_name(config->seed, i, word, sizeof(word));
+        uint32_t a = synth_uniform(&rng) < 0.05 ? synth_below(&rng, 1000) : 0;
+        records_len += write_word(fp, word, a, 0, 1 + 1000000 / (i + 1));
+    }
+
+    fclose(fp);
+    log_info("%s: %lu records", path, records_len);
+    return 1;
+}
+
+uint32_t gen_journals(synth_config_t *config, char *directory) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/journal.dat", directory);
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        log_error("failed to open %s", path);
+        return 0;
+    }
+
+    uint8_t journal[CONTAINER_LEN];
+    uint8_t processed[CONTAINER_LEN];
+
+    for (uint64_t i = 0; i < config->journals_len; i++) {
+        synth_journal(config->seed, i, journal, sizeof(journal));
+        uint32_t processed_len = sizeof(processed);
+        if (!text_process(journal, processed, &processed_len) || !processed_len) continue;
+        uint64_t hash = text_hash64(processed, processed_len);
+        fwrite(&hash, sizeof(hash), 1, fp);
+    }
+
+    fclose(fp);
+    log_info("%s: %lu journals", path, config->journals_len);
+    return 1;
+}
+
+// Author columns hold the hash and length of the processed last name, as find_author() expects
+void get_author_hash(uint8_t *last_name, uint32_t *hash, uint32_t *len) {
+    uint8_t processed[SYNTH_NAME_LEN * 4];
+    uint32_t processed_len = sizeof(processed);
+    *hash = 0;
+    *len = 0;
+    if (!text_process(last_name, processed, &processed_len)) return;
+    *hash = text_hash32(processed, processed_len);
+    *len = processed_len;
+}
+
+uint32_t exec_sql(sqlite3 *sqlite, char *sql) {
+    char *err_msg = 0;
+    if (sqlite3_exec(sqlite, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        log_error("%s: %s", sql, err_msg);
+        sqlite3_free(err_msg);
+        return 0;
+    }
+    return 1;
+}
+
+uint32_t gen_doidata(synth_config_t *config, char *directory) {
+    int rc;
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/doidata.sqlite", directory);
+
+    unlink(path);
+
+    sqlite3 *sqlite;
+    if ((rc = sqlite3_open(path, &sqlite)) != SQLITE_OK) {
+        log_error("%s (%d): %s", path, rc, sqlite3_errmsg(sqlite));
+        return 0;
+    }
+
+    if (!exec_sql(sqlite, "PRAGMA journal_mode = OFF") ||
+        !exec_sql(sqlite, "PRAGMA synchronous = OFF") ||
+        !exec_sql(sqlite, "CREATE TABLE doidata (title_hash INTEGER, author1_len INTEGER, author1_hash INTEGER, "
+                          "author2_len INTEGER, author2_hash INTEGER, doi TEXT)")) {
+        sqlite3_close(sqlite);
+        return 0;
+    }
+
+    char *sql = "INSERT INTO doidata VALUES (?, ?, ?, ?, ?, ?)";
+    sqlite3_stmt *stmt;
+    if ((rc = sqlite3_prepare_v2(sqlite, sql, -1, &stmt, 0)) != SQLITE_OK) {
+        log_error("%s (%i): %s", sql, rc, sqlite3_errmsg(sqlite));
+        sqlite3_close(sqlite);
+        return 0;
+    }
+
+    synth_article_t article;
+    uint8_t processed[MAX_LOOKUP_TEXT_LEN];
+
+    exec_sql(sqlite, "BEGIN");
+    for (uint64_t i = 0; i < config->articles_len; i++) {
+        synth_article(config, i, &article);
+
+        uint32_t processed_len = sizeof(processed);
+        text_process(article.title, processed, &processed_len);
+
+        uint32_t author1_hash = 0, author1_len = 0, author2_hash = 0, author2_len = 0;
+        get_author_hash(article.authors[0].last_name, &author1_hash, &author1_len);
+        if (article.authors_len > 1) {
+            get_author_hash(article.authors[1].last_name, &author2_hash, &author2_len);
+        }
+
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64) text_hash64(processed, processed_len));
+        sqlite3_bind_int(stmt, 2, author1_len);
+        sqlite3_bind_int(stmt, 3, author1_hash);
+        sqlite3_bind_int(stmt, 4, author2_len);
+        sqlite3_bind_int(stmt, 5, author2_hash);
+        sqlite3_bind_text(stmt, 6, article.doi, -1, SQLITE_STATIC);
+
+        if ((rc = sqlite3_step(stmt)) != SQLITE_DONE) {
+            log_error("(%i): %s", rc, sqlite3_errmsg(sqlite));
+            sqlite3_finalize(stmt);
+            sqlite3_close(sqlite);
+            return 0;
+        }
+        sqlite3_reset(stmt);
+
+        if ((i + 1) % GEN_BATCH_SIZE == 0) {
+            exec_sql(sqlite, "COMMIT");
+            exec_sql(sqlite, "BEGIN");
+            log_info("%lu articles", i + 1);
+        }
+    }
+    exec_sql(sqlite, "COMMIT");
+    sqlite3_finalize(stmt);
+
+    // Indexes are much faster to build once all rows are in
+    log_info("indexing");
+    if (!exec_sql(sqlite, "CREATE INDEX doidata_title_hash ON doidata (title_hash)") ||
+        !exec_sql(sqlite, "CREATE INDEX doidata_doi ON doidata (doi)")) {
+        sqlite3_close(sqlite);
+        return 0;
+    }
+
+    sqlite3_close(sqlite);
+    log_info("%s: %lu articles", path, config->articles_len);
+    return 1;
+}
+
+void print_usage() {
+    printf(
+            "Missing parameters.\n" \
+            "-o\toutput data directory\n" \
+            "-n\tnumber of DOIs (default 100000)\n" \
+            "-w\tvocabulary size (default 1000000)\n" \
+            "-j\tnumber of journals (default 100000)\n" \
+            "-u\tfraction of duplicate titles (default 0.01)\n" \
+            "-g\tfraction of generic titles like \"Editorial\" (default 0.001)\n" \
+            "-s\tseed (default 1)\n" \
+            "-l\tlog level\n" \
+            "Usage example:\n" \
+            "recognizer-gendata -o /var/db -n 10000000\n"
+    );
+}
+
+int main(int argc, char **argv) {
+    char *opt_directory = 0;
+    synth_config_t config = {
+            .seed = 1,
+            .articles_len = 100000,
+            .words_len = 1000000,
+            .journals_len = 100000,
+            .duplicate_fraction = 0.01,
+            .generic_fraction = 0.001
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:n:w:j:u:g:s:l:")) != -1) {
+        switch (opt) {
+            case 'o':
+                opt_directory = optarg;
+                break;
+            case 'n':
+                config.articles_len = strtoull(optarg, 0, 10);
+                break;
+            case 'w':
+                config.words_len = strtoull(optarg, 0, 10);
+                break;
+            case 'j':
+                config.journals_len = strtoull(optarg, 0, 10);
+                break;
+            case 'u':
+                config.duplicate_fraction = strtod(optarg, 0);
+                break;
+            case 'g':
+                config.generic_fraction = strtod(optarg, 0);
+                break;
+            case 's':
+                config.seed = strtoull(optarg, 0, 10);
+                break;
+            case 'l':
+                if (optarg) {
+                    log_level = strtol(optarg, 0, 10);
+                }
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!opt_directory || !config.articles_len || !config.words_len || !config.journals_len) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (!text_init()) {
+        log_error("failed to initialize text processor");
+        return EXIT_FAILURE;
+    }
+
+    log_info("generating words");
+    if (!gen_words(&config, opt_directory)) return EXIT_FAILURE;
+
+    log_info("generating journals");
+    if (!gen_journals(&config, opt_directory)) return EXIT_FAILURE;
+
+    log_info("generating doidata");
+    if (!gen_doidata(&config, opt_directory)) return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,576 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <jemalloc/jemalloc.h>
+#include "defines.h"
+#include "log.h"
+#include "synth.h"
+
+#define GEN_PAGE_WIDTH 612
+#define GEN_PAGE_HEIGHT 792
+#define GEN_MARGIN 60
+#define GEN_COLUMN_GAP 20
+#define GEN_BODY_TOP 70
+#define GEN_BODY_BOTTOM 735
+#define GEN_MAX_LINE_WORDS 128
+#define GEN_MAX_BLOCK_LINES 256
+#define GEN_WORD_LEN 128
+#define GEN_STREAM_DOC 0x7000000000000000ULL
+
+// Fonts used by the generated layouts
+#define GEN_FONT_BODY 1
+#define GEN_FONT_TITLE 2
+#define GEN_FONT_HEADFOOT 3
+#define GEN_FONT_AUTHORS 4
+#define GEN_FONT_AFFILIATION 5
+
+typedef struct gen_word {
+    double x_min;
+    double y_min;
+    double x_max;
+    double y_max;
+    double font_size;
+    uint8_t space;
+    uint8_t bold;
+    uint32_t font;
+    uint8_t text[GEN_WORD_LEN];
+} gen_word_t;
+
+typedef struct gen_line {
+    gen_word_t words[GEN_MAX_LINE_WORDS];
+    uint32_t words_len;
+} gen_line_t;
+
+typedef struct gen_block {
+    gen_line_t lines[GEN_MAX_BLOCK_LINES];
+    uint32_t lines_len;
+} gen_block_t;
+
+typedef struct gen_options {
+    uint32_t docs_len;
+    uint32_t pages_len;
+    uint32_t columns;
+    uint32_t words_per_page;
+    double jstor_fraction;
+    double structured_fraction;
+    double doi_fraction;
+    double miss_fraction;
+} gen_options_t;
+
+typedef struct gen_page {
+    FILE *fp;
+    uint32_t blocks_len;
+} gen_page_t;
+
+int log_level = 1;
+
+gen_block_t *block;
+
+void write_string(FILE *fp, uint8_t *str) {
+    fputc('"', fp);
+    for (uint8_t *c = str; *c; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', fp);
+        if (*c < 0x20) fprintf(fp, "\\u%04x", *c);
+        else fputc(*c, fp);
+    }
+    fputc('"', fp);
+}
+
+void write_block(gen_page_t *page) {
+    if (!block->lines_len) return;
+
+    double x_min = GEN_PAGE_WIDTH, y_min = GEN_PAGE_HEIGHT, x_max = 0, y_max = 0;
+    for (uint32_t i = 0; i < block->lines_len; i++) {
+        gen_line_t *line = &block->lines[i];
+        for (uint32_t j = 0; j < line->words_len; j++) {
+            gen_word_t *word = &line->words[j];
+            if (word->x_min < x_min) x_min = word->x_min;
+            if (word->y_min < y_min) y_min = word->y_min;
+            if (word->x_max > x_max) x_max = word->x_max;
+            if (word->y_max > y_max) y_max = word->y_max;
+        }
+    }
+
+    FILE *fp = page->fp;
+    if (page->blocks_len++) fputc(',', fp);
+    fprintf(fp, "[%.2f,%.2f,%.2f,%.2f,[", x_min, y_min, x_max, y_max);
+    for (uint32_t i = 0; i < block->lines_len; i++) {
+        gen_line_t *line = &block->lines[i];
+        if (i) fputc(',', fp);
+        fputs("[[", fp);
+        for (uint32_t j = 0; j < line->words_len; j++) {
+            gen_word_t *word = &line->words[j];
+            if (j) fputc(',', fp);
+            fprintf(fp, "[%.2f,%.2f,%.2f,%.2f,%.1f,%u,%.2f,0,0,%u,0,0,%u,",
+                    word->x_min, word->y_min, word->x_max, word->y_max, word->font_size,
+                    word->space, word->y_min + word->font_size * 0.8, word->bold, word->font);
+            write_string(fp, word->text);
+            fputc(']', fp);
+        }
+        fputs("]]", fp);
+    }
+    fputs("]]", fp);
+
+    block->lines_len = 0;
+}
+
+// Lays out text into lines of the current block, wrapping at width. Returns the y below the last line
+double add_text(uint8_t *text, double x, double y, double width, double font_size, uint32_t font, uint8_t bold) {
+    gen_line_t *line = 0;
+    double line_x = x;
+    uint8_t *p = text;
+
+    while (*p) {
+        while (*p == ' ') p++;
+        if (!*p) break;
+        uint8_t *s = p;
+        while (*p && *p != ' ') p++;
+
+        uint32_t len = p - s;
+        if (len >= GEN_WORD_LEN) len = GEN_WORD_LEN - 1;
+        double word_width = len * font_size * 0.5;
+
+        if (!line || line->words_len == GEN_MAX_LINE_WORDS ||
+            (line->words_len && line_x + word_width > x + width)) {
+            if (block->lines_len == GEN_MAX_BLOCK_LINES) break;
+            if (line) {
+                line->words[line->words_len - 1].space = 0;
+                y += font_size * 1.2;
+            }
+            line = &block->lines[block->lines_len++];
+            line->words_len = 0;
+            line_x = x;
+        }
+
+        gen_word_t *word = &line->words[line->words_len++];
+        word->x_min = line_x;
+        word->y_min = y;
+        word->x_max = line_x + word_width;
+        word->y_max = y + font_size;
+        word->font_size = font_size;
+        word->space = 1;
+        word->bold = bold;
+        word->font = font;
+        memcpy(word->text, s, len);
+        word->text[len] = 0;
+
+        line_x += word_width + font_size * 0.3;
+    }
+
+    if (line) line->words[line->words_len - 1].space = 0;
+    return y + font_size * 1.2;
+}
+
+double add_line(uint8_t *text, double x, double y, double font_size, uint32_t font, uint8_t bold) {
+    return add_text(text, x, y, GEN_PAGE_WIDTH, font_size, font, bold);
+}
+
+// A paragraph of sentences made of Zipf distributed words
+uint32_t get_paragraph(synth_config_t *config, synth_rng_t *rng, uint32_t words_len, uint8_t *text, uint32_t text_size) {
+    uint32_t len = 0;
+    while (words_len && len + 1 < text_size) {
+        uint32_t n = 6 + synth_below(rng, 14);
+        if (n > words_len) n = words_len;
+        words_len -= n;
+
+        if (len) text[len++] = ' ';
+        uint32_t sentence_len = synth_sentence(config, rng, n, text + len, text_size - len - 1);
+        if (text[len] >= 'a' && text[len] <= 'z') text[len] -= 'a' - 'A';
+        len += sentence_len;
+        text[len++] = '.';
+        text[len] = 0;
+    }
+    return len;
+}
+
+void get_authors_str(synth_article_t *article, uint8_t *text, uint32_t text_size) {
+    uint32_t len = 0;
+    *text = 0;
+    for (uint32_t i = 0; i < article->authors_len && len < text_size; i++) {
+        synth_author_t *author = &article->authors[i];
+        char *separator = !i ? "" : i + 1 == article->authors_len ? " and " : ", ";
+        len += snprintf(text + len, text_size - len, "%s%s %s", separator, author->first_name, author->last_name);
+    }
+}
+
+void get_publisher(synth_config_t *config, synth_article_t *article, uint8_t *publisher, uint32_t publisher_size) {
+    uint8_t name[SYNTH_NAME_LEN];
+    synth_last_name(config->seed, article->journal_id % 1000, name, sizeof(name));
+    snprintf(publisher, publisher_size, "%s %s", name, article->journal_id % 2 ? "Press" : "Publishing");
+}
+
+void add_headfoot(synth_config_t *config, synth_article_t *article, gen_page_t *page, uint32_t page_i) {
+    uint8_t text[TITLE_LEN + CONTAINER_LEN];
+
+    // Running headers alternate between the journal and the title, like most journals print them.
+    // Some run the journal name into the volume line, so it's only found inside a longer line
+    if (page_i % 2) {
+        snprintf(text, sizeof(text), "%s", article->title);
+    } else if (article->journal_id % 4 == 0) {
+        snprintf(text, sizeof(text), "%s Vol. %u No. %u (%u)",
+                 article->journal, article->volume, article->issue, article->year);
+    } else {
+        snprintf(text, sizeof(text), "%s, Vol. %u, No. %u (%u)",
+                 article->journal, article->volume, article->issue, article->year);
+    }
+    add_text(text, GEN_MARGIN, 40, GEN_PAGE_WIDTH - 2 * GEN_MARGIN, 8, GEN_FONT_HEADFOOT, 0);
+    write_block(page);
+
+    uint8_t publisher[PUBLISHER_LEN];
+    get_publisher(config, article, publisher, sizeof(publisher));
+    snprintf(text, sizeof(text), "© %u %s. All rights reserved.", article->year, publisher);
+    add_line(text, GEN_MARGIN + 150, 765, 7, GEN_FONT_HEADFOOT, 0);
+    write_block(page);
+
+    // Page numbers go to the outer corner
+    snprintf(text, sizeof(text), "%u", article->first_page + page_i);
+    add_line(text, page_i % 2 ? GEN_PAGE_WIDTH - GEN_MARGIN - 15 : GEN_MARGIN, 750, 9, GEN_FONT_HEADFOOT, 0);
+    write_block(page);
+}
+
+double add_front_matter(synth_config_t *config, gen_options_t *options, synth_rng_t *rng,
+                        synth_article_t *article, gen_page_t *page) {
+    uint8_t text[ABSTRACT_LEN];
+    double width = GEN_PAGE_WIDTH - 2 * GEN_MARGIN;
+
+    double y = add_text(article->title, GEN_MARGIN + 20, 80, width - 40, 18, GEN_FONT_TITLE, 1);
+    write_block(page);
+
+    y += 12;
+    if (synth_uniform(rng) < 0.6) {
+        get_authors_str(article, text, sizeof(text));
+        y = add_text(text, GEN_MARGIN + 20, y, width - 40, 12, GEN_FONT_AUTHORS, 0);
+        write_block(page);
+        y = add_line("Department of Physics, University of Somewhere, 12345 City, Country", GEN_MARGIN + 20, y + 4, 9,
+                     GEN_FONT_AFFILIATION, 0);
+        write_block(page);
+    } else {
+        // One block per author with an affiliation below, side by side
+        double author_width = width / 3;
+        double row_y = y;
+        for (uint32_t i = 0; i < article->authors_len; i++) {
+            synth_author_t *author = &article->authors[i];
+            double x = GEN_MARGIN + (i % 3) * author_width;
+            if (i && i % 3 == 0) row_y += 40;
+            snprintf(text, sizeof(text), "%s %s", author->first_name, author->last_name);
+            double author_y = add_line(text, x, row_y, 12, GEN_FONT_AUTHORS, 0);
+            add_line("University of Somewhere", x, author_y, 9, GEN_FONT_AFFILIATION, 0);
+            write_block(page);
+        }
+        y = row_y + 40;
+    }
+
+    if (synth_uniform(rng) < options->doi_fraction) {
+        snprintf(text, sizeof(text), "doi:%s", article->doi);
+        y = add_line(text, GEN_MARGIN + 20, y + 4, 8, GEN_FONT_HEADFOOT, 0);
+        write_block(page);
+    }
+
+    y += 16;
+    if (synth_uniform(rng) < options->structured_fraction) {
+        char *names[] = {"Background:", "Methods:", "Results:", "Conclusions:"};
+        for (uint32_t i = 0; i < 4; i++) {
+            uint32_t len = snprintf(text, sizeof(text), "%s ", names[i]);
+            get_paragraph(config, rng, 25 + synth_below(rng, 30), text + len, sizeof(text) - len);
+            uint32_t line_i = block->lines_len;
+            y = add_text(text, GEN_MARGIN + 20, y, width - 40, 9, GEN_FONT_BODY, 0);
+            if (line_i < block->lines_len) block->lines[line_i].words[0].bold = 1;
+        }
+        write_block(page);
+    } else {
+        add_line("Abstract", GEN_MARGIN + 20, y, 10, GEN_FONT_BODY, 1);
+        write_block(page);
+        get_paragraph(config, rng, 120 + synth_below(rng, 100), text, sizeof(text));
+        y = add_text(text, GEN_MARGIN + 20, y + 14, width - 40, 9, GEN_FONT_BODY, 0);
+        write_block(page);
+    }
+
+    y += 14;
+    y = add_line("Keywords: synthetic, layout, benchmark", GEN_MARGIN + 20, y, 9, GEN_FONT_BODY, 0);
+    write_block(page);
+
+    return y + 20;
+}
+
+// Fills columns with paragraphs. The font shrinks to fit the requested number of words
+void add_body(synth_config_t *config, gen_options_t *options, synth_rng_t *rng, gen_page_t *page, double top,
+              uint32_t words_per_page) {
+    double column_width = (GEN_PAGE_WIDTH - 2 * GEN_MARGIN - (options->columns - 1) * GEN_COLUMN_GAP) /
+                          (double) options->columns;
+    double area = column_width * options->columns * (GEN_BODY_BOTTOM - GEN_BODY_TOP);
+    // An average word with its space is about 3.5 font sizes wide and lines are 1.2 font sizes apart
+    double font_size = sqrt(area / (4.2 * words_per_page));
+    if (font_size > 10) font_size = 10;
+    if (font_size < 2) font_size = 2;
+
+    uint8_t text[ABSTRACT_LEN];
+
+    for (uint32_t column_i = 0; column_i < options->columns; column_i++) {
+        double x = GEN_MARGIN + column_i * (column_width + GEN_COLUMN_GAP);
+        double y = top;
+        while (1) {
+            uint32_t lines_len = 4 + synth_below(rng, 8);
+            if (y + lines_len * font_size * 1.2 > GEN_BODY_BOTTOM) break;
+            uint32_t words_per_line = column_width / (font_size * 3.5);
+            if (!words_per_line) words_per_line = 1;
+            get_paragraph(config, rng, lines_len * words_per_line, text, sizeof(text));
+            y = add_text(text, x, y, column_width, font_size, GEN_FONT_BODY, 0);
+            write_block(page);
+            y += font_size;
+        }
+    }
+}
+
+void add_jstor_cover(synth_config_t *config, synth_article_t *article, gen_page_t *page) {
+    uint8_t text[TITLE_LEN + CONTAINER_LEN];
+    uint8_t authors[AUTHORS_LEN];
+    uint8_t publisher[PUBLISHER_LEN];
+
+    // Cover metadata starts after the logo block
+    add_line("JSTOR", 50, 50, 14, GEN_FONT_TITLE, 1);
+    write_block(page);
+
+    get_authors_str(article, authors, sizeof(authors));
+    get_publisher(config, article, publisher, sizeof(publisher));
+
+    // The title and the citation lines share a font, so they form a single line block
+    double y = add_text(article->title, 50, 100, 500, 10, GEN_FONT_BODY, 0);
+    snprintf(text, sizeof(text), "Author(s): %s", authors);
+    y = add_line(text, 50, y, 10, GEN_FONT_BODY, 0);
+    snprintf(text, sizeof(text), "Source: %s, Vol. %u, No. %u (%u), pp. %u-%u", article->journal,
+             article->volume, article->issue, article->year, article->first_page, article->last_page);
+    y = add_line(text, 50, y, 10, GEN_FONT_BODY, 0);
+    snprintf(text, sizeof(text), "Published by: %s", publisher);
+    y = add_line(text, 50, y, 10, GEN_FONT_BODY, 0);
+    snprintf(text, sizeof(text), "Stable URL: http://www.jstor.org/stable/%llu", 10000 + (unsigned long long) article->id);
+    y = add_line(text, 50, y, 10, GEN_FONT_BODY, 0);
+    add_line("Accessed: 01-01-2018 00:00 UTC", 50, y, 10, GEN_FONT_BODY, 0);
+    write_block(page);
+
+    add_text("JSTOR is a not-for-profit service that helps scholars, researchers, and students discover, use, "
+             "and build upon a wide range of content in a trusted digital archive.", 50, 600, 500, 8, GEN_FONT_BODY, 0);
+    write_block(page);
+}
+
+void begin_page(gen_page_t *page) {
+    fprintf(page->fp, "[%u,%u,[[[", GEN_PAGE_WIDTH, GEN_PAGE_HEIGHT);
+    page->blocks_len = 0;
+}
+
+void end_page(gen_page_t *page) {
+    fputs("]]]]", page->fp);
+}
+
+void gen_doc(synth_config_t *config, gen_options_t *options, uint32_t doc_i, FILE *fp) {
+    synth_rng_t rng;
+    synth_seed(&rng, config->seed ^ GEN_STREAM_DOC ^ (doc_i * 0xD1B54A32D192ED03ULL));
+
+    // Missing articles aren't in doidata, so their title lookups fail like they do for real unknown PDFs
+    uint64_t article_id = synth_uniform(&rng) < options->miss_fraction ?
+                          config->articles_len + doc_i : synth_below(&rng, config->articles_len);
+
+    synth_article_t article;
+    synth_article(config, article_id, &article);
+
+    uint8_t jstor = synth_uniform(&rng) < options->jstor_fraction;
+    uint32_t total_pages = article.last_page - article.first_page + 1 + jstor;
+    if (total_pages < options->pages_len) total_pages = options->pages_len;
+
+    fputs("{\"metadata\":{", fp);
+    if (!jstor && synth_uniform(&rng) < 0.2) {
+        fputs("\"Title\":", fp);
+        write_string(fp, article.title);
+    } else {
+        fputs("\"Producer\":\"recognizer-gendoc\"", fp);
+    }
+    fprintf(fp, "},\"totalPages\":%u,\"pages\":[", total_pages);
+
+    gen_page_t page = {fp};
+    for (uint32_t page_i = 0; page_i < options->pages_len; page_i++) {
+        if (page_i) fputc(',', fp);
+        begin_page(&page);
+        if (jstor && !page_i) {
+            add_jstor_cover(config, &article, &page);
+        } else {
+            uint32_t article_page_i = page_i - jstor;
+            add_headfoot(config, &article, &page, article_page_i);
+            double top = GEN_BODY_TOP;
+            uint32_t words_per_page = options->words_per_page;
+            if (!article_page_i) {
+                top = add_front_matter(config, options, &rng, &article, &page);
+                // Some front pages are dense, so the text an abstract extractor runs into
+                // after the abstract is longer than the abstract buffer
+                if (article.id % 8 == 0) words_per_page *= 8;
+            }
+            add_body(config, options, &rng, &page, top, words_per_page);
+        }
+        end_page(&page);
+    }
+
+    fputs("]}\n", fp);
+}
+
+void print_usage() {
+    printf(
+            "Missing parameters.\n" \
+            "-o\toutput NDJSON file (default stdout)\n" \
+            "-O\toutput directory with one request body per file\n" \
+            "-c\tnumber of documents (default 100)\n" \
+            "-p\tpages per document (default 5)\n" \
+            "-k\tcolumns (default 2)\n" \
+            "-W\twords per page (default 600)\n" \
+            "-J\tfraction of JSTOR cover pages (default 0.1)\n" \
+            "-A\tfraction of structured abstracts (default 0.3)\n" \
+            "-D\tfraction of DOIs printed on the first page (default 0.5)\n" \
+            "-M\tfraction of articles missing from doidata (default 0.1)\n" \
+            "-n, -w, -j, -u, -g, -s\tsame as recognizer-gendata, to match its doidata\n" \
+            "-l\tlog level\n" \
+            "Usage example:\n" \
+            "recognizer-gendoc -n 10000000 -c 10000 -W 2000 -o requests.jsonl\n"
+    );
+}
+
+int main(int argc, char **argv) {
+    char *opt_output = 0;
+    char *opt_directory = 0;
+    synth_config_t config = {
+            .seed = 1,
+            .articles_len = 100000,
+            .words_len = 1000000,
+            .journals_len = 100000,
+            .duplicate_fraction = 0.01,
+            .generic_fraction = 0.001
+    };
+    gen_options_t options = {
+            .docs_len = 100,
+            .pages_len = 5,
+            .columns = 2,
+            .words_per_page = 600,
+            .jstor_fraction = 0.1,
+            .structured_fraction = 0.3,
+            .doi_fraction = 0.5,
+            .miss_fraction = 0.1
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "o:O:c:p:k:W:J:A:D:M:n:w:j:u:g:s:l:")) != -1) {
+        switch (opt) {
+            case 'o':
+                opt_output = optarg;
+                break;
+            case 'O':
+                opt_directory = optarg;
+                break;
+            case 'c':
+                options.docs_len = strtoul(optarg, 0, 10);
+                break;
+            case 'p':
+                options.pages_len = strtoul(optarg, 0, 10);
+                break;
+            case 'k':
+                options.columns = strtoul(optarg, 0, 10);
+                break;
+            case 'W':
+                options.words_per_page = strtoul(optarg, 0, 10);
+                break;
+            case 'J':
+                options.jstor_fraction = strtod(optarg, 0);
+                break;
+            case 'A':
+                options.structured_fraction = strtod(optarg, 0);
+                break;
+            case 'D':
+                options.doi_fraction = strtod(optarg, 0);
+                break;
+            case 'M':
+                options.miss_fraction = strtod(optarg, 0);
+                break;
+            case 'n':
+                config.articles_len = strtoull(optarg, 0, 10);
+                break;
+            case 'w':
+                config.words_len = strtoull(optarg, 0, 10);
+                break;
+            case 'j':
+                config.journals_len = strtoull(optarg, 0, 10);
+                break;
+            case 'u':
+                config.duplicate_fraction = strtod(optarg, 0);
+                break;
+            case 'g':
+                config.generic_fraction = strtod(optarg, 0);
+                break;
+            case 's':
+                config.seed = strtoull(optarg, 0, 10);
+                break;
+            case 'l':
+                if (optarg) {
+                    log_level = strtol(optarg, 0, 10);
+                }
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!options.pages_len || !options.columns || !options.words_per_page ||
+        !config.articles_len || !config.words_len || !config.journals_len) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (!(block = malloc(sizeof(gen_block_t)))) return EXIT_FAILURE;
+
+    FILE *fp = stdout;
+    if (opt_output && !(fp = fopen(opt_output, "w"))) {
+        log_error("failed to open %s", opt_output);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < options.docs_len; i++) {
+        if (opt_directory) {
+            char path[PATH_MAX];
+            snprintf(path, PATH_MAX, "%s/%06u.json", opt_directory, i);
+            if (!(fp = fopen(path, "w"))) {
+                log_error("failed to open %s", path);
+                return EXIT_FAILURE;
+            }
+            gen_doc(&config, &options, i, fp);
+            fclose(fp);
+        } else {
+            gen_doc(&config, &options, i, fp);
+        }
+    }
+
+    if (!opt_directory && fp != stdout) fclose(fp);
+    free(block);
+
+    return EXIT_SUCCESS;
+}
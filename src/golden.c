@@ -0,0 +1,212 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <jansson.h>
+#include <jemalloc/jemalloc.h>
+#include "log.h"
+#include "recognize.h"
+#include "result.h"
+#include "golden.h"
+
+// Longest value printed in a mismatch report
+#define GOLDEN_PRINT_LEN 200
+
+pthread_mutex_t golden_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Expected results by id, and ids that were seen during the run
+json_t *golden_expected = 0;
+json_t *golden_seen = 0;
+uint32_t golden_mismatches = 0;
+
+// Results in input order, waiting to be written
+char **golden_lines = 0;
+uint32_t golden_lines_len = 0;
+
+void get_golden_key(json_t *id, char *key, uint32_t key_size) {
+    if (json_is_integer(id)) {
+        snprintf(key, key_size, "%lld", (long long) json_integer_value(id));
+    } else {
+        snprintf(key, key_size, "%s", json_string_value(id) ? json_string_value(id) : "");
+    }
+}
+
+uint32_t golden_load(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        log_error("failed to open %s", path);
+        return 0;
+    }
+
+    golden_expected = json_object();
+    golden_seen = json_object();
+
+    char *line = 0;
+    size_t line_size = 0;
+    ssize_t line_len;
+    uint32_t line_i = 0;
+    while ((line_len = getline(&line, &line_size, fp)) > 0) {
+        line_i++;
+        if (line_len == 1) continue;
+
+        json_error_t error;
+        json_t *obj = json_loadb(line, line_len, 0, &error);
+        json_t *id = json_object_get(obj, "id");
+        if (!id) {
+            log_error("%s:%u: invalid golden result", path, line_i);
+            if (obj) json_decref(obj);
+            free(line);
+            fclose(fp);
+            return 0;
+        }
+
+        char key[PATH_MAX];
+        get_golden_key(id, key, sizeof(key));
+        json_object_set_new(golden_expected, key, obj);
+    }
+
+    free(line);
+    fclose(fp);
+    log_info("loaded %zu golden results", json_object_size(golden_expected));
+    return 1;
+}
+
+void print_value(const char *value) {
+    uint32_t len = strlen(value);
+    fputc('"', stderr);
+    for (uint32_t i = 0; i < len && i < GOLDEN_PRINT_LEN; i++) {
+        if (value[i] == '\n') fputs("\\n", stderr);
+        else if (value[i] == '\t') fputs("\\t", stderr);
+        else fputc(value[i], stderr);
+    }
+    fputs(len > GOLDEN_PRINT_LEN ? "\"..." : "\"", stderr);
+}
+
+// Compares every field with the golden result. Returns 0 and reports the differences on a mismatch
+uint32_t golden_check(json_t *id, res_metadata_t *result) {
+    char key[PATH_MAX];
+    get_golden_key(id, key, sizeof(key));
+
+    // Lookups are read-only, but the seen set and reports are shared
+    json_t *expected = json_object_get(golden_expected, key);
+
+    pthread_mutex_lock(&golden_mutex);
+    json_object_set_new(golden_seen, key, json_true());
+
+    uint32_t ret = 1;
+    if (!expected) {
+        fprintf(stderr, "%s: not in golden results\n", key);
+        ret = 0;
+    } else {
+        for (uint32_t i = 0; i < result_fields_len; i++) {
+            const char *expected_value = json_string_value(json_object_get(expected, result_fields[i].name));
+            if (!expected_value) expected_value = "";
+            uint8_t *value = result_get_field(result, i);
+            if (!strcmp(expected_value, value)) continue;
+
+            fprintf(stderr, "%s: %s: expected ", key, result_fields[i].name);
+            print_value(expected_value);
+            fputs(", got ", stderr);
+            print_value(value);
+            fputc('\n', stderr);
+            ret = 0;
+        }
+    }
+
+    if (!ret) golden_mismatches++;
+    pthread_mutex_unlock(&golden_mutex);
+    return ret;
+}
+
+uint32_t golden_add(uint32_t seq, json_t *id, res_metadata_t *result) {
+    json_t *obj = json_object();
+    json_object_set(obj, "id", id);
+    result_to_golden_json(result, obj);
+    char *str = json_dumps(obj, JSON_COMPACT | JSON_PRESERVE_ORDER);
+    json_decref(obj);
+    if (!str) return 0;
+
+    pthread_mutex_lock(&golden_mutex);
+    if (seq >= golden_lines_len) {
+        uint32_t lines_len = golden_lines_len ? golden_lines_len : 1024;
+        while (lines_len <= seq) lines_len *= 2;
+        char **lines = realloc(golden_lines, sizeof(char *) * lines_len);
+        if (!lines) {
+            pthread_mutex_unlock(&golden_mutex);
+            free(str);
+            return 0;
+        }
+        memset(lines + golden_lines_len, 0, sizeof(char *) * (lines_len - golden_lines_len));
+        golden_lines = lines;
+        golden_lines_len = lines_len;
+    }
+    golden_lines[seq] = str;
+    pthread_mutex_unlock(&golden_mutex);
+    return 1;
+}
+
+// Writes results in input order, so golden files diff cleanly between runs
+uint32_t golden_write(char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        log_error("failed to open %s", path);
+        return 0;
+    }
+
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < golden_lines_len; i++) {
+        if (!golden_lines[i]) continue;
+        fputs(golden_lines[i], fp);
+        fputc('\n', fp);
+        free(golden_lines[i]);
+        written++;
+    }
+    free(golden_lines);
+    golden_lines = 0;
+    golden_lines_len = 0;
+
+    fclose(fp);
+    log_info("wrote %u golden results to %s", written, path);
+    return 1;
+}
+
+// Reports golden results that weren't produced. Returns the number of failed ids
+uint32_t golden_finish() {
+    uint32_t missing = 0;
+    for (void *iter = json_object_iter(golden_expected); iter; iter = json_object_iter_next(golden_expected, iter)) {
+        const char *key = json_object_iter_key(iter);
+        if (json_object_get(golden_seen, key)) continue;
+        fprintf(stderr, "%s: missing from input\n", key);
+        missing++;
+    }
+
+    fprintf(stderr, "golden:      %zu checked, %u mismatched, %u missing\n",
+            json_object_size(golden_seen), golden_mismatches, missing);
+
+    json_decref(golden_expected);
+    json_decref(golden_seen);
+    return golden_mismatches + missing;
+}
@@ -0,0 +1,18 @@
+#ifndef RECOGNIZER_SERVER_GOLDEN_H
+#define RECOGNIZER_SERVER_GOLDEN_H
+
+#include <stdint.h>
+#include <jansson.h>
+#include "recognize.h"
+
+uint32_t golden_load(char *path);
+
+uint32_t golden_check(json_t *id, res_metadata_t *result);
+
+uint32_t golden_add(uint32_t seq, json_t *id, res_metadata_t *result);
+
+uint32_t golden_write(char *path);
+
+uint32_t golden_finish();
+
+#endif //RECOGNIZER_SERVER_GOLDEN_H
@@ -0,0 +1,844 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include <jemalloc/jemalloc.h>
+#include "log.h"
+#include "stats.h"
+
+#define LOAD_BUFFER_SIZE 65536
+#define LOAD_MAX_SWEEP 64
+
+typedef struct load_body {
+    char *data;
+    uint32_t data_len;
+    // Sent with Content-Encoding: gzip
+    uint8_t gzip;
+} load_body_t;
+
+// One keep-alive connection with its response read buffer
+typedef struct load_conn {
+    int fd;
+    char buf[LOAD_BUFFER_SIZE];
+    uint32_t buf_pos;
+    uint32_t buf_len;
+    // Bytes of the current response received so far
+    uint64_t received;
+    uint8_t close;
+} load_conn_t;
+
+typedef struct load_run {
+    // Open loop when set: request i is due at start + i * 1e9 / rate
+    // regardless of how long earlier requests took
+    double rate;
+    uint64_t start;
+    uint64_t end;
+    uint64_t max_requests;
+    // Next request slot, shared by all connections
+    uint64_t next;
+} load_run_t;
+
+typedef struct load_worker {
+    pthread_t thread;
+    load_run_t *run;
+    load_conn_t conn;
+    uint64_t *latencies;
+    uint32_t latencies_len;
+    uint32_t latencies_size;
+    uint64_t ok;
+    uint64_t unavailable;
+    uint64_t other;
+    uint64_t errors;
+    // How late the most delayed open-loop request was sent
+    uint64_t max_lag;
+} load_worker_t;
+
+typedef struct load_result {
+    uint32_t connections;
+    uint64_t elapsed;
+    uint64_t ok;
+    uint64_t unavailable;
+    uint64_t other;
+    uint64_t errors;
+    uint64_t max_lag;
+    // Open loop requests that were due before the end but never sent
+    uint64_t missed;
+    uint64_t *latencies;
+    uint32_t latencies_len;
+} load_result_t;
+
+int log_level = 1;
+
+char *opt_host = "127.0.0.1";
+char *opt_port = "8080";
+char *opt_path = "/recognize";
+uint32_t opt_timeout = 60;
+
+struct addrinfo *load_addr = 0;
+
+load_body_t *load_bodies = 0;
+uint32_t load_bodies_len = 0;
+uint32_t load_bodies_size = 0;
+
+uint32_t load_add_body(char *data, uint32_t data_len) {
+    if (load_bodies_len == load_bodies_size) {
+        uint32_t size = load_bodies_size ? load_bodies_size * 2 : 1024;
+        load_body_t *bodies = realloc(load_bodies, sizeof(load_body_t) * size);
+        if (!bodies) return 0;
+        load_bodies = bodies;
+        load_bodies_size = size;
+    }
+
+    load_body_t *body = load_bodies + load_bodies_len++;
+    body->data = data;
+    body->data_len = data_len;
+    body->gzip = data_len >= 2 && (uint8_t) data[0] == 0x1f && (uint8_t) data[1] == 0x8b;
+    return 1;
+}
+
+char *load_read_file(char *path, uint32_t *data_len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+
+    uint32_t size = 65536;
+    uint32_t len = 0;
+    char *data = malloc(size);
+    size_t n;
+    while (data && (n = fread(data + len, 1, size - len, fp)) > 0) {
+        len += n;
+        if (len == size) {
+            size *= 2;
+            char *p = realloc(data, size);
+            if (!p) {
+                free(data);
+                fclose(fp);
+                return 0;
+            }
+            data = p;
+        }
+    }
+
+    fclose(fp);
+    *data_len = len;
+    return data;
+}
+
+// Request bodies are replayed as they are stored, so gzipped files are sent
+// compressed, like the clients do
+uint32_t load_read_dir(char *dir) {
+    struct dirent **entries;
+    int entries_len = scandir(dir, &entries, 0, alphasort);
+    if (entries_len < 0) return 0;
+
+    for (int i = 0; i < entries_len; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+        free(entries[i]);
+
+        struct stat st;
+        if (stat(path, &st) || !S_ISREG(st.st_mode)) continue;
+
+        uint32_t data_len;
+        char *data = load_read_file(path, &data_len);
+        if (!data) {
+            log_error("failed to read %s", path);
+            continue;
+        }
+        if (!data_len || !load_add_body(data, data_len)) free(data);
+    }
+
+    free(entries);
+    return 1;
+}
+
+// One request body per line, and the file itself can be gzipped
+uint32_t load_read_jsonl(char *path) {
+    gzFile file = gzopen(path, "rb");
+    if (!file) return 0;
+
+    uint32_t size = 65536;
+    char *line = malloc(size);
+    uint32_t len = 0;
+    while (line && gzgets(file, line + len, size - len)) {
+        len += strlen(line + len);
+        if (line[len - 1] != '\n' && !gzeof(file)) {
+            if (len < size - 1) continue;
+            size *= 2;
+            char *p = realloc(line, size);
+            if (!p) break;
+            line = p;
+            continue;
+        }
+
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) len--;
+        if (len) {
+            char *data = malloc(len);
+            if (!data) break;
+            memcpy(data, line, len);
+            if (!load_add_body(data, len)) {
+                free(data);
+                break;
+            }
+        }
+        len = 0;
+    }
+
+    free(line);
+    gzclose(file);
+    return 1;
+}
+
+uint32_t load_compress_bodies() {
+    for (uint32_t i = 0; i < load_bodies_len; i++) {
+        load_body_t *body = load_bodies + i;
+        if (body->gzip) continue;
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        // 16 + MAX_WBITS writes a gzip header
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return 0;
+        }
+
+        uint32_t size = deflateBound(&stream, body->data_len);
+        char *data = malloc(size);
+        if (!data) {
+            deflateEnd(&stream);
+            return 0;
+        }
+
+        stream.next_in = (Bytef *) body->data;
+        stream.avail_in = body->data_len;
+        stream.next_out = (Bytef *) data;
+        stream.avail_out = size;
+        int r = deflate(&stream, Z_FINISH);
+        deflateEnd(&stream);
+        if (r != Z_STREAM_END) {
+            free(data);
+            return 0;
+        }
+
+        free(body->data);
+        body->data = data;
+        body->data_len = stream.total_out;
+        body->gzip = 1;
+    }
+    return 1;
+}
+
+void load_close(load_conn_t *conn) {
+    if (conn->fd >= 0) close(conn->fd);
+    conn->fd = -1;
+    conn->buf_pos = 0;
+    conn->buf_len = 0;
+}
+
+uint32_t load_connect(load_conn_t *conn) {
+    conn->fd = socket(load_addr->ai_family, load_addr->ai_socktype, load_addr->ai_protocol);
+    if (conn->fd < 0) return 0;
+
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct timeval timeout = {opt_timeout, 0};
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(conn->fd, load_addr->ai_addr, load_addr->ai_addrlen)) {
+        load_close(conn);
+        return 0;
+    }
+    return 1;
+}
+
+uint32_t load_write(int fd, struct iovec *iov, int iov_len) {
+    while (iov_len) {
+        ssize_t n = writev(fd, iov, iov_len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+
+        while (iov_len && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iov_len--;
+        }
+        if (iov_len) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+// Reads more response bytes into the buffer. Returns 0 on EOF or error
+uint32_t load_fill(load_conn_t *conn) {
+    if (conn->buf_pos) {
+        memmove(conn->buf, conn->buf + conn->buf_pos, conn->buf_len - conn->buf_pos);
+        conn->buf_len -= conn->buf_pos;
+        conn->buf_pos = 0;
+    }
+    if (conn->buf_len == LOAD_BUFFER_SIZE) return 0;
+
+    ssize_t n;
+    do {
+        n = read(conn->fd, conn->buf + conn->buf_len, LOAD_BUFFER_SIZE - conn->buf_len);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return 0;
+
+    conn->buf_len += n;
+    conn->received += n;
+    return 1;
+}
+
+// Returns the next line without its line ending, or 0
+char *load_read_line(load_conn_t *conn) {
+    while (1) {
+        char *start = conn->buf + conn->buf_pos;
+        char *end = memchr(start, '\n', conn->buf_len - conn->buf_pos);
+        if (end) {
+            conn->buf_pos = end + 1 - conn->buf;
+            if (end > start && end[-1] == '\r') end--;
+            *end = 0;
+            return start;
+        }
+        if (!load_fill(conn)) return 0;
+    }
+}
+
+uint32_t load_skip(load_conn_t *conn, uint64_t len) {
+    while (len) {
+        uint32_t available = conn->buf_len - conn->buf_pos;
+        if (!available) {
+            if (!load_fill(conn)) return 0;
+            continue;
+        }
+        uint32_t n = len < available ? len : available;
+        conn->buf_pos += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Reads a whole response and discards its body. Returns the status code or 0
+int load_read_response(load_conn_t *conn) {
+    char *line = load_read_line(conn);
+    if (!line) return 0;
+
+    int major = 0, minor = 0, status = 0;
+    if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3) return 0;
+    conn->close = major == 1 && minor == 0;
+
+    int64_t content_length = -1;
+    uint8_t chunked = 0;
+    while ((line = load_read_line(conn)) && *line) {
+        char *value = strchr(line, ':');
+        if (!value) continue;
+        *value++ = 0;
+        while (*value == ' ') value++;
+
+        if (!strcasecmp(line, "Content-Length")) {
+            content_length = strtoll(value, 0, 10);
+        } else if (!strcasecmp(line, "Transfer-Encoding")) {
+            chunked = !strcasecmp(value, "chunked");
+        } else if (!strcasecmp(line, "Connection")) {
+            if (!strcasecmp(value, "close")) conn->close = 1;
+            if (!strcasecmp(value, "keep-alive")) conn->close = 0;
+        }
+    }
+    if (!line) return 0;
+
+    if (chunked) {
+        while (1) {
+            if (!(line = load_read_line(conn))) return 0;
+            uint64_t len = strtoull(line, 0, 16);
+            if (!len) break;
+            if (!load_skip(conn, len) || !(line = load_read_line(conn))) return 0;
+        }
+        // Trailers
+        while ((line = load_read_line(conn)) && *line);
+        if (!line) return 0;
+    } else if (content_length >= 0) {
+        if (!load_skip(conn, content_length)) return 0;
+    } else {
+        // The body ends when the server closes the connection
+        while (load_fill(conn)) conn->buf_pos = conn->buf_len;
+        conn->close = 1;
+    }
+
+    return status;
+}
+
+// Sends the body and waits for the response. Returns the status code,
+// or 0 on connection errors
+int load_request(load_conn_t *conn, load_body_t *body) {
+    char header[512];
+    int header_len = snprintf(header, sizeof(header),
+                              "POST %s HTTP/1.1\r\n"
+                              "Host: %s:%s\r\n"
+                              "Content-Type: application/json\r\n"
+                              "%s"
+                              "Content-Length: %u\r\n"
+                              "\r\n",
+                              opt_path, opt_host, opt_port,
+                              body->gzip ? "Content-Encoding: gzip\r\n" : "",
+                              body->data_len);
+
+    // A reused keep-alive connection can be closed by the server
+    // at any time, so it's retried once on a new connection
+    for (uint32_t attempt = 0; attempt < 2; attempt++) {
+        uint8_t reused = conn->fd >= 0;
+        if (!reused && !load_connect(conn)) return 0;
+
+        struct iovec iov[2] = {
+                {header,     header_len},
+                {body->data, body->data_len}
+        };
+
+        conn->received = 0;
+        int status = 0;
+        if (load_write(conn->fd, iov, 2)) {
+            status = load_read_response(conn);
+        }
+
+        if (status) {
+            if (conn->close) load_close(conn);
+            return status;
+        }
+
+        load_close(conn);
+        if (!reused || conn->received) return 0;
+    }
+    return 0;
+}
+
+void load_sleep_until(uint64_t ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+
+void load_add_latency(load_worker_t *worker, uint64_t latency) {
+    if (worker->latencies_len == worker->latencies_size) {
+        uint32_t size = worker->latencies_size ? worker->latencies_size * 2 : 4096;
+        uint64_t *latencies = realloc(worker->latencies, sizeof(uint64_t) * size);
+        if (!latencies) return;
+        worker->latencies = latencies;
+        worker->latencies_size = size;
+    }
+    worker->latencies[worker->latencies_len++] = latency;
+}
+
+void *load_worker(void *arg) {
+    load_worker_t *worker = arg;
+    load_run_t *run = worker->run;
+
+    while (1) {
+        uint64_t slot = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+        if (run->max_requests && slot >= run->max_requests) break;
+
+        // Latency is measured from when the request was due, not from when it
+        // was actually sent. Otherwise a stalled server would delay the requests
+        // that should have measured the stall, and hide it (coordinated omission)
+        uint64_t due;
+        if (run->rate > 0) {
+            due = run->start + (uint64_t) (slot * 1e9 / run->rate);
+            // When the connections can't keep up, the run still ends on time,
+            // and the requests that were due but never sent are reported as missed
+            if (due >= run->end || stats_now() >= run->end) break;
+            load_sleep_until(due);
+        } else {
+            due = stats_now();
+            if (due >= run->end) break;
+        }
+
+        uint64_t lag = stats_now() - due;
+        if (lag > worker->max_lag) worker->max_lag = lag;
+
+        int status = load_request(&worker->conn, &load_bodies[slot % load_bodies_len]);
+        if (!status) {
+            worker->errors++;
+            continue;
+        }
+
+        load_add_latency(worker, stats_now() - due);
+
+        if (status >= 200 && status < 300) {
+            worker->ok++;
+        } else if (status == 503) {
+            worker->unavailable++;
+        } else {
+            worker->other++;
+        }
+    }
+
+    load_close(&worker->conn);
+    return 0;
+}
+
+uint32_t load_run(uint32_t connections, double rate, uint64_t duration, uint64_t max_requests,
+                  load_result_t *result) {
+    memset(result, 0, sizeof(load_result_t));
+    result->connections = connections;
+
+    load_worker_t *workers = calloc(connections, sizeof(load_worker_t));
+    if (!workers) return 0;
+
+    load_run_t run = {0};
+    run.rate = rate;
+    run.max_requests = max_requests;
+    run.start = stats_now();
+    run.end = duration ? run.start + duration : UINT64_MAX;
+
+    uint32_t workers_len = 0;
+    for (; workers_len < connections; workers_len++) {
+        load_worker_t *worker = workers + workers_len;
+        worker->run = &run;
+        worker->conn.fd = -1;
+        if (pthread_create(&worker->thread, 0, load_worker, worker)) {
+            log_error("failed to create thread");
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < workers_len; i++) {
+        pthread_join(workers[i].thread, 0);
+    }
+
+    result->elapsed = stats_now() - run.start;
+
+    for (uint32_t i = 0; i < workers_len; i++) {
+        result->latencies_len += workers[i].latencies_len;
+    }
+    result->latencies = malloc(sizeof(uint64_t) * (result->latencies_len + 1));
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < workers_len; i++) {
+        load_worker_t *worker = workers + i;
+        if (result->latencies) {
+            memcpy(result->latencies + n, worker->latencies, sizeof(uint64_t) * worker->latencies_len);
+            n += worker->latencies_len;
+        }
+        result->ok += worker->ok;
+        result->unavailable += worker->unavailable;
+        result->other += worker->other;
+        result->errors += worker->errors;
+        if (worker->max_lag > result->max_lag) result->max_lag = worker->max_lag;
+        free(worker->latencies);
+    }
+    free(workers);
+
+    if (rate > 0 && duration) {
+        uint64_t due = (uint64_t) (rate * duration / 1e9);
+        if (max_requests && max_requests < due) due = max_requests;
+        uint64_t sent = result->ok + result->unavailable + result->other + result->errors;
+        result->missed = due > sent ? due - sent : 0;
+    }
+
+    if (!result->latencies) return 0;
+    result->latencies_len = n;
+    stats_sort_latencies(result->latencies, result->latencies_len);
+    return workers_len == connections;
+}
+
+double load_get_throughput(load_result_t *result) {
+    double seconds = result->elapsed / 1e9;
+    return seconds > 0 ? result->latencies_len / seconds : 0;
+}
+
+double load_get_percentile(load_result_t *result, double p) {
+    return stats_get_percentile(result->latencies, result->latencies_len, p) / 1e6;
+}
+
+void load_print_result(load_result_t *result, double rate) {
+    fprintf(stderr, "requests:    %u (%lu ok, %lu unavailable, %lu other, %lu errors)\n",
+            result->latencies_len, result->ok, result->unavailable, result->other, result->errors);
+    fprintf(stderr, "connections: %u\n", result->connections);
+    if (rate > 0) {
+        fprintf(stderr, "rate:        %.1f req/s target, open loop\n", rate);
+    } else {
+        fprintf(stderr, "rate:        closed loop\n");
+    }
+    fprintf(stderr, "elapsed:     %.3f s\n", result->elapsed / 1e9);
+    fprintf(stderr, "throughput:  %.1f req/s\n", load_get_throughput(result));
+    fprintf(stderr, "latency:     p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms\n",
+            load_get_percentile(result, 0.50),
+            load_get_percentile(result, 0.90),
+            load_get_percentile(result, 0.99),
+            load_get_percentile(result, 0.999),
+            load_get_percentile(result, 1.0));
+    if (rate > 0) {
+        // Large lag means there weren't enough connections to keep up with the rate,
+        // and the latencies above include the time requests waited for a connection
+        fprintf(stderr, "send lag:    max %.3f ms, %lu due requests missed\n",
+                result->max_lag / 1e6, result->missed);
+    }
+}
+
+// Runs the closed loop at each connection count, and reports the knee: the fewest
+// connections that reach 90% of the peak throughput. Beyond it, more concurrency
+// mostly adds queueing latency
+uint32_t load_sweep(uint32_t *levels, uint32_t levels_len, uint64_t duration, uint64_t warmup) {
+    load_result_t results[LOAD_MAX_SWEEP];
+
+    fprintf(stderr, "%11s %12s %10s %10s %10s %10s %8s\n",
+            "connections", "throughput", "p50 ms", "p90 ms", "p99 ms", "max ms", "errors");
+
+    double peak = 0;
+    for (uint32_t i = 0; i < levels_len; i++) {
+        load_result_t *result = results + i;
+        if (warmup) {
+            load_run(levels[i], 0, warmup, 0, result);
+            free(result->latencies);
+        }
+        if (!load_run(levels[i], 0, duration, 0, result)) return 0;
+
+        double throughput = load_get_throughput(result);
+        if (throughput > peak) peak = throughput;
+
+        fprintf(stderr, "%11u %10.1f/s %10.3f %10.3f %10.3f %10.3f %8lu\n",
+                levels[i], throughput,
+                load_get_percentile(result, 0.50),
+                load_get_percentile(result, 0.90),
+                load_get_percentile(result, 0.99),
+                load_get_percentile(result, 1.0),
+                result->errors + result->unavailable + result->other);
+    }
+
+    for (uint32_t i = 0; i < levels_len; i++) {
+        load_result_t *result = results + i;
+        if (peak > 0 && load_get_throughput(result) >= peak * 0.9) {
+            fprintf(stderr, "knee:        %u connections, %.1f req/s, p99 %.3f ms (peak %.1f req/s)\n",
+                    result->connections, load_get_throughput(result), load_get_percentile(result, 0.99), peak);
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < levels_len; i++) {
+        free(results[i].latencies);
+    }
+    return 1;
+}
+
+uint32_t load_parse_levels(char *str, uint32_t *levels, uint32_t *levels_len) {
+    *levels_len = 0;
+    char *p = str;
+    while (*p) {
+        char *end;
+        unsigned long level = strtoul(p, &end, 10);
+        if (end == p || !level || *levels_len == LOAD_MAX_SWEEP) return 0;
+        levels[(*levels_len)++] = level;
+        p = end;
+        if (*p == ',') p++;
+        else if (*p) return 0;
+    }
+    return *levels_len > 0;
+}
+
+void print_usage() {
+    printf(
+            "Missing parameters.\n" \
+            "-i\tinput JSONL file or directory with one request body per file (optionally gzipped)\n" \
+            "-H\tserver host (default 127.0.0.1)\n" \
+            "-p\tserver port (default 8080)\n" \
+            "-u\trequest path (default /recognize)\n" \
+            "-c\tconnections (default 16)\n" \
+            "-r\ttarget rate in requests per second for an open loop (default closed loop)\n" \
+            "-T\tduration in seconds (default 10, or unlimited with -n)\n" \
+            "-n\tstop after this many requests\n" \
+            "-w\twarmup in seconds, not measured (default 0)\n" \
+            "-S\tclosed loop sweep over these connection counts, e.g. 1,2,4,8,16\n" \
+            "-z\tgzip the bodies that aren't compressed yet\n" \
+            "-x\tsocket timeout in seconds (default 60)\n" \
+            "-l\tlog level\n" \
+            "Usage example:\n" \
+            "recognizer-load -i requests.jsonl -p 8003 -c 32 -T 30\n" \
+            "recognizer-load -i requests.jsonl -p 8003 -r 200 -c 64 -T 30\n" \
+            "recognizer-load -i requests.jsonl -p 8003 -S 1,2,4,8,16,32 -T 10\n"
+    );
+}
+
+int main(int argc, char **argv) {
+    char *opt_input = 0;
+    char *opt_sweep = 0;
+    uint32_t opt_connections = 16;
+    double opt_rate = 0;
+    double opt_duration = 0;
+    double opt_warmup = 0;
+    uint64_t opt_max_requests = 0;
+    uint8_t opt_gzip = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:H:p:u:c:r:T:n:w:S:zx:l:")) != -1) {
+        switch (opt) {
+            case 'i':
+                opt_input = optarg;
+                break;
+            case 'H':
+                opt_host = optarg;
+                break;
+            case 'p':
+                opt_port = optarg;
+                break;
+            case 'u':
+                opt_path = optarg;
+                break;
+            case 'c':
+                opt_connections = strtoul(optarg, 0, 10);
+                break;
+            case 'r':
+                opt_rate = strtod(optarg, 0);
+                break;
+            case 'T':
+                opt_duration = strtod(optarg, 0);
+                break;
+            case 'n':
+                opt_max_requests = strtoull(optarg, 0, 10);
+                break;
+            case 'w':
+                opt_warmup = strtod(optarg, 0);
+                break;
+            case 'S':
+                opt_sweep = optarg;
+                break;
+            case 'z':
+                opt_gzip = 1;
+                break;
+            case 'x':
+                opt_timeout = strtoul(optarg, 0, 10);
+                break;
+            case 'l':
+                if (optarg) {
+                    log_level = strtol(optarg, 0, 10);
+                }
+                break;
+            default:
+                print_usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!opt_input || !opt_connections) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    uint32_t levels[LOAD_MAX_SWEEP];
+    uint32_t levels_len = 0;
+    if (opt_sweep && !load_parse_levels(opt_sweep, levels, &levels_len)) {
+        log_error("invalid sweep %s", opt_sweep);
+        return EXIT_FAILURE;
+    }
+
+    if (opt_sweep && opt_rate > 0) {
+        log_error("the sweep runs a closed loop and can't be combined with a rate");
+        return EXIT_FAILURE;
+    }
+
+    if (!opt_duration && (!opt_max_requests || opt_sweep)) {
+        opt_duration = 10;
+    }
+
+    struct stat st;
+    if (stat(opt_input, &st)) {
+        log_error("failed to open input %s", opt_input);
+        return EXIT_FAILURE;
+    }
+
+    if (!(S_ISDIR(st.st_mode) ? load_read_dir(opt_input) : load_read_jsonl(opt_input))) {
+        log_error("failed to read input %s", opt_input);
+        return EXIT_FAILURE;
+    }
+
+    if (!load_bodies_len) {
+        log_error("no request bodies in %s", opt_input);
+        return EXIT_FAILURE;
+    }
+
+    if (opt_gzip && !load_compress_bodies()) {
+        log_error("failed to compress request bodies");
+        return EXIT_FAILURE;
+    }
+
+    log_info("loaded %u request bodies", load_bodies_len);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int r = getaddrinfo(opt_host, opt_port, &hints, &load_addr);
+    if (r) {
+        log_error("failed to resolve %s:%s: %s", opt_host, opt_port, gai_strerror(r));
+        return EXIT_FAILURE;
+    }
+
+    // Writes to connections closed by the server must fail instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    uint64_t duration = (uint64_t) (opt_duration * 1e9);
+    uint64_t warmup = (uint64_t) (opt_warmup * 1e9);
+
+    if (opt_sweep) {
+        if (!load_sweep(levels, levels_len, duration, warmup)) {
+            log_error("sweep failed");
+            return EXIT_FAILURE;
+        }
+        freeaddrinfo(load_addr);
+        return EXIT_SUCCESS;
+    }
+
+    load_result_t result;
+    if (warmup) {
+        load_run(opt_connections, opt_rate, warmup, 0, &result);
+        free(result.latencies);
+    }
+
+    if (!load_run(opt_connections, opt_rate, duration, opt_max_requests, &result)) {
+        log_error("load run failed");
+        return EXIT_FAILURE;
+    }
+
+    load_print_result(&result, opt_rate);
+    free(result.latencies);
+    freeaddrinfo(load_addr);
+    return result.latencies_len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
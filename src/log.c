@@ -0,0 +1,266 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <jemalloc/jemalloc.h>
+#include "log.h"
+
+// Without log_start, lines are written synchronously, which suits the command line tools.
+// After it, each thread formats its message into its own ring buffer, and a background
+// thread adds the timestamp and writes it out. Logging then takes no locks and makes no
+// system calls on the request path. A full ring drops messages instead of blocking
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_MAX_MESSAGE 4096
+#define LOG_DRAIN_INTERVAL_NS 10000000
+
+typedef struct log_record {
+    // Record size including this header and padding, or 0 to wrap to the ring start
+    uint32_t size;
+    uint32_t message_len;
+    uint32_t tid;
+    uint32_t line;
+    int64_t time;
+    const char *level_name;
+    const char *file;
+    const char *func;
+    char message[];
+} log_record_t;
+
+// Single producer (the owning thread) and single consumer (the drain thread)
+typedef struct log_ring {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    // Rings of exited threads are reused by new ones
+    uint32_t in_use;
+    struct log_ring *next;
+    uint8_t data[LOG_RING_SIZE];
+} log_ring_t;
+
+uint8_t log_async = 0;
+log_ring_t *log_rings = 0;
+pthread_key_t log_ring_key;
+pthread_t log_thread;
+// Serializes draining between the drain thread and log_flush
+pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+__thread log_ring_t *log_ring = 0;
+__thread uint32_t log_tid = 0;
+
+uint32_t log_get_tid() {
+    if (!log_tid) log_tid = syscall(__NR_gettid);
+    return log_tid;
+}
+
+void log_release_ring(void *ptr) {
+    log_ring_t *ring = ptr;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+log_ring_t *log_get_ring() {
+    if (log_ring) return log_ring;
+
+    log_ring_t *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&ring->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+
+    if (!ring) {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (!ring) return 0;
+        ring->in_use = 1;
+
+        // Rings are only added, never removed, so a lock-free push is enough
+        log_ring_t *head = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+        do {
+            ring->next = head;
+        } while (!__atomic_compare_exchange_n(&log_rings, &head, ring, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    }
+
+    pthread_setspecific(log_ring_key, ring);
+    log_ring = ring;
+    return ring;
+}
+
+void log_format_time(int64_t time, char *time_buf, uint32_t time_buf_size) {
+    struct tm tm;
+    localtime_r((time_t *) &time, &tm);
+    strftime(time_buf, time_buf_size, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
+void log_print(FILE *fp, uint32_t tid, const char *level_name, const char *time_buf, const char *file, uint32_t line,
+               const char *func, const char *message, uint32_t message_len) {
+    fprintf(fp, "[%u] [%s] %s %s:%u (%s): %.*s\n", tid, level_name, time_buf, file, line, func,
+            (int) message_len, message);
+}
+
+void log_push(log_ring_t *ring, const char *level_name, const char *file, int line, const char *func,
+              const char *message, uint32_t message_len) {
+    uint32_t size = (sizeof(log_record_t) + message_len + 7) & ~7u;
+
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    uint32_t pos = head % LOG_RING_SIZE;
+    uint32_t contiguous = LOG_RING_SIZE - pos;
+    uint32_t needed = contiguous < size ? contiguous + size : size;
+
+    if (head + needed - tail > LOG_RING_SIZE) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (contiguous < size) {
+        ((log_record_t *) (ring->data + pos))->size = 0;
+        head += contiguous;
+        pos = 0;
+    }
+
+    log_record_t *record = (log_record_t *) (ring->data + pos);
+    record->size = size;
+    record->message_len = message_len;
+    record->tid = log_get_tid();
+    record->line = line;
+    record->time = time(0);
+    record->level_name = level_name;
+    record->file = file;
+    record->func = func;
+    memcpy(record->message, message, message_len);
+
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+void log_write(const char *level_name, const char *file, int line, const char *func, const char *fmt, ...) {
+    char message[LOG_MAX_MESSAGE];
+
+    va_list args;
+    va_start(args, fmt);
+    int message_len = vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+
+    if (message_len < 0) return;
+    // Longer messages are truncated
+    if (message_len >= sizeof(message)) message_len = sizeof(message) - 1;
+
+    log_ring_t *ring = log_async ? log_get_ring() : 0;
+    if (ring) {
+        log_push(ring, level_name, file, line, func, message, message_len);
+        return;
+    }
+
+    char time_buf[20];
+    log_format_time(time(0), time_buf, sizeof(time_buf));
+    log_print(stderr, log_get_tid(), level_name, time_buf, file, line, func, message, message_len);
+}
+
+// Writes out everything the rings contain. Returns the number of lines written
+uint32_t log_drain() {
+    // Timestamps only change once per second, so the formatted one is reused
+    static int64_t last_time = -1;
+    static char time_buf[20];
+    static uint64_t reported_dropped = 0;
+
+    uint32_t lines = 0;
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&log_drain_mutex);
+
+    log_ring_t *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+
+        while (tail != head) {
+            uint32_t pos = tail % LOG_RING_SIZE;
+            log_record_t *record = (log_record_t *) (ring->data + pos);
+            if (!record->size) {
+                tail += LOG_RING_SIZE - pos;
+                continue;
+            }
+
+            if (record->time != last_time) {
+                last_time = record->time;
+                log_format_time(last_time, time_buf, sizeof(time_buf));
+            }
+
+            log_print(stderr, record->tid, record->level_name, time_buf, record->file, record->line,
+                      record->func, record->message, record->message_len);
+            tail += record->size;
+            lines++;
+        }
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    if (dropped != reported_dropped) {
+        fprintf(stderr, "[%u] [err] %lu log messages dropped\n", log_get_tid(), dropped - reported_dropped);
+        reported_dropped = dropped;
+    }
+
+    if (lines) fflush(stderr);
+
+    pthread_mutex_unlock(&log_drain_mutex);
+    return lines;
+}
+
+void *log_drain_thread(void *arg) {
+    struct timespec interval = {0, LOG_DRAIN_INTERVAL_NS};
+    while (1) {
+        if (!log_drain()) nanosleep(&interval, 0);
+    }
+    return 0;
+}
+
+void log_flush() {
+    if (log_async) log_drain();
+    fflush(stderr);
+}
+
+// Switches to asynchronous logging. Everything logged is flushed on exit
+uint32_t log_start() {
+    if (log_async) return 1;
+
+    if (pthread_key_create(&log_ring_key, log_release_ring)) return 0;
+
+    // Shutdown signals must not interrupt the drain thread while it holds the drain mutex
+    sigset_t set, old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    int err = pthread_create(&log_thread, 0, log_drain_thread, 0);
+    pthread_sigmask(SIG_SETMASK, &old_set, 0);
+    if (err) return 0;
+    pthread_detach(log_thread);
+
+    atexit(log_flush);
+    log_async = 1;
+    return 1;
+}
@@ -22,6 +22,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <pthread.h>
@@ -37,48 +38,291 @@
 #include "log.h"
 #include "word.h"
 #include "journal.h"
+#include "stats.h"
+#include "result.h"
+#include "pool.h"
+#include "cache.h"
+#include "flight.h"
+#include "writer.h"
+#include "deadline.h"
+#include "session.h"
+#include "task.h"
+
+// Decompressed size limit for single documents and for batches
+#define MAX_UNCOMPRESSED_SIZE (4 * 1024 * 1024)
+#define MAX_BATCH_UNCOMPRESSED_SIZE (256 * 1024 * 1024)
+
+// Connection threads mostly wait for clients or workers, so there are many more of them
+#define DEFAULT_IO_THREADS 64
+
+// Outcomes of get_result()
+#define RESULT_INVALID 0
+#define RESULT_OK 1
+#define RESULT_REJECTED 2
+
+// Documents that can be finished ahead of the one written next, per worker
+#define BATCH_WINDOW_PER_WORKER 4
+
+// Document recognized on a worker, for a connection thread that waits for it
+typedef struct recognize_job {
+    const char *data;
+    uint32_t data_len;
+    json_t *root;
+    recognize_options_t *options;
+    uint64_t deadline;
+    uint64_t hash;
+    res_metadata_t *result;
+    uint32_t status;
+    // Set when the job leads identical requests, which it's finished for on the worker
+    flight_t *flight;
+} recognize_job_t;
+
+typedef struct batch_item {
+    // NDJSON line, or the parsed document for JSON array input
+    const char *data;
+    uint32_t data_len;
+    json_t *body;
+} batch_item_t;
+
+// A batch document between its submission and its result line. The connection thread
+// keeps a window of them, and reuses each once its line is written
+typedef struct batch_slot {
+    recognize_job_t job;
+    pool_job_t pool_job;
+    flight_t flight;
+    res_metadata_t result;
+    // Whether the result came from the cache or an identical request, so the worker only parses the document
+    uint8_t ready;
+    uint8_t invalid;
+    json_t *id;
+    uint64_t started_at;
+    uint32_t us;
+} batch_slot_t;
+
+// Pages of a session request, checked and recognized on a worker
+typedef struct session_job {
+    session_t *session;
+    // New pages, and the index of the first one
+    json_t *pages;
+    uint32_t page_i;
+    uint8_t final;
+    recognize_options_t *options;
+    uint64_t deadline;
+    uint8_t done;
+    res_metadata_t result;
+    uint32_t us;
+} session_job_t;
 
 int log_level = 1;
 onion *on = NULL;
+// Recognition time budget in ms, 0 for none
+uint32_t time_budget = 0;
+// Whether requests are recognized in identifier-first mode by default
+uint8_t identifier_first = 0;
+
+// Inflates gzip data into a new zero terminated buffer, or returns 0
+// if the data is invalid or inflates to more than max_size
+char *decompress_data(const char *data, uint32_t data_len, uint32_t max_size, uint32_t *uncompressed_len) {
+    z_stream zStream;
+    memset(&zStream, 0, sizeof(zStream));
+    if (inflateInit2(&zStream, 16 + MAX_WBITS) != Z_OK) return 0;
+
+    uint32_t size = data_len * 4 + 4096;
+    if (size > max_size) size = max_size;
+    char *uncompressed_data = malloc(size);
+
+    zStream.next_in = (Bytef *) data;
+    zStream.avail_in = data_len;
+
+    int r = Z_OK;
+    while (uncompressed_data) {
+        zStream.next_out = (Bytef *) uncompressed_data + zStream.total_out;
+        zStream.avail_out = size - 1 - zStream.total_out;
+
+        r = inflate(&zStream, Z_FINISH);
+        if (r == Z_STREAM_END || (r != Z_OK && r != Z_BUF_ERROR) || zStream.avail_out) break;
 
-json_t *authors_to_json(uint8_t *authors) {
-    json_t *json_authors = json_array();
-    uint8_t *p = authors;
-    uint8_t *s;
-
-    uint8_t *first_name = 0, *last_name = 0;
-    uint32_t first_name_len = 0, last_name_len = 0;
-
-    while (1) {
-        while (*p == '\t' || *p == '\n') p++;
-        if (!*p) break;
-        s = p;
-        while (*p && *p != '\t' && *p != '\n') p++;
-
-        if (*p == '\t') {
-            first_name = s;
-            first_name_len = p - s;
-        } else {
-            last_name = s;
-            last_name_len = p - s;
-            json_t *json_author = json_object();
-            json_object_set(json_author, "firstName", json_stringn(first_name, first_name_len));
-            json_object_set(json_author, "lastName", json_stringn(last_name, last_name_len));
-            json_array_append(json_authors, json_author);
-            first_name = 0;
-            last_name = 0;
+        if (size >= max_size) {
+            r = Z_BUF_ERROR;
+            break;
         }
 
-        if (!*p) break;
+        size = size * 2 < max_size ? size * 2 : max_size;
+        char *p = realloc(uncompressed_data, size);
+        if (!p) break;
+        uncompressed_data = p;
+    }
+
+    inflateEnd(&zStream);
+
+    if (r != Z_STREAM_END) {
+        free(uncompressed_data);
+        return 0;
     }
-    return json_authors;
+
+    uncompressed_data[zStream.total_out] = 0;
+    *uncompressed_len = zStream.total_out;
+    return uncompressed_data;
 }
 
-onion_connection_status url_recognize(void *_, onion_request *req, onion_response *res) {
-    if (!(onion_request_get_flags(req) & OR_POST)) {
-        return OCS_PROCESSED;
+// Timings are returned when requested with "timings" query parameter or "X-Timings" header
+uint32_t is_timings_requested(onion_request *req) {
+    const char *value = onion_request_get_query(req, "timings");
+    if (!value) value = onion_request_get_header(req, "X-Timings");
+    return value && strcmp(value, "0") && strcmp(value, "false");
+}
+
+// Fields are selected with "fields" query parameter or "X-Fields" header, as a comma
+// separated list of result field names. All fields are returned by default.
+// Identifier-first mode is set with -e, and can be overridden with "identifier_first"
+// query parameter or "X-Identifier-First" header. Returns 0 for invalid fields
+uint32_t get_recognize_options(onion_request *req, recognize_options_t *options) {
+    options->identifier_first = identifier_first;
+    const char *value = onion_request_get_query(req, "identifier_first");
+    if (!value) value = onion_request_get_header(req, "X-Identifier-First");
+    if (value) options->identifier_first = strcmp(value, "0") && strcmp(value, "false");
+
+    value = onion_request_get_query(req, "fields");
+    if (!value) value = onion_request_get_header(req, "X-Fields");
+    if (!value) {
+        options->fields = FIELDS_ALL;
+        return 1;
+    }
+    return result_parse_fields(value, &options->fields) && options->fields;
+}
+
+onion_connection_status respond_error(onion_response *res, int code, const char *error) {
+    onion_response_set_code(res, code);
+    onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
+    onion_response_printf(res, "{\"error\": \"%s\"}", error);
+    return OCS_PROCESSED;
+}
+
+onion_connection_status reject_fields(onion_response *res) {
+    return respond_error(res, 400, "invalid fields");
+}
+
+// The budget is set with -b, and clients can lower it with "X-Time-Budget" header in ms.
+// Returns the budget in ns, or 0 for none
+uint64_t get_time_budget(onion_request *req) {
+    uint64_t budget = time_budget;
+    const char *value = onion_request_get_header(req, "X-Time-Budget");
+    if (value) {
+        uint64_t requested = strtoull(value, 0, 10);
+        if (requested && (!budget || requested < budget)) budget = requested;
+    }
+    return budget * 1000000;
+}
+
+// Parses the document unless it's already parsed, and recognizes it. Runs on a worker
+void run_recognize_job(void *arg) {
+    recognize_job_t *job = arg;
+    json_t *root = job->root;
+
+    deadline_begin(job->deadline);
+    // Time spent waiting for a worker counts against the budget too
+    deadline_check(STATS_QUEUE_WAIT);
+
+    json_t *parsed = 0;
+    if (!root) {
+        uint64_t t = stats_now();
+        json_error_t error;
+        root = parsed = json_loadb(job->data, job->data_len, 0, &error);
+        stats_lap(STATS_JSON_PARSE, t);
+        deadline_check(STATS_JSON_PARSE);
+    }
+
+    if (root && json_is_object(root)) {
+        res_metadata_t *result = job->result;
+
+        uint64_t t = stats_now();
+        recognize(root, job->options, result);
+        stats_lap(STATS_RECOGNIZE, t);
+        job->status = RESULT_OK;
+
+        result_keep_fields(result, job->options->fields);
+
+        result->partial = deadline_is_exhausted();
+
+        // Partial results depend on the budget and load, so only complete ones are reused.
+        // Documents without their raw bytes have no hash to be cached by
+        if (job->hash && cache_is_enabled() && !result->partial) cache_put(job->hash, result);
     }
 
+    deadline_end();
+
+    if (parsed) json_decref(parsed);
+
+    if (job->flight) flight_finish(job->flight, job->result, job->status);
+}
+
+// Takes the result from the cache or from an identical request in flight. Returns 1 once
+// job->result and job->status are set, and otherwise the job has to be run on a worker,
+// as the leader of identical requests if job->flight is set
+uint32_t prepare_result(recognize_job_t *job, flight_t *flight) {
+    uint64_t hash = job->data ? cache_get_hash(job->data, job->data_len) : 0;
+    // Results recognized with other options are kept apart from the default ones
+    uint64_t options_key = (job->options->fields ^ FIELDS_ALL) | (uint64_t) job->options->identifier_first << 32;
+    if (hash && options_key) hash ^= options_key * 0x9E3779B97F4A7C15ull;
+    job->hash = hash;
+
+    if (hash && cache_is_enabled() && cache_get(hash, job->result)) {
+        job->status = RESULT_OK;
+        return 1;
+    }
+
+    // Followers wait on their connection thread, without taking a worker
+    flight_t *leader = hash ? flight_join(flight, hash, job->deadline) : 0;
+    if (!leader) {
+        job->flight = hash ? flight : 0;
+        return 0;
+    }
+
+    uint64_t leader_deadline = leader->deadline;
+    job->status = flight_wait(leader, job->result);
+    // A result the leader ran out of time for only does for a budget that isn't larger,
+    // and otherwise the document is recognized again, without coalescing
+    if (job->status != RESULT_OK || !job->result->partial || (job->deadline && job->deadline <= leader_deadline)) {
+        return 1;
+    }
+    memset(job->result, 0, sizeof(res_metadata_t));
+    job->status = RESULT_INVALID;
+    return 0;
+}
+
+// Takes the result from the cache or from an identical request in flight, and only
+// recognizes the document otherwise, on a worker. The document is parsed from data
+// unless root is given. Requests are rejected when the queue is full. Recognition stops
+// at the deadline (0 for none) and marks the result partial. Returns RESULT_*
+uint32_t get_result(const char *data, uint32_t data_len, json_t *root, recognize_options_t *options,
+                    uint64_t deadline, res_metadata_t *result) {
+    flight_t flight;
+    recognize_job_t job = {data, data_len, root, options, deadline, 0, result, RESULT_INVALID, 0};
+    if (prepare_result(&job, &flight)) return job.status;
+
+    if (!pool_run(run_recognize_job, &job)) {
+        job.status = RESULT_REJECTED;
+        // Requests waiting for this one are rejected with it
+        if (job.flight) flight_finish(job.flight, result, job.status);
+    }
+
+    return job.status;
+}
+
+// Responses are compact unless requested with "pretty" query parameter
+uint32_t is_pretty_requested(onion_request *req) {
+    const char *value = onion_request_get_query(req, "pretty");
+    return value && strcmp(value, "0") && strcmp(value, "false");
+}
+
+// Overloaded clients are asked to retry, instead of waiting behind a long queue
+onion_connection_status reject_request(onion_response *res) {
+    onion_response_set_header(res, "Retry-After", "1");
+    return respond_error(res, 503, "overloaded");
+}
+
+onion_connection_status process_recognize(onion_request *req, onion_response *res, stats_request_t *stats_request,
+                                          recognize_options_t *options, uint64_t deadline) {
     const onion_block *dreq = onion_request_get_data(req);
     if (!dreq) return OCS_PROCESSED;
 
@@ -96,94 +340,519 @@ onion_connection_status url_recognize(void *_, onion_request *req, onion_respons
 
     char *uncompressed_data = 0;
 
+    uint64_t t = stats_now();
+
     if (content_encoding && !strcmp(content_encoding, "gzip")) {
-        uLong compSize = data_len;
-        uLongf ucompSize = 4096 * 1024;
-        uncompressed_data = calloc(4096, 1024);
+        uncompressed_data = decompress_data(data, data_len, MAX_UNCOMPRESSED_SIZE, &data_len);
+        if (!uncompressed_data) return OCS_PROCESSED;
+
+        d = uncompressed_data;
 
-        z_stream zStream;
-        memset(&zStream, 0, sizeof(zStream));
-        inflateInit2(&zStream, 16);
+        t = stats_lap(STATS_DECOMPRESS, t);
+    }
 
-        zStream.next_in = (Bytef *) data;
-        zStream.avail_in = compSize;
-        zStream.next_out = (Bytef *) uncompressed_data;
-        zStream.avail_out = ucompSize - 1;
+    res_metadata_t result = {0};
+    uint32_t status = get_result(d, data_len, 0, options, deadline, &result);
+    if (status != RESULT_OK) {
+        free(uncompressed_data);
+        return status == RESULT_REJECTED ? reject_request(res) : OCS_PROCESSED;
+    }
 
-        int r;
-        r = inflate(&zStream, Z_FINISH);
-        if (r != Z_OK && r != Z_STREAM_END) {
-            free(uncompressed_data);
-            return OCS_PROCESSED;
+    uint32_t us = (stats_now() - t) / 1000;
+
+    writer_t *writer = writer_get_thread(is_pretty_requested(req) ? 1 : 0);
+    if (!writer) {
+        free(uncompressed_data);
+        return OCS_INTERNAL_ERROR;
+    }
+
+    writer_begin_object(writer);
+    writer_key(writer, "time");
+    writer_integer(writer, us);
+    result_write(&result, options->fields, writer);
+
+    if (is_timings_requested(req)) {
+        json_t *timings = timings_to_json(stats_request);
+        writer_key(writer, "timings");
+        writer_json(writer, timings);
+        json_decref(timings);
+    }
+
+    writer_end_object(writer);
+
+    if (writer->failed) {
+        free(uncompressed_data);
+        return OCS_INTERNAL_ERROR;
+    }
+
+    log_debug("\n%s", writer->data);
+
+    onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
+    onion_response_write(res, writer->data, writer->len);
+
+    if (uncompressed_data) free(uncompressed_data);
+
+    return OCS_PROCESSED;
+}
+
+onion_connection_status url_recognize(void *_, onion_request *req, onion_response *res) {
+    if (!(onion_request_get_flags(req) & OR_POST)) {
+        return OCS_PROCESSED;
+    }
+
+    recognize_options_t options = {0};
+    if (!get_recognize_options(req, &options)) return reject_fields(res);
+
+    // Workers add their stages to the request of the connection thread they run the job for
+    stats_request_t stats_request = {0};
+    stats_begin_request(&stats_request);
+
+    uint64_t budget = get_time_budget(req);
+    uint64_t deadline = budget ? stats_now() + budget : 0;
+
+    onion_connection_status status = process_recognize(req, res, &stats_request, &options, deadline);
+    stats_end_request();
+    return status;
+}
+
+// Parses a batch document for its "id", and recognizes it unless its result is already done. Runs on a worker
+void run_batch_job(void *arg) {
+    batch_slot_t *slot = arg;
+    recognize_job_t *job = &slot->job;
+
+    json_t *root = job->root;
+    json_t *parsed = 0;
+    if (!root) {
+        uint64_t t = stats_now();
+        json_error_t error;
+        root = parsed = json_loadb(job->data, job->data_len, 0, &error);
+        stats_lap(STATS_JSON_PARSE, t);
+    }
+
+    if (root && json_is_object(root)) {
+        slot->id = json_object_get(root, "id");
+        if (slot->id) json_incref(slot->id);
+
+        if (!slot->ready) {
+            job->root = root;
+            run_recognize_job(job);
+        }
+    } else {
+        slot->invalid = 1;
+        // Identical requests can't do better with the same bytes
+        if (job->flight) flight_finish(job->flight, job->result, RESULT_INVALID);
+    }
+
+    if (parsed) json_decref(parsed);
+
+    slot->us = (stats_now() - slot->started_at) / 1000;
+}
+
+// Takes the document's result from the cache or an identical request, and queues it for a
+// worker. Documents were admitted with the batch, so they are never rejected
+void batch_start(batch_slot_t *slot, batch_item_t *item, recognize_options_t *options, uint64_t budget) {
+    memset(slot, 0, sizeof(batch_slot_t));
+    slot->started_at = stats_now();
+
+    recognize_job_t *job = &slot->job;
+    // Only NDJSON lines have their raw bytes to hash
+    job->data = item->data;
+    job->data_len = item->data_len;
+    job->root = item->body;
+    job->options = options;
+    job->deadline = budget ? slot->started_at + budget : 0;
+    job->result = &slot->result;
+
+    slot->ready = prepare_result(job, &slot->flight);
+    // The document is recognized itself when the request it waited for was rejected
+    if (slot->ready && job->status == RESULT_REJECTED) {
+        memset(&slot->result, 0, sizeof(res_metadata_t));
+        slot->ready = 0;
+    }
+
+    pool_start(&slot->pool_job, run_batch_job, slot, 0);
+}
+
+// Waits for the document and writes its result line, unless res is 0 because
+// the client is gone. Returns 0 if the line can't be written
+uint32_t batch_finish(batch_slot_t *slot, uint32_t index, onion_response *res) {
+    pool_wait(&slot->pool_job);
+
+    json_t *id = slot->id;
+    uint8_t invalid = slot->invalid;
+    slot->id = 0;
+
+    writer_t *writer = res ? writer_get_thread(0) : 0;
+    if (!writer) {
+        if (id) json_decref(id);
+        return 0;
+    }
+
+    writer_begin_object(writer);
+    writer_key(writer, "index");
+    writer_integer(writer, index);
+
+    if (invalid) {
+        writer_key(writer, "error");
+        writer_string(writer, "invalid json", strlen("invalid json"));
+    } else {
+        if (id) {
+            writer_key(writer, "id");
+            writer_json(writer, id);
         }
 
-        r = inflateEnd(&zStream);
-        if (r != Z_OK) {
-            free(uncompressed_data);
-            return OCS_PROCESSED;
+        writer_key(writer, "time");
+        writer_integer(writer, slot->us);
+        result_write(&slot->result, slot->job.options->fields, writer);
+    }
+
+    writer_end_object(writer);
+
+    if (id) json_decref(id);
+
+    // A line that failed to serialize is skipped, like before
+    if (writer->failed) return 1;
+    return onion_response_write(res, writer->data, writer->len) >= 0 && onion_response_write(res, "\n", 1) >= 0;
+}
+
+// Splits the body into documents: a JSON array, or one document per line
+uint32_t get_batch_items(char *data, uint32_t data_len, json_t **array, batch_item_t **items, uint32_t *items_len) {
+    *array = 0;
+    *items = 0;
+    *items_len = 0;
+
+    uint32_t i = 0;
+    while (i < data_len && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r' || data[i] == '\n')) i++;
+
+    if (i < data_len && data[i] == '[') {
+        json_error_t error;
+        *array = json_loadb(data, data_len, 0, &error);
+        if (!*array || !json_is_array(*array)) return 0;
+
+        *items_len = json_array_size(*array);
+        *items = calloc(*items_len + 1, sizeof(batch_item_t));
+        if (!*items) return 0;
+
+        for (uint32_t j = 0; j < *items_len; j++) {
+            (*items)[j].body = json_array_get(*array, j);
         }
+        return 1;
+    }
 
-        d = uncompressed_data;
+    uint32_t items_size = 0;
+    char *line = data;
+    char *end = data + data_len;
+    while (line < end) {
+        char *next = memchr(line, '\n', end - line);
+        if (!next) next = end;
+
+        uint32_t line_len = next - line;
+        while (line_len && (line[line_len - 1] == '\r' || line[line_len - 1] == ' ')) line_len--;
+
+        if (line_len) {
+            if (*items_len == items_size) {
+                items_size = items_size ? items_size * 2 : 64;
+                batch_item_t *p = realloc(*items, sizeof(batch_item_t) * items_size);
+                if (!p) return 0;
+                *items = p;
+            }
+            batch_item_t *item = *items + (*items_len)++;
+            memset(item, 0, sizeof(batch_item_t));
+            item->data = line;
+            item->data_len = line_len;
+        }
+
+        line = next + 1;
     }
 
-    json_t *root;
-    json_error_t error;
-    root = json_loads(d, 0, &error);
+    return 1;
+}
 
-    if (!root || !json_is_object(root)) {
+// Results are streamed as NDJSON in input order, each tagged with the document index
+// and its "id" if it has one. The connection thread keeps a window of documents queued
+// for the workers, up to the queue depth but always at least one, and writes each
+// result once the documents before it are written. The window bounds how many finished
+// results can wait for a slower earlier document
+onion_connection_status url_recognize_batch(void *_, onion_request *req, onion_response *res) {
+    if (!(onion_request_get_flags(req) & OR_POST)) {
         return OCS_PROCESSED;
     }
 
-    struct timeval st, et;
+    recognize_options_t options = {0};
+    if (!get_recognize_options(req, &options)) return reject_fields(res);
 
-    res_metadata_t result = {0};
-    uint32_t rc;
+    if (pool_is_full()) {
+        stats_count(STATS_REJECTED_REQUESTS, 1);
+        return reject_request(res);
+    }
 
-    gettimeofday(&st, NULL);
-    rc = recognize(root, &result);
-    gettimeofday(&et, NULL);
+    const onion_block *dreq = onion_request_get_data(req);
+    if (!dreq) return OCS_PROCESSED;
 
-    json_decref(root);
+    char *data = (char *) onion_block_data(dreq);
+    uint32_t data_len = onion_block_size(dreq);
+    char *uncompressed_data = 0;
 
-    uint32_t us = ((et.tv_sec - st.tv_sec) * 1000000) + (et.tv_usec - st.tv_usec);
+    const char *content_encoding = onion_request_get_header(req, "Content-Encoding");
+    if (content_encoding && !strcmp(content_encoding, "gzip")) {
+        uint64_t t = stats_now();
+        uncompressed_data = decompress_data(data, data_len, MAX_BATCH_UNCOMPRESSED_SIZE, &data_len);
+        if (!uncompressed_data) return OCS_PROCESSED;
+        data = uncompressed_data;
+        stats_lap(STATS_DECOMPRESS, t);
+    }
 
-    json_t *obj = json_object();
+    json_t *array;
+    batch_item_t *items;
+    uint32_t items_len;
+    if (!get_batch_items(data, data_len, &array, &items, &items_len)) {
+        if (array) json_decref(array);
+        free(items);
+        free(uncompressed_data);
+        return respond_error(res, 400, "invalid batch");
+    }
 
-    json_object_set_new(obj, "time", json_integer(us));
-
-    if (*result.type) json_object_set(obj, "type", json_string(result.type));
-    json_object_set(obj, "title", json_string(result.title));
-    json_object_set(obj, "authors", authors_to_json(result.authors));
-    if (*result.doi) json_object_set(obj, "doi", json_string(result.doi));
-    if (*result.isbn) json_object_set(obj, "isbn", json_string(result.isbn));
-    if (*result.arxiv) json_object_set(obj, "arxiv", json_string(result.arxiv));
-    if (*result.abstract) json_object_set(obj, "abstract", json_string(result.abstract));
-    if (*result.year) json_object_set(obj, "year", json_string(result.year));
-    if (*result.container) json_object_set(obj, "container", json_string(result.container));
-    if (*result.publisher) json_object_set(obj, "publisher", json_string(result.publisher));
-    if (*result.pages) json_object_set(obj, "pages", json_string(result.pages));
-    if (*result.volume) json_object_set(obj, "volume", json_string(result.volume));
-    if (*result.issue) json_object_set(obj, "issue", json_string(result.issue));
-    if (*result.issn) json_object_set(obj, "issn", json_string(result.issue));
-    if (*result.url) json_object_set(obj, "url", json_string(result.url));
+    uint32_t window = pool_get_workers() * BATCH_WINDOW_PER_WORKER;
+    batch_slot_t *slots = malloc(sizeof(batch_slot_t) * window);
+    if (!slots) {
+        if (array) json_decref(array);
+        free(items);
+        free(uncompressed_data);
+        return OCS_INTERNAL_ERROR;
+    }
 
-    char *str = json_dumps(obj, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
-    json_decref(obj);
+    uint64_t budget = get_time_budget(req);
 
-    log_debug("\n%s", str);
+    onion_response_set_header(res, "Content-Type", "application/x-ndjson; charset=utf-8");
 
-    onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
-    onion_response_printf(res, "%s", str);
-    free(str);
+    // Documents started, and written
+    uint32_t next = 0;
+    uint32_t written = 0;
+    uint8_t cancelled = 0;
+    while (written < next || (next < items_len && !cancelled)) {
+        // More documents only go to a full queue when none of the batch's are left in it
+        while (!cancelled && next < items_len && next < written + window && (next == written || !pool_is_full())) {
+            batch_start(&slots[next % window], &items[next], &options, budget);
+            next++;
+        }
 
-    if (uncompressed_data) free(uncompressed_data);
+        // Documents that are already started are still waited for when the client is gone
+        if (!batch_finish(&slots[written % window], written, cancelled ? 0 : res)) cancelled = 1;
+        written++;
+
+        // Results that are already done go out together
+        uint8_t flush = written == next || !pool_is_done(&slots[written % window].pool_job);
+        if (flush && !cancelled && onion_response_flush(res) < 0) cancelled = 1;
+    }
+
+    free(slots);
+    free(items);
+    if (array) json_decref(array);
+    free(uncompressed_data);
 
     return OCS_PROCESSED;
 }
 
+// Checks the new pages, and recognizes the document once it has enough of them. Runs on a worker
+void run_session_job(void *arg) {
+    session_job_t *job = arg;
+    session_t *session = job->session;
+
+    // Only the new pages are checked, so each page is looked at once however many requests there are
+    if (!session->found && json_array_size(job->pages)) {
+        json_t *body = json_object();
+        json_object_set(body, "pages", job->pages);
+        session->found = recognize_early(body, job->page_i, &session->early);
+        json_decref(body);
+    }
+
+    uint32_t pages_len = json_array_size(json_object_get(session->body, "pages"));
+    uint32_t total_pages = json_integer_value(json_object_get(session->body, "totalPages"));
+
+    job->done = session->found || job->final || pages_len >= total_pages || pages_len >= MAX_PAGES;
+    if (!job->done) return;
+
+    if (session->found && pages_len < total_pages) stats_count(STATS_SESSION_EARLY_EXITS, 1);
+
+    uint64_t t = stats_now();
+    res_metadata_t *result = &job->result;
+    deadline_begin(job->deadline);
+    recognize(session->body, job->options, result);
+    result->partial = deadline_is_exhausted();
+    deadline_end();
+    stats_lap(STATS_RECOGNIZE, t);
+
+    // The pages a DOI was found on alone may not be enough for recognize() to find it again
+    if (!*result->doi && *session->early.doi) strcpy(result->doi, session->early.doi);
+    result_keep_fields(result, job->options->fields);
+
+    job->us = (stats_now() - t) / 1000;
+}
+
+// Adds the pages of a session request, has a worker check and recognize them, and writes the response
+onion_connection_status process_session(onion_request *req, onion_response *res, recognize_options_t *options,
+                                        uint64_t deadline, json_t *root) {
+    json_t *pages = json_object_get(root, "pages");
+    if (!json_is_array(pages)) return respond_error(res, 400, "invalid pages");
+
+    session_t *session;
+    uint32_t page_i = 0;
+
+    const char *id = onion_request_get_query(req, "session");
+    if (!id) id = onion_request_get_header(req, "X-Session");
+    if (id) {
+        uint8_t busy;
+        session = session_get(strtoull(id, 0, 16), &busy);
+        if (!session) return busy ? respond_error(res, 409, "session busy") : respond_error(res, 404, "unknown session");
+
+        page_i = json_array_size(json_object_get(session->body, "pages"));
+    } else {
+        if (!json_is_object(json_object_get(root, "metadata"))) return respond_error(res, 400, "invalid document");
+
+        // Sessions end once totalPages are uploaded, so it must be a page count
+        json_t *total_pages = json_object_get(root, "totalPages");
+        if (!json_is_integer(total_pages) || json_integer_value(total_pages) < 1) {
+            return respond_error(res, 400, "invalid totalPages");
+        }
+
+        session = session_create(root);
+        if (!session) return reject_request(res);
+        stats_count(STATS_SESSIONS, 1);
+    }
+
+    // recognize() only sees the first MAX_PAGES pages, so the ones beyond aren't kept or checked either
+    json_t *added = json_array();
+    for (uint32_t i = 0; i < json_array_size(pages) && page_i + i < MAX_PAGES; i++) {
+        json_array_append(added, json_array_get(pages, i));
+    }
+    if (id) json_array_extend(json_object_get(session->body, "pages"), added);
+
+    session_job_t job = {session, added, page_i, json_is_true(json_object_get(root, "final")), options, deadline};
+    pool_run_wait(run_session_job, &job);
+    json_decref(added);
+
+    writer_t *writer = writer_get_thread(is_pretty_requested(req) ? 1 : 0);
+    if (!writer) {
+        session_release(session);
+        return OCS_INTERNAL_ERROR;
+    }
+
+    char session_id[17];
+    sprintf(session_id, "%016lx", session->id);
+
+    writer_begin_object(writer);
+
+    if (job.done) {
+        writer_key(writer, "time");
+        writer_integer(writer, job.us);
+        result_write(&job.result, options->fields, writer);
+
+        session_destroy(session);
+    } else {
+        writer_key(writer, "session");
+        writer_string(writer, session_id, strlen(session_id));
+
+        session_release(session);
+    }
+
+    writer_key(writer, "done");
+    writer_boolean(writer, job.done);
+    writer_end_object(writer);
+
+    if (writer->failed) return OCS_INTERNAL_ERROR;
+
+    onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
+    onion_response_write(res, writer->data, writer->len);
+    return OCS_PROCESSED;
+}
+
+// Progressive recognition of a document uploaded in several requests. The first request has
+// the usual body and starts a session, and the following ones pass the returned session with
+// "session" query parameter or "X-Session" header, and only have "pages" with the next pages.
+// Each page is checked for a JSTOR cover page or a confirmed DOI as it arrives, and once one
+// is found, or the last page ("final": true or totalPages) is uploaded, the response has the
+// result and "done": true. Until then it's {"session": ..., "done": false}
+onion_connection_status url_recognize_session(void *_, onion_request *req, onion_response *res) {
+    if (!(onion_request_get_flags(req) & OR_POST)) {
+        return OCS_PROCESSED;
+    }
+
+    recognize_options_t options = {0};
+    if (!get_recognize_options(req, &options)) return reject_fields(res);
+
+    uint64_t budget = get_time_budget(req);
+    uint64_t deadline = budget ? stats_now() + budget : 0;
+
+    // The pages are added to the session before a worker is free, so
+    // requests are rejected upfront, before they change the session
+    if (pool_is_full()) {
+        stats_count(STATS_REJECTED_REQUESTS, 1);
+        return reject_request(res);
+    }
+
+    const onion_block *dreq = onion_request_get_data(req);
+    if (!dreq) return OCS_PROCESSED;
+
+    const char *data = onion_block_data(dreq);
+    uint32_t data_len = onion_block_size(dreq);
+    char *uncompressed_data = 0;
+
+    const char *content_encoding = onion_request_get_header(req, "Content-Encoding");
+    if (content_encoding && !strcmp(content_encoding, "gzip")) {
+        uint64_t t = stats_now();
+        uncompressed_data = decompress_data(data, data_len, MAX_UNCOMPRESSED_SIZE, &data_len);
+        if (!uncompressed_data) return OCS_PROCESSED;
+        data = uncompressed_data;
+        stats_lap(STATS_DECOMPRESS, t);
+    }
+
+    uint64_t t = stats_now();
+    json_error_t error;
+    json_t *root = json_loadb(data, data_len, 0, &error);
+    stats_lap(STATS_JSON_PARSE, t);
+
+    onion_connection_status status;
+    if (json_is_object(root)) {
+        status = process_session(req, res, &options, deadline, root);
+    } else {
+        status = respond_error(res, 400, "invalid json");
+    }
+
+    if (root) json_decref(root);
+    free(uncompressed_data);
+    return status;
+}
+
 onion_connection_status url_stats(void *_, onion_request *req, onion_response *res) {
     json_t *obj = json_object();
 
+    json_t *json_pool = json_object();
+    json_object_set_new(json_pool, "workers", json_integer(pool_get_workers()));
+    json_object_set_new(json_pool, "pinned", json_integer(pool_get_pinned()));
+    json_object_set_new(json_pool, "queue_depth", json_integer(pool_get_queue_depth()));
+    json_object_set_new(json_pool, "running", json_integer(stats_get_gauge(STATS_RUNNING_REQUESTS)));
+    json_object_set_new(json_pool, "queued", json_integer(stats_get_gauge(STATS_QUEUED_REQUESTS)));
+    json_object_set_new(obj, "pool", json_pool);
+
+    uint64_t hits = stats_get_counter(STATS_CACHE_HITS);
+    uint64_t misses = stats_get_counter(STATS_CACHE_MISSES);
+
+    json_t *json_cache = json_object();
+    json_object_set_new(json_cache, "hits", json_integer(hits));
+    json_object_set_new(json_cache, "disk_hits", json_integer(stats_get_counter(STATS_CACHE_DISK_HITS)));
+    json_object_set_new(json_cache, "misses", json_integer(misses));
+    json_object_set_new(json_cache, "hit_rate", json_real(hits + misses ? (double) hits / (hits + misses) : 0));
+    json_object_set_new(json_cache, "entries", json_integer(stats_get_gauge(STATS_CACHE_ENTRIES)));
+    json_object_set_new(json_cache, "bytes", json_integer(stats_get_gauge(STATS_CACHE_BYTES)));
+    json_object_set_new(obj, "cache", json_cache);
+
+    json_t *json_exhausted = json_object();
+    for (uint32_t i = 0; i < STATS_STAGES_LEN; i++) {
+        uint64_t exhausted = stats_get_exhausted(i);
+        if (exhausted) json_object_set_new(json_exhausted, stats_get_stage_name(i), json_integer(exhausted));
+    }
+    json_object_set_new(obj, "deadline_exhausted", json_exhausted);
+
     char *str = json_dumps(obj, JSON_INDENT(1) | JSON_PRESERVE_ORDER);
     json_decref(obj);
 
@@ -194,6 +863,17 @@ onion_connection_status url_stats(void *_, onion_request *req, onion_response *r
     return OCS_PROCESSED;
 }
 
+onion_connection_status url_metrics(void *_, onion_request *req, onion_response *res) {
+    char *str = stats_get_prometheus();
+    if (!str) return OCS_INTERNAL_ERROR;
+
+    onion_response_set_header(res, "Content-Type", "text/plain; version=0.0.4");
+    onion_response_write0(res, str);
+    free(str);
+
+    return OCS_PROCESSED;
+}
+
 void signal_handler(int signum) {
     log_info("signal received (%d), shutting down..", signum);
 
@@ -205,11 +885,15 @@ void signal_handler(int signum) {
         log_error("doidata close failed");
     }
 
+    if (!cache_close()) {
+        log_error("cache close failed");
+    }
+
     log_info("exiting");
 
     // Force flush because otherwise Docker doesn't output logs
     fflush(stdout);
-    fflush(stderr);
+    log_flush();
     exit(EXIT_SUCCESS);
 }
 
@@ -218,18 +902,37 @@ void print_usage() {
             "Missing parameters.\n" \
             "-d\tdata directory\n" \
             "-p\tport\n" \
+            "-t\tworker threads (default number of CPUs)\n" \
+            "-q\trequests that can wait for a worker before the rest get 503 (default number of workers)\n" \
+            "-i\tconnection threads, which read and inflate request bodies for the workers (default 64,\n" \
+            "\tand at least workers + queue depth + 4)\n" \
+            "-s\tmaximum request body size in MB (default 5)\n" \
+            "-m\tresult cache size in MB, 0 to disable (default 64)\n" \
+            "-c\tpersistent result cache file (default none)\n" \
+            "-n\tresults kept in the persistent cache, the oldest are evicted first (default 1000000)\n" \
+            "-b\trecognition time budget in ms, after which a partial result is returned (default none)\n" \
+            "-e\tidentifier-first mode: return right after a DOI is confirmed, skipping the other stages\n" \
             "-l\tlog level\n" \
             "Usage example:\n" \
-            "recognizer-server -d /var/db -p 8080\n"
+            "recognizer-server -d /var/db -p 8080\n" \
+            "recognizer-server -d /var/db -p 8080 -t 8 -q 32 -i 256\n" \
+            "recognizer-server -d /var/db -p 8080 -m 256 -c /var/cache/recognizer.sqlite\n"
     );
 }
 
 int main(int argc, char **argv) {
     char *opt_db_directory = 0;
     char *opt_port = 0;
+    uint32_t opt_workers = 0;
+    int64_t opt_queue_depth = -1;
+    uint32_t opt_io_threads = 0;
+    uint32_t opt_max_post_size = 5;
+    uint32_t opt_cache_size = 64;
+    char *opt_cache_path = 0;
+    uint64_t opt_cache_entries = 1000000;
 
     int opt;
-    while ((opt = getopt(argc, argv, "d:p:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "d:p:t:q:i:s:m:c:n:b:el:")) != -1) {
         switch (opt) {
             case 'd':
                 opt_db_directory = optarg;
@@ -242,6 +945,33 @@ int main(int argc, char **argv) {
             case 'p':
                 opt_port = optarg;
                 break;
+            case 't':
+                opt_workers = strtoul(optarg, 0, 10);
+                break;
+            case 'q':
+                opt_queue_depth = strtol(optarg, 0, 10);
+                break;
+            case 'i':
+                opt_io_threads = strtoul(optarg, 0, 10);
+                break;
+            case 's':
+                opt_max_post_size = strtoul(optarg, 0, 10);
+                break;
+            case 'm':
+                opt_cache_size = strtoul(optarg, 0, 10);
+                break;
+            case 'c':
+                opt_cache_path = optarg;
+                break;
+            case 'n':
+                opt_cache_entries = strtoull(optarg, 0, 10);
+                break;
+            case 'b':
+                time_budget = strtoul(optarg, 0, 10);
+                break;
+            case 'e':
+                identifier_first = 1;
+                break;
             default:
                 print_usage();
                 return EXIT_FAILURE;
@@ -253,10 +983,30 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    if (!opt_workers) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opt_workers = cpus > 0 ? cpus : 1;
+    }
+
+    if (opt_queue_depth < 0) {
+        opt_queue_depth = opt_workers;
+    }
+
+    // Running and queued requests hold their connection thread while waiting
+    if (!opt_io_threads) {
+        opt_io_threads = opt_workers + opt_queue_depth + POOL_SPARE_THREADS;
+        if (opt_io_threads < DEFAULT_IO_THREADS) opt_io_threads = DEFAULT_IO_THREADS;
+    }
+
     if (log_level > 0) {
         setenv("ONION_LOG", "noinfo", 1);
     }
 
+    if (!log_start()) {
+        log_error("failed to start logger");
+        return EXIT_FAILURE;
+    }
+
     if (!text_init()) {
         log_error("failed to initialize text processor");
         return EXIT_FAILURE;
@@ -280,6 +1030,28 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    log_info("initializing cache");
+    if (!cache_init((uint64_t) opt_cache_size * 1024 * 1024, opt_cache_path, opt_cache_entries, opt_db_directory)) {
+        log_error("failed to initialize cache");
+        return EXIT_FAILURE;
+    }
+
+    if (!session_init()) {
+        log_error("failed to initialize sessions");
+        return EXIT_FAILURE;
+    }
+
+    if (!pool_init(opt_workers, opt_queue_depth)) {
+        log_error("failed to start workers");
+        return EXIT_FAILURE;
+    }
+
+    // While at most half of the workers are busy, the idle cores help with the per page work of requests
+    if (!task_init(opt_workers - 1, opt_workers / 2)) {
+        log_error("failed to initialize task helpers");
+        return EXIT_FAILURE;
+    }
+
     on = onion_new(O_POOL);
 
     // Signal handler must be initialized after onion_new
@@ -290,14 +1062,18 @@ int main(int argc, char **argv) {
     sigaction(SIGTERM, &action, NULL);
 
     onion_set_port(on, opt_port);
-    onion_set_max_threads(on, 16);
-    onion_set_max_post_size(on, 5 * 1024 * 1024);
+    onion_set_max_threads(on, opt_io_threads);
+    onion_set_max_post_size(on, opt_max_post_size * 1024 * 1024);
 
     onion_url *urls = onion_root_url(on);
 
+    onion_url_add(urls, "recognize/batch", url_recognize_batch);
+    onion_url_add(urls, "recognize/session", url_recognize_session);
     onion_url_add(urls, "recognize", url_recognize);
     onion_url_add(urls, "stats", url_stats);
-    log_info("listening on port %s", opt_port);
+    onion_url_add(urls, "metrics", url_metrics);
+    log_info("listening on port %s with %u workers (%u pinned), %u connection threads and queue depth %ld",
+             opt_port, opt_workers, pool_get_pinned(), opt_io_threads, opt_queue_depth);
 
     onion_listen(on);
 
@@ -0,0 +1,311 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+// For pthread_setaffinity_np and the CPU_* macros
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "stats.h"
+#include "log.h"
+#include "pool.h"
+
+// Recognition runs on a fixed set of workers, apart from the connection threads. Onion runs
+// each request on its own connection thread, which reads and inflates the body, and only then
+// submits the CPU-bound work here and waits for it. Slow clients hold a connection thread
+// but never a worker. Each worker has its own queue, and a worker whose queue is empty
+// steals the oldest job of another one, so the workers keep busy whatever the order jobs
+// finish in. Jobs that can't get a worker wait up to the queue depth, and limited ones
+// beyond that are rejected at once instead of making every client slower. Work that was
+// already admitted, like session pages and batch documents, is never rejected, but it
+// fills the queue like the rest, so other requests are shed while it waits
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Waiting connection threads sleep on their own job's condition with this mutex
+pthread_mutex_t pool_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+pool_worker_t *pool_workers = 0;
+uint32_t pool_workers_len = 1;
+uint32_t pool_queue_depth = 0;
+uint32_t pool_pinned = 0;
+// Queue that gets the next job when no worker is idle
+uint32_t pool_next = 0;
+// Idle workers, the last one to get idle first, as its caches are the warmest
+pool_worker_t *pool_idle = 0;
+
+// Jobs submitted and not finished yet
+uint32_t pool_busy = 0;
+// Jobs that haven't started yet, which count against the queue depth
+uint32_t pool_queued = 0;
+
+void pool_push(pool_queue_t *queue, pool_job_t *job) {
+    pthread_mutex_lock(&queue->mutex);
+    job->next = 0;
+    if (queue->tail) queue->tail->next = job;
+    else __atomic_store_n(&queue->head, job, __ATOMIC_RELAXED);
+    queue->tail = job;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Takes the oldest job, so jobs start in the order they were queued whoever takes them
+pool_job_t *pool_pop(pool_queue_t *queue) {
+    // Empty queues are skipped without taking their lock
+    if (!__atomic_load_n(&queue->head, __ATOMIC_RELAXED)) return 0;
+
+    pthread_mutex_lock(&queue->mutex);
+    pool_job_t *job = queue->head;
+    if (job) {
+        __atomic_store_n(&queue->head, job->next, __ATOMIC_RELAXED);
+        if (!job->next) queue->tail = 0;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return job;
+}
+
+// Takes a job from the worker's own queue, or steals one from the next busy worker
+pool_job_t *pool_take(pool_worker_t *worker) {
+    pool_job_t *job = pool_pop(&worker->queue);
+    if (job) return job;
+
+    for (uint32_t i = 1; i < pool_workers_len; i++) {
+        job = pool_pop(&pool_workers[(worker->index + i) % pool_workers_len].queue);
+        if (job) {
+            stats_count(STATS_STOLEN_JOBS, 1);
+            return job;
+        }
+    }
+
+    return 0;
+}
+
+// Runs the job as part of the submitter's request, and wakes the submitter
+void pool_exec(pool_job_t *job) {
+    __atomic_sub_fetch(&pool_queued, 1, __ATOMIC_RELAXED);
+    stats_gauge_add(STATS_QUEUED_REQUESTS, -1);
+    stats_gauge_add(STATS_RUNNING_REQUESTS, 1);
+
+    stats_begin_request(job->stats_request);
+    stats_lap(STATS_QUEUE_WAIT, job->queued_at);
+    job->func(job->arg);
+    stats_end_request();
+
+    stats_gauge_add(STATS_RUNNING_REQUESTS, -1);
+    __atomic_sub_fetch(&pool_busy, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool_done_mutex);
+    __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&pool_done_mutex);
+}
+
+void *pool_worker(void *arg) {
+    pool_worker_t *worker = arg;
+
+    while (1) {
+        pool_job_t *job = pool_take(worker);
+
+        if (!job) {
+            pthread_mutex_lock(&pool_mutex);
+            // Jobs are only queued with pool_mutex held, so none can be
+            // queued unseen between this last look and the wait
+            job = pool_take(worker);
+            if (!job) {
+                worker->idle = 1;
+                worker->next_idle = pool_idle;
+                pool_idle = worker;
+                while (worker->idle) pthread_cond_wait(&worker->cond, &pool_mutex);
+            }
+            pthread_mutex_unlock(&pool_mutex);
+            if (!job) continue;
+        }
+
+        pool_exec(job);
+    }
+
+    return 0;
+}
+
+// Pins each worker to its own core, but only if there is a core for each of them. Otherwise
+// pinned workers would compete for the same cores while others are left to the scheduler
+void pool_pin(pthread_t *threads, uint32_t threads_len) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) || CPU_COUNT(&allowed) < threads_len) return;
+
+    uint32_t cpu = 0;
+    for (uint32_t i = 0; i < threads_len; i++) {
+        while (!CPU_ISSET(cpu, &allowed)) cpu++;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(threads[i], sizeof(set), &set)) {
+            log_error("failed to pin worker %u to cpu %u", i, cpu);
+        } else {
+            pool_pinned++;
+        }
+        cpu++;
+    }
+}
+
+uint32_t pool_init(uint32_t workers, uint32_t queue_depth) {
+    if (!workers) return 0;
+
+    pool_workers = calloc(workers, sizeof(pool_worker_t));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if (!pool_workers || !threads) {
+        free(threads);
+        return 0;
+    }
+
+    pool_workers_len = workers;
+    pool_queue_depth = queue_depth;
+
+    for (uint32_t i = 0; i < workers; i++) {
+        pool_workers[i].index = i;
+        pthread_mutex_init(&pool_workers[i].queue.mutex, 0);
+        pthread_cond_init(&pool_workers[i].cond, 0);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, POOL_STACK_SIZE);
+
+    for (uint32_t i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], &attr, pool_worker, &pool_workers[i])) {
+            log_error("failed to start worker");
+            pthread_attr_destroy(&attr);
+            free(threads);
+            return 0;
+        }
+        pthread_detach(threads[i]);
+    }
+
+    pthread_attr_destroy(&attr);
+
+    pool_pin(threads, workers);
+    free(threads);
+    return 1;
+}
+
+// Queues the job on an idle worker, or on the workers in turn when none is idle.
+// Returns 0 if the job is limited and the queue is full
+uint32_t pool_submit(pool_job_t *job) {
+    pthread_mutex_lock(&pool_mutex);
+
+    if (job->limited && __atomic_load_n(&pool_busy, __ATOMIC_RELAXED) >= pool_workers_len &&
+        __atomic_load_n(&pool_queued, __ATOMIC_RELAXED) >= pool_queue_depth) {
+        pthread_mutex_unlock(&pool_mutex);
+        stats_count(STATS_REJECTED_REQUESTS, 1);
+        return 0;
+    }
+
+    __atomic_add_fetch(&pool_busy, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool_queued, 1, __ATOMIC_RELAXED);
+    stats_gauge_add(STATS_QUEUED_REQUESTS, 1);
+
+    pool_worker_t *worker = pool_idle;
+    if (worker) {
+        pool_idle = worker->next_idle;
+        worker->idle = 0;
+        pthread_cond_signal(&worker->cond);
+    } else {
+        worker = &pool_workers[pool_next++ % pool_workers_len];
+    }
+
+    pool_push(&worker->queue, job);
+
+    pthread_mutex_unlock(&pool_mutex);
+    return 1;
+}
+
+// Queues func to run on a worker without waiting for it. The job has to stay in place
+// until pool_wait returns. Returns 0 if the job is limited and the queue is full
+uint32_t pool_start(pool_job_t *job, pool_func_t func, void *arg, uint8_t limited) {
+    memset(job, 0, sizeof(pool_job_t));
+    job->func = func;
+    job->arg = arg;
+    job->limited = limited;
+    job->queued_at = stats_now();
+    job->stats_request = stats_get_request();
+    pthread_cond_init(&job->cond, 0);
+
+    if (pool_submit(job)) return 1;
+
+    pthread_cond_destroy(&job->cond);
+    return 0;
+}
+
+// Waits for a job started with pool_start
+void pool_wait(pool_job_t *job) {
+    pthread_mutex_lock(&pool_done_mutex);
+    while (!job->done) pthread_cond_wait(&job->cond, &pool_done_mutex);
+    pthread_mutex_unlock(&pool_done_mutex);
+
+    pthread_cond_destroy(&job->cond);
+}
+
+// Whether pool_wait would return at once
+uint32_t pool_is_done(pool_job_t *job) {
+    return __atomic_load_n(&job->done, __ATOMIC_ACQUIRE);
+}
+
+// Runs func on a worker and returns once it's done
+uint32_t pool_call(pool_func_t func, void *arg, uint8_t limited) {
+    pool_job_t job;
+    if (!pool_start(&job, func, arg, limited)) return 0;
+    pool_wait(&job);
+    return 1;
+}
+
+// Returns 0 without running func when the queue is full
+uint32_t pool_run(pool_func_t func, void *arg) {
+    return pool_call(func, arg, 1);
+}
+
+// For work that was already admitted, like the pages of a session. Takes its
+// turn in the same order, but is never rejected
+void pool_run_wait(pool_func_t func, void *arg) {
+    pool_call(func, arg, 0);
+}
+
+uint32_t pool_is_full() {
+    pthread_mutex_lock(&pool_mutex);
+    uint32_t full = __atomic_load_n(&pool_queued, __ATOMIC_RELAXED) >= pool_queue_depth &&
+                    __atomic_load_n(&pool_busy, __ATOMIC_RELAXED) >= pool_workers_len;
+    pthread_mutex_unlock(&pool_mutex);
+    return full;
+}
+
+uint32_t pool_get_workers() {
+    return pool_workers_len;
+}
+
+uint32_t pool_get_queue_depth() {
+    return pool_queue_depth;
+}
+
+// Number of workers pinned to a core
+uint32_t pool_get_pinned() {
+    return pool_pinned;
+}
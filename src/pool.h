@@ -0,0 +1,68 @@
+#ifndef RECOGNIZER_SERVER_POOL_H
+#define RECOGNIZER_SERVER_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "stats.h"
+
+// Connection threads beyond workers and queue, so that overload can still
+// be answered with 503 and metrics stay reachable
+#define POOL_SPARE_THREADS 4
+
+// Workers run recognize(), which keeps large arrays on the stack
+#define POOL_STACK_SIZE (16 * 1024 * 1024)
+
+typedef void (*pool_func_t)(void *arg);
+
+// A job submitted by a connection thread, which stays in place until a worker has run it
+typedef struct pool_job {
+    pool_func_t func;
+    void *arg;
+    // Whether the job is rejected when the queue is full. Jobs that were already
+    // admitted aren't, but they still count against the queue depth while queued
+    uint8_t limited;
+    uint8_t done;
+    uint64_t queued_at;
+    // Request of the submitting thread, so the worker's timings are added to it
+    stats_request_t *stats_request;
+    pthread_cond_t cond;
+    struct pool_job *next;
+} pool_job_t;
+
+// Jobs waiting for a worker. Each worker has its own queue
+typedef struct pool_queue {
+    pthread_mutex_t mutex;
+    pool_job_t *head;
+    pool_job_t *tail;
+} pool_queue_t;
+
+typedef struct pool_worker {
+    uint32_t index;
+    pool_queue_t queue;
+    // Waits for a job while idle, with pool_mutex
+    pthread_cond_t cond;
+    uint8_t idle;
+    struct pool_worker *next_idle;
+} pool_worker_t;
+
+uint32_t pool_init(uint32_t workers, uint32_t queue_depth);
+
+uint32_t pool_run(pool_func_t func, void *arg);
+
+void pool_run_wait(pool_func_t func, void *arg);
+
+uint32_t pool_start(pool_job_t *job, pool_func_t func, void *arg, uint8_t limited);
+
+void pool_wait(pool_job_t *job);
+
+uint32_t pool_is_done(pool_job_t *job);
+
+uint32_t pool_is_full();
+
+uint32_t pool_get_workers();
+
+uint32_t pool_get_queue_depth();
+
+uint32_t pool_get_pinned();
+
+#endif //RECOGNIZER_SERVER_POOL_H
@@ -34,9 +34,17 @@
 #include "log.h"
 #include "recognize_abstract.h"
 #include "recognize_authors.h"
+#include "recognize_fonts.h"
 #include "recognize_jstor.h"
 #include "recognize_pages.h"
 #include "recognize_various.h"
+#include "stats.h"
+#include "deadline.h"
+#include "task.h"
+
+#define XXH_STATIC_LINKING_ONLY
+
+#include "xxhash.h"
 
 extern UNormalizer2 *unorm2;
 
@@ -52,40 +60,40 @@ void print_font_size_dist(doc_t *doc) {
     printf("\n\n");
 }
 
-uint32_t init_font_size_dist(doc_t *doc) {
+uint32_t destroy_doc(doc_t *doc) {
     for (uint32_t page_i = 0; page_i < doc->pages_len; page_i++) {
-        page_t *page = doc->pages + page_i;
+        page_t *page = &doc->pages[page_i];
 
         for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
-            flow_t *flow = page->flows + flow_i;
+            flow_t *flow = &page->flows[flow_i];
 
             for (uint32_t block_i = 0; block_i < flow->blocks_len; block_i++) {
-                block_t *block = flow->blocks + block_i;
+                block_t *block = &flow->blocks[block_i];
 
                 for (uint32_t line_i = 0; line_i < block->lines_len; line_i++) {
-                    line_t *line = block->lines + line_i;
-
-                    for (uint32_t word_i = 0; word_i < line->words_len; word_i++) {
-                        word_t *word = line->words + word_i;
-
-                        uint32_t font_size = (uint32_t) word->font_size;
-
-                        if (font_size > 999) continue;
-                        page->fs_dist[font_size] += word->text_len; // Measure length in UTF-8 characters
-
-                        if (font_size + 1 > page->fs_dist_len) page->fs_dist_len = font_size + 1;
-                    }
+                    line_t *line = &block->lines[line_i];
+                    free(line->words);
                 }
+                free(block->lines);
             }
+            free(flow->blocks);
         }
+        free(page->flows);
+        free(page->numbers);
+        destroy_fonts_info(&page->font_ids);
     }
+    free(doc->pages);
+    free(doc);
 }
 
 doc_t *get_doc(json_t *body) {
     doc_t *doc = (doc_t *) calloc(1, sizeof(doc_t));
 
     json_t *json_pages = json_object_get(body, "pages");
-    if (!json_is_array(json_pages)) return 0;
+    if (!json_is_array(json_pages)) {
+        free(doc);
+        return 0;
+    }
     uint32_t pages_len = json_array_size(json_pages);
 
     if (pages_len > MAX_PAGES) pages_len = MAX_PAGES;
@@ -93,6 +101,13 @@ doc_t *get_doc(json_t *body) {
     doc->pages = (page_t *) calloc(pages_len, sizeof(page_t));
     doc->pages_len = pages_len;
 
+    uint32_t words_len = 0;
+
+    fonts_info_t line_font_ids;
+    fonts_info_t line_font_sizes;
+    init_fonts_info(&line_font_ids);
+    init_fonts_info(&line_font_sizes);
+
     for (uint32_t page_i = 0; page_i < pages_len; page_i++) {
         json_t *json_obj = json_array_get(json_pages, page_i);
         page_t *page = doc->pages + page_i;
@@ -107,16 +122,16 @@ doc_t *get_doc(json_t *body) {
         page->height = json_number_value(height);
 
         json_t *json_flows = json_array_get(json_obj, 2);
-        if (!json_is_array(json_flows)) return 0;
+        if (!json_is_array(json_flows)) goto error;
         page->flows_len = json_array_size(json_flows);
-        page->flows = (flow_t *) malloc(sizeof(flow_t) * page->flows_len);
+        page->flows = (flow_t *) calloc(sizeof(flow_t), page->flows_len);
 
         for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
             json_t *json_obj = json_array_get(json_flows, flow_i);
             flow_t *flow = page->flows + flow_i;
 
             json_t *json_blocks = json_array_get(json_obj, 0);
-            if (!json_is_array(json_blocks)) return 0;
+            if (!json_is_array(json_blocks)) goto error;
             flow->blocks_len = json_array_size(json_blocks);
             flow->blocks = (block_t *) calloc(sizeof(block_t), flow->blocks_len);
             for (uint32_t block_i = 0; block_i < flow->blocks_len; block_i++) {
@@ -138,7 +153,7 @@ doc_t *get_doc(json_t *body) {
                 block->y_max = json_number_value(y_max);
 
                 json_t *json_lines = json_array_get(json_obj, 4);
-                if (!json_is_array(json_lines)) return 0;
+                if (!json_is_array(json_lines)) goto error;
                 block->lines_len = json_array_size(json_lines);
                 block->lines = (line_t *) calloc(sizeof(line_t), block->lines_len);
                 for (uint32_t line_i = 0; line_i < block->lines_len; line_i++) {
@@ -146,8 +161,9 @@ doc_t *get_doc(json_t *body) {
                     line_t *line = block->lines + line_i;
 
                     json_t *json_words = json_array_get(json_obj, 0);
-                    if (!json_is_array(json_words)) return 0;
+                    if (!json_is_array(json_words)) goto error;
                     line->words_len = json_array_size(json_words);
+                    words_len += line->words_len;
                     line->words = (word_t *) malloc(sizeof(word_t) * line->words_len);
 
                     for (uint32_t word_i = 0; word_i < line->words_len; word_i++) {
@@ -188,6 +204,8 @@ doc_t *get_doc(json_t *body) {
 
                         word->char_len = text_char_len(word->text);
 
+                        add_word_font(page, word);
+
                         line->char_len += word->char_len + (word->space ? 1 : 0);
 
                         if (block->font_size_min == 0 || block->font_size_min > word->font_size) {
@@ -208,37 +226,29 @@ doc_t *get_doc(json_t *body) {
                         if (page->content_x_left > word->x_min) page->content_x_left = word->x_min;
                         if (page->content_x_right < word->x_max) page->content_x_right = word->x_max;
                     }
+
+                    set_line_dominating_font(line, &line_font_ids, &line_font_sizes);
+                    add_page_numbers(page, line);
+
+                    if (page_i == 0 && !page->has_jstor_url && is_jstor_line(line)) {
+                        page->has_jstor_url = 1;
+                    }
                 }
             }
         }
     }
 
-    init_font_size_dist(doc);
+    destroy_fonts_info(&line_font_ids);
+    destroy_fonts_info(&line_font_sizes);
+    stats_count(STATS_WORDS, words_len);
 //  print_font_size_dist(doc);
     return doc;
-}
-
-uint32_t destroy_doc(doc_t *doc) {
-    for (uint32_t page_i = 0; page_i < doc->pages_len; page_i++) {
-        page_t *page = &doc->pages[page_i];
-
-        for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
-            flow_t *flow = &page->flows[flow_i];
-
-            for (uint32_t block_i = 0; block_i < flow->blocks_len; block_i++) {
-                block_t *block = &flow->blocks[block_i];
 
-                for (uint32_t line_i = 0; line_i < block->lines_len; line_i++) {
-                    line_t *line = &block->lines[line_i];
-                    free(line->words);
-                }
-                free(block->lines);
-            }
-            free(flow->blocks);
-        }
-        free(page->flows);
-    }
-    free(doc->pages);
+    error:
+    destroy_fonts_info(&line_font_ids);
+    destroy_fonts_info(&line_font_sizes);
+    destroy_doc(doc);
+    return 0;
 }
 
 uint32_t doc_to_text(doc_t *doc, uint8_t *text, uint32_t *text_len, uint32_t max_text_size, uint32_t total_pages) {
@@ -305,74 +315,37 @@ uint32_t doc_to_text(doc_t *doc, uint8_t *text, uint32_t *text_len, uint32_t max
 uint32_t get_first_page_by_fonts(doc_t *doc) {
     uint32_t start_page = 0;
 
-    uint32_t fonts[100][100];
-    uint32_t fonts_len[100] = {0};
-
-    for (uint32_t page_i = 0; page_i < doc->pages_len; page_i++) {
-        page_t *page = doc->pages + page_i;
-
-        for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
-            flow_t *flow = page->flows + flow_i;
-
-            for (uint32_t block_i = 0; block_i < flow->blocks_len; block_i++) {
-                block_t *block = flow->blocks + block_i;
-
-                for (uint32_t line_i = 0; line_i < block->lines_len; line_i++) {
-                    line_t *line = block->lines + line_i;
-
-                    for (uint32_t word_i = 0; word_i < line->words_len; word_i++) {
-                        word_t *word = line->words + word_i;
-
-                        uint8_t found = 0;
-                        for (uint32_t i = 0; i < fonts_len[page_i]; i++) {
-                            if (fonts[page_i][i] == word->font) {
-                                found = 1;
-                                break;
-                            }
-                        }
-
-                        if (!found) {
-                            fonts[page_i][fonts_len[page_i]++] = word->font;
-                        }
-                    }
-                }
-            }
-        }
-    }
-
     if (doc->pages_len < 3) return 0;
 
     for (uint32_t page_i = 0; page_i < doc->pages_len - 2; page_i++) {
+        fonts_info_t *font_ids = &doc->pages[page_i].font_ids;
 
         uint32_t missing = 0;
-        uint32_t total = 0;
+        uint32_t next_fonts_len = 0;
 
-        for (uint32_t i = 0; i < fonts_len[page_i]; i++) {
-            uint64_t font1 = fonts[page_i][i];
+        for (uint32_t page2_i = page_i + 1; page2_i < doc->pages_len; page2_i++) {
+            next_fonts_len += doc->pages[page2_i].font_ids.fonts_len;
+        }
 
+        for (uint32_t i = 0; i < font_ids->fonts_len; i++) {
+            uint32_t font_id = font_ids->fonts[i].font_id;
 
             uint8_t found = 0;
 
             for (uint32_t page2_i = page_i + 1; page2_i < doc->pages_len; page2_i++) {
-                for (uint32_t j = 0; j < fonts_len[page2_i]; j++) {
-                    uint64_t font2 = fonts[page2_i][j];
-                    total++;
-
-                    if (font1 == font2) {
-                        found = 1;
-                        break;
-                    }
+                if (get_font(&doc->pages[page2_i].font_ids, font_id, 0)) {
+                    found = 1;
+                    break;
                 }
-                if (found) break;
             }
 
             if (!found) {
                 missing++;
             }
-
         }
 
-        if (missing == fonts_len[page_i] && total >= 2) {
+        // None of the page fonts are used in the following pages
+        if (missing == font_ids->fonts_len && font_ids->fonts_len * next_fonts_len >= 2) {
             start_page = page_i + 1;
         }
     }
@@ -442,32 +415,163 @@ uint32_t get_block_text(block_t *block, uint8_t *text, uint32_t max_text_size) {
         *(text + text_len) = '\n';
         (text_len)++;
     }
+
+    *(text + text_len) = 0;
+    return 1;
+}
+
+// Hashes exactly the same bytes get_block_text would produce, without materializing them
+uint64_t get_block_text_hash(block_t *block, uint32_t max_text_size) {
+    uint32_t text_len = 0;
+    XXH64_state_t state;
+    XXH64_reset(&state, 0);
+
+    for (uint32_t line_i = 0; line_i < block->lines_len; line_i++) {
+        line_t *line = block->lines + line_i;
+
+        XXH64_update(&state, "\n", 1);
+        text_len++;
+        for (uint32_t word_i = 0; word_i < line->words_len; word_i++) {
+            word_t *word = line->words + word_i;
+
+            if (text_len + word->text_len >= max_text_size - 2) {
+                return XXH64_digest(&state);
+            }
+            XXH64_update(&state, word->text, word->text_len);
+            text_len += word->text_len;
+
+            if (word->space) {
+                XXH64_update(&state, " ", 1);
+                text_len++;
+            }
+        }
+
+        XXH64_update(&state, "\n", 1);
+        text_len++;
+    }
+
+    return XXH64_digest(&state);
+}
+
+typedef struct hf_block {
+    block_t *block;
+    int32_t cell_x;
+    int32_t cell_y;
+    uint64_t text_hash;
+    uint32_t next;
+} hf_block_t;
+
+typedef struct hf_page {
+    hf_block_t *blocks;
+    uint32_t blocks_len;
+    uint32_t *buckets;
+    uint32_t buckets_mask;
+} hf_page_t;
+
+uint32_t get_hf_bucket(hf_page_t *hf_page, int32_t cell_x, int32_t cell_y) {
+    return (((uint32_t) cell_x * 73856093u) ^ ((uint32_t) cell_y * 19349663u)) & hf_page->buckets_mask;
+}
+
+// Indexes page blocks by their top-left corner quantized to HF_CELL_SIZE,
+// so blocks within HF_CELL_SIZE of each other are in the same or adjacent cells
+uint32_t init_hf_page(page_t *page, hf_page_t *hf_page, uint32_t max_text_size) {
+    uint32_t blocks_len = 0;
+    for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
+        blocks_len += page->flows[flow_i].blocks_len;
+    }
+
+    uint32_t buckets_len = 16;
+    while (buckets_len < blocks_len * 2) buckets_len *= 2;
+
+    hf_page->blocks = (hf_block_t *) malloc(sizeof(hf_block_t) * (blocks_len + 1));
+    hf_page->blocks_len = 0;
+    hf_page->buckets = (uint32_t *) calloc(buckets_len, sizeof(uint32_t));
+    hf_page->buckets_mask = buckets_len - 1;
+
+    for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
+        flow_t *flow = page->flows + flow_i;
+
+        for (uint32_t block_i = 0; block_i < flow->blocks_len; block_i++) {
+            block_t *block = flow->blocks + block_i;
+            hf_block_t *hf_block = &hf_page->blocks[hf_page->blocks_len];
+
+            hf_block->block = block;
+            hf_block->cell_x = (int32_t) floor(block->x_min / HF_CELL_SIZE);
+            hf_block->cell_y = (int32_t) floor(block->y_min / HF_CELL_SIZE);
+            hf_block->text_hash = get_block_text_hash(block, max_text_size);
+
+            // Bucket heads and chain links store block index + 1, zero terminates the chain
+            uint32_t bucket = get_hf_bucket(hf_page, hf_block->cell_x, hf_block->cell_y);
+            hf_block->next = hf_page->buckets[bucket];
+            hf_page->buckets[bucket] = ++hf_page->blocks_len;
+        }
+    }
+
+    return 1;
+}
+
+void destroy_hf_page(hf_page_t *hf_page) {
+    free(hf_page->blocks);
+    free(hf_page->buckets);
+}
+
+typedef struct hf_task {
+    doc_t *doc;
+    hf_page_t *hf_pages;
+    uint32_t max_text_size;
+} hf_task_t;
+
+void init_hf_page_task(void *arg, uint32_t page_i) {
+    hf_task_t *task = arg;
+    init_hf_page(task->doc->pages + page_i, &task->hf_pages[page_i], task->max_text_size);
 }
 
 uint32_t extract_header_footer(doc_t *doc, uint8_t *text, uint32_t text_size) {
+    uint8_t data1[10000];
+    uint8_t data2[10000];
+
+    hf_page_t hf_pages[MAX_PAGES];
+
+    hf_task_t task = {doc, hf_pages, sizeof(data1)};
+    if (!task_run(init_hf_page_task, &task, doc->pages_len)) {
+        for (uint32_t page_i = 0; page_i < doc->pages_len; page_i++) {
+            init_hf_page(doc->pages + page_i, &hf_pages[page_i], sizeof(data1));
+        }
+    }
+
     for (uint32_t page_i = 0; page_i + 1 < doc->pages_len; page_i++) {
+        if (deadline_check(STATS_HEADFOOT)) break;
+
         page_t *page = doc->pages + page_i;
+        hf_page_t *hf_page = &hf_pages[page_i];
 
-        for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
-            flow_t *flow = page->flows + flow_i;
+        for (uint32_t hf_block_i = 0; hf_block_i < hf_page->blocks_len; hf_block_i++) {
+            hf_block_t *hf_block = &hf_page->blocks[hf_block_i];
+            block_t *block = hf_block->block;
 
-            for (uint32_t block_i = 0; block_i < flow->blocks_len; block_i++) {
-                block_t *block = flow->blocks + block_i;
+            // Only injected text can be at the top or bottom of the page
+            if (block->y_min < 15 || block->y_max > page->height - 15) continue;
+
+            uint8_t data1_ready = 0;
 
-                // Only injected text can be at the top or bottom of the page
-                if (block->y_min < 15 || block->y_max > page->height - 15) continue;
+            double width1 = block->x_max - block->x_min;
+            double height1 = block->y_max - block->y_min;
 
-                for (uint32_t page2_i = page_i + 1; page2_i < doc->pages_len && page2_i <= page_i + 2; page2_i++) {
-                    page_t *page2 = doc->pages + page2_i;
+            for (uint32_t page2_i = page_i + 1; page2_i < doc->pages_len && page2_i <= page_i + 2; page2_i++) {
+                hf_page_t *hf_page2 = &hf_pages[page2_i];
 
-                    for (uint32_t flow2_i = 0; flow2_i < page2->flows_len; flow2_i++) {
-                        flow_t *flow2 = page2->flows + flow2_i;
+                for (int32_t cell_x = hf_block->cell_x - 1; cell_x <= hf_block->cell_x + 1; cell_x++) {
+                    for (int32_t cell_y = hf_block->cell_y - 1; cell_y <= hf_block->cell_y + 1; cell_y++) {
+                        uint32_t n = hf_page2->buckets[get_hf_bucket(hf_page2, cell_x, cell_y)];
 
-                        for (uint32_t block2_i = 0; block2_i < flow2->blocks_len; block2_i++) {
-                            block_t *block2 = flow2->blocks + block2_i;
+                        while (n) {
+                            hf_block_t *hf_block2 = &hf_page2->blocks[n - 1];
+                            block_t *block2 = hf_block2->block;
+                            n = hf_block2->next;
 
-                            double width1 = block->x_max - block->x_min;
-                            double height1 = block->y_max - block->y_min;
+                            if (hf_block2->cell_x != cell_x || hf_block2->cell_y != cell_y) continue;
+
+                            if (hf_block2->text_hash != hf_block->text_hash) continue;
 
                             double width2 = block2->x_max - block2->x_min;
                             double height2 = block2->y_max - block2->y_min;
@@ -477,9 +581,10 @@ uint32_t extract_header_footer(doc_t *doc, uint8_t *text, uint32_t text_size) {
                                     fabs(block->y_min - block2->y_min) < 10 &&
                                     fabs(width1 - width2) < 10 &&
                                     fabs(height1 - height2) < 10) {
-                                uint8_t data1[10000] = {0};
-                                uint8_t data2[10000] = {0};
-                                get_block_text(block, data1, sizeof(data1));
+                                if (!data1_ready) {
+                                    get_block_text(block, data1, sizeof(data1));
+                                    data1_ready = 1;
+                                }
                                 get_block_text(block2, data2, sizeof(data2));
 
                                 if (!strcmp(data1, data2)) {
@@ -496,6 +601,11 @@ uint32_t extract_header_footer(doc_t *doc, uint8_t *text, uint32_t text_size) {
             }
         }
     }
+
+    for (uint32_t page_i = 0; page_i < doc->pages_len; page_i++) {
+        destroy_hf_page(&hf_pages[page_i]);
+    }
+
     return 0;
 }
 
@@ -542,82 +652,224 @@ uint32_t skip_block(line_block_t *line_blocks, uint32_t line_blocks_len, uint32_
     return 0;
 }
 
-uint32_t title_to_doi(doc_t *doc, uint8_t *processed_text, uint32_t processed_text_len, uint8_t *doi) {
-    uint32_t count = 0;
-    uint32_t max_title_len = 0;
+typedef struct title_candidate {
+    // Line block the candidate comes from
+    uint32_t block_i;
+    uint8_t *title;
+} title_candidate_t;
+
+typedef struct title_candidates {
+    title_candidate_t *items;
+    uint32_t len;
+    uint32_t size;
+} title_candidates_t;
+
+void add_title_candidate(title_candidates_t *candidates, uint32_t block_i, uint8_t *title) {
+    if (candidates->len == candidates->size) {
+        candidates->size = candidates->size ? candidates->size * 2 : 32;
+        candidates->items = (title_candidate_t *) realloc(candidates->items,
+                                                          sizeof(title_candidate_t) * candidates->size);
+    }
+    uint32_t title_len = strlen(title);
+    title_candidate_t *candidate = &candidates->items[candidates->len++];
+    candidate->block_i = block_i;
+    candidate->title = (uint8_t *) malloc(title_len + 1);
+    memcpy(candidate->title, title, title_len + 1);
+}
 
+void destroy_title_candidates(title_candidates_t *candidates) {
+    for (uint32_t i = 0; i < candidates->len; i++) {
+        free(candidates->items[i].title);
+    }
+    free(candidates->items);
+}
+
+// Collects the title lines of a page to look up, in lookup order
+void get_title_candidates(page_t *page, title_candidates_t *candidates) {
     uint8_t output_text[MAX_LOOKUP_TEXT_LEN];
-    uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
 
-    for (uint32_t page_i = 0; page_i + 1 < doc->pages_len && page_i < 3; page_i++) {
-        page_t *page = doc->pages + page_i;
-        line_block_t line_blocks[MAX_LINE_BLOCKS];
-        uint32_t line_blocks_len = 0;
-        get_line_blocks(page, line_blocks, &line_blocks_len);
+    line_block_t line_blocks[MAX_LINE_BLOCKS];
+    uint32_t line_blocks_len = 0;
+    get_line_blocks(page, line_blocks, &line_blocks_len);
 
-        for (uint32_t i = 0; i < line_blocks_len; i++) {
-            line_block_t *gb = &line_blocks[i];
+    for (uint32_t i = 0; i < line_blocks_len; i++) {
+        line_block_t *gb = &line_blocks[i];
 
-            if (count > 100) break;
+        if (skip_block(line_blocks, line_blocks_len, i)) continue;
 
-            if (skip_block(line_blocks, line_blocks_len, i)) continue;
+        for (uint32_t m = 0; m < gb->lines_len && m < 2; m++) {
+            uint8_t title[1024] = {0};
+            uint32_t title_len = 0;
 
-            for (uint32_t m = 0; m < gb->lines_len && m < 2; m++) {
-                uint8_t title[1024] = {0};
-                uint32_t title_len = 0;
+            if (gb->lines_len - m > 7) continue;
 
-                if (gb->lines_len - m > 7) continue;
+            line_block_to_text(gb, m, title, &title_len, sizeof(title));
 
-                line_block_to_text(gb, m, title, &title_len, sizeof(title));
+            uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
+            text_process(title, output_text, &output_text_len);
 
-                uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
-                text_process(title, output_text, &output_text_len);
+            if (output_text_len < 15 || output_text_len > 300) continue;
 
-                if (output_text_len < 15 || output_text_len > 300) continue;
+            if (!title_len) continue;
 
-                if (title_len <= max_title_len) continue;
+            add_title_candidate(candidates, i, title);
+        }
 
-                count++;
-                if (get_doi_by_title(title, processed_text, processed_text_len, doi)) {
-                    log_debug("found doi %s in page %d", doi, page_i);
-                }
-            }
+        if (i + 1 < line_blocks_len) {
+            uint8_t title[1024] = {0};
+            uint32_t title_len = 0;
+
+            line_block_t *cur_lb = &line_blocks[i];
+            line_block_t *next_lb = &line_blocks[i + 1];
 
-            if (i + 1 < line_blocks_len) {
-                uint8_t title[1024] = {0};
-                uint32_t title_len = 0;
+            if (cur_lb->y_min > page->height / 3) continue;
 
-                line_block_t *cur_lb = &line_blocks[i];
-                line_block_t *next_lb = &line_blocks[i + 1];
+            if (cur_lb->lines_len + next_lb->lines_len > 6) continue;
 
-                if (cur_lb->y_min > page->height / 3) continue;
+            line_block_to_text(cur_lb, 0, title, &title_len, sizeof(title));
+            line_block_to_text(next_lb, 0, title + title_len, &title_len, sizeof(title) - title_len);
 
-                if (cur_lb->lines_len + next_lb->lines_len > 6) continue;
+            uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
+            text_process(title, output_text, &output_text_len);
 
-                line_block_to_text(cur_lb, 0, title, &title_len, sizeof(title));
-                line_block_to_text(next_lb, 0, title + title_len, &title_len, sizeof(title) - title_len);
+            if (output_text_len < 15 || output_text_len > 300) continue;
 
-                uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
-                text_process(title, output_text, &output_text_len);
+            add_title_candidate(candidates, i, title);
+        }
+    }
+}
 
-                if (output_text_len < 15 || output_text_len > 300) continue;
+typedef struct title_task {
+    doc_t *doc;
+    title_candidates_t *candidates;
+} title_task_t;
 
-                count++;
-                if (get_doi_by_title(title, processed_text, processed_text_len, doi)) {
-                    log_debug("found doi %s in page %d", doi, page_i);
-                }
+void get_title_candidates_task(void *arg, uint32_t page_i) {
+    title_task_t *task = arg;
+    get_title_candidates(task->doc->pages + page_i, &task->candidates[page_i]);
+}
+
+uint32_t title_to_doi(doc_t *doc, uint8_t *processed_text, uint32_t processed_text_len, uint8_t *doi) {
+    uint32_t count = 0;
+
+    uint32_t pages_len = doc->pages_len - 1 < 3 ? doc->pages_len - 1 : 3;
+    title_candidates_t candidates[3] = {0};
+
+    // Candidates can be collected in parallel, but lookups stay sequential on this
+    // thread, because they share the doidata connection
+    title_task_t task = {doc, candidates};
+    if (!task_run(get_title_candidates_task, &task, pages_len)) {
+        for (uint32_t page_i = 0; page_i < pages_len; page_i++) {
+            get_title_candidates(doc->pages + page_i, &candidates[page_i]);
+        }
+    }
+
+    for (uint32_t page_i = 0; page_i < pages_len; page_i++) {
+        uint32_t block_i = UINT32_MAX;
+
+        for (uint32_t i = 0; i < candidates[page_i].len; i++) {
+            title_candidate_t *candidate = &candidates[page_i].items[i];
+
+            // The limits are checked once per line block
+            if (candidate->block_i != block_i) {
+                block_i = candidate->block_i;
+
+                if (count > 100) break;
+
+                // Each candidate is a lookup, so stop between them when out of time
+                if (deadline_check(STATS_TITLE_TO_DOI)) break;
+            }
+
+            count++;
+            if (get_doi_by_title(candidate->title, processed_text, processed_text_len, doi)) {
+                log_debug("found doi %s in page %d", doi, page_i);
             }
         }
 
+        destroy_title_candidates(&candidates[page_i]);
+    }
+
+    return 0;
+}
+
+uint32_t extract_abstract(page_t *page, uint8_t *abstract, uint32_t abstract_size) {
+    return extract_abstract_structured(page, abstract, abstract_size) ||
+           extract_abstract_simple(page, abstract, abstract_size);
+}
+
+typedef struct abstract_task {
+    doc_t *doc;
+    uint8_t *found;
+    uint8_t (*abstracts)[ABSTRACT_LEN + 1];
+} abstract_task_t;
+
+void find_abstract_task(void *arg, uint32_t page_i) {
+    abstract_task_t *task = arg;
+    if (deadline_check(STATS_ABSTRACT)) return;
+    task->found[page_i] = extract_abstract(&task->doc->pages[page_i], task->abstracts[page_i], ABSTRACT_LEN + 1);
+}
+
+// Returns the page the abstract search has to start from. Pages are searched in parallel
+// when there are idle cores. The first page with an abstract is returned with *copied set
+// and the abstract copied, and when there is none the serial search only needs to repeat
+// the last page, which leaves the same result
+uint32_t find_abstract_page(doc_t *doc, uint8_t *abstract, uint32_t abstract_size, uint32_t *copied) {
+    uint8_t found[MAX_PAGES] = {0};
+    uint8_t abstracts[MAX_PAGES][ABSTRACT_LEN + 1];
+    abstract_task_t task = {doc, found, abstracts};
+    *copied = 0;
+    if (!task_run(find_abstract_task, &task, doc->pages_len)) return 0;
+
+    for (uint32_t i = 0; i < doc->pages_len; i++) {
+        if (found[i]) {
+            memcpy(abstract, abstracts[i], abstract_size);
+            *copied = 1;
+            return i;
+        }
     }
-    //printf("get_doi_by_title: %d\n", count);
+    return doc->pages_len - 1;
+}
 
-    return !!max_title_len;
+#define STAGE(stage) (1u << (stage))
+
+typedef struct recognize_stage {
+    stats_stage_t stage;
+    // Fields the stage fills
+    uint32_t fields;
+    // Stages whose results it uses
+    uint32_t needs;
+} recognize_stage_t;
+
+// Each stage is listed after the stages it needs. JSTOR detection isn't here, because it runs
+// for every document: it's cheap, and a JSTOR cover page decides all fields on its own
+recognize_stage_t recognize_stages[] = {
+        {STATS_TEXT,         0,                                                            0},
+        {STATS_IDENTIFIERS,  FIELD_DOI | FIELD_ISBN | FIELD_ARXIV | FIELD_ISSN | FIELD_TITLE, STAGE(STATS_TEXT)},
+        {STATS_ABSTRACT,     FIELD_ABSTRACT,                                               0},
+        {STATS_PAGES,        FIELD_PAGES,                                                  0},
+        {STATS_HEADFOOT,     FIELD_CONTAINER | FIELD_VOLUME | FIELD_ISSUE | FIELD_YEAR,    0},
+        {STATS_TITLE_AUTHOR, FIELD_TITLE | FIELD_AUTHORS,                                  STAGE(STATS_PAGES)},
+        {STATS_TITLE_TO_DOI, FIELD_DOI,                                                    STAGE(STATS_TEXT) |
+                                                                                           STAGE(STATS_IDENTIFIERS)}
+};
+
+// Returns the stages that produce the given fields, and the stages they need
+uint32_t get_recognize_stages(uint32_t fields) {
+    uint32_t stages = 0;
+    // Walking backwards, a stage is reached only after all stages that need it
+    for (int32_t i = sizeof(recognize_stages) / sizeof(recognize_stage_t) - 1; i >= 0; i--) {
+        recognize_stage_t *stage = &recognize_stages[i];
+        if (stage->fields & fields) stages |= STAGE(stage->stage);
+        if (stages & STAGE(stage->stage)) stages |= stage->needs;
+    }
+    return stages;
 }
 
-uint32_t recognize(json_t *body, res_metadata_t *result) {
+uint32_t recognize(json_t *body, recognize_options_t *options, res_metadata_t *result) {
     memset(result, 0, sizeof(res_metadata_t));
 
+    uint32_t stages = get_recognize_stages(options ? options->fields : FIELDS_ALL);
+
     strcpy(result->type, "journal-article");
 
     json_t *json_metadata = json_object_get(body, "metadata");
@@ -633,127 +885,186 @@ uint32_t recognize(json_t *body, res_metadata_t *result) {
         process_metadata(json_metadata, &pdf_metadata);
     }
 
+    uint64_t t = stats_now();
+
     doc_t *doc = get_doc(body);
 
-    if (doc->pages_len == 0) return 0;
+    t = stats_lap(STATS_GET_DOC, t);
+
+    if (!doc) return 0;
+
+    if (doc->pages_len == 0) {
+        destroy_doc(doc);
+        return 0;
+    }
+
+    if (deadline_check(STATS_GET_DOC)) goto end;
 
-    if (extract_jstor(&doc->pages[0], result)) goto end;
+    if (doc->pages[0].has_jstor_url) {
+        uint32_t is_jstor = extract_jstor(&doc->pages[0], result);
+        t = stats_lap(STATS_JSTOR, t);
+        if (is_jstor) goto end;
+    }
 
     uint8_t text[MAX_LOOKUP_TEXT_LEN];
     uint32_t text_len = MAX_LOOKUP_TEXT_LEN;
     uint8_t processed_text[MAX_LOOKUP_TEXT_LEN];
     uint32_t processed_text_len = MAX_LOOKUP_TEXT_LEN;
 
-    doc_to_text(doc, text, &text_len, MAX_LOOKUP_TEXT_LEN - 1, total_pages);
-    text_process(text, processed_text, &processed_text_len);
+    if (stages & STAGE(STATS_TEXT)) {
+        doc_to_text(doc, text, &text_len, MAX_LOOKUP_TEXT_LEN - 1, total_pages);
+        text_process(text, processed_text, &processed_text_len);
 
-    if (!processed_text_len) goto end;
+        t = stats_lap(STATS_TEXT, t);
+
+        if (!processed_text_len || deadline_check(STATS_TEXT)) goto end;
+    }
 
-    extract_doi(text, result->doi);
-    extract_isbn(text, result->isbn);
-    extract_arxiv(text, result->arxiv);
-    extract_issn(text, result->issn);
+    if (stages & STAGE(STATS_IDENTIFIERS)) {
+        uint32_t doi_confirmed = extract_doi(text, result->doi);
+        extract_isbn(text, result->isbn);
+        extract_arxiv(text, result->arxiv);
+        extract_issn(text, result->issn);
 
-    if (!*result->doi) {
-        if (strlen(pdf_metadata.title)) {
-            if (get_doi_by_title(pdf_metadata.title, processed_text, processed_text_len, result->doi)) {
-                strcpy(result->title, pdf_metadata.title);
+        if (!*result->doi) {
+            if (strlen(pdf_metadata.title)) {
+                if (get_doi_by_title(pdf_metadata.title, processed_text, processed_text_len, result->doi)) {
+                    strcpy(result->title, pdf_metadata.title);
+                }
             }
         }
+
+        t = stats_lap(STATS_IDENTIFIERS, t);
+
+        if (deadline_check(STATS_IDENTIFIERS)) goto end;
+
+        // The remaining fields would mostly be replaced by resolving the DOI anyway
+        if (doi_confirmed && options && options->identifier_first) {
+            result->early_exit = 1;
+            stats_count(STATS_IDENTIFIER_FIRST_EXITS, 1);
+            goto end;
+        }
     }
 
     uint32_t first_page = 0;
 
-    for (uint32_t i = 0; i < doc->pages_len; i++) {
-        page_t *pg = &doc->pages[i];
-        if (
-                extract_abstract_structured(pg, result->abstract, sizeof(result->abstract)) ||
-                extract_abstract_simple(pg, result->abstract, sizeof(result->abstract))) {
-            //first_page = i;
-            log_debug("abstract found in page index %d\n", first_page);
-
-
-            uint8_t *c = &result->abstract[strlen(result->abstract) - 1];
-            while (c >= result->abstract) {
-                if (*c == ' ' || *c == '\n' || *c == '\r') {
-                    *c = 0;
-                } else {
-                    break;
-                }
-                c--;
+    if (stages & STAGE(STATS_ABSTRACT)) {
+        uint32_t found = 0;
+        uint32_t i = find_abstract_page(doc, result->abstract, sizeof(result->abstract), &found);
+        for (; i < doc->pages_len; i++) {
+            if (!found) {
+                if (deadline_check(STATS_ABSTRACT)) break;
+                found = extract_abstract(&doc->pages[i], result->abstract, sizeof(result->abstract));
             }
 
-            uint32_t found_keywords = 0;
-            c = &result->abstract[strlen(result->abstract) - 1];
-            while (c > result->abstract) {
-                if (!strncmp(c, "Keywords:", 9) || !strncmp(c, "KEYWORDS:", 9)) {
-                    *(c - 1) = 0;
-                    found_keywords = 1;
+            if (found) {
+                //first_page = i;
+                log_debug("abstract found in page index %d\n", first_page);
+
+
+                uint8_t *c = &result->abstract[strlen(result->abstract) - 1];
+                while (c >= result->abstract) {
+                    if (*c == ' ' || *c == '\n' || *c == '\r') {
+                        *c = 0;
+                    } else {
+                        break;
+                    }
+                    c--;
                 }
-                c--;
-            }
 
-            if (!found_keywords && *result->abstract && result->abstract[strlen(result->abstract) - 1] != '.') {
-                *result->abstract = 0;
-                first_page = 0;
-            }
+                uint32_t found_keywords = 0;
+                c = &result->abstract[strlen(result->abstract) - 1];
+                while (c > result->abstract) {
+                    if (!strncmp(c, "Keywords:", 9) || !strncmp(c, "KEYWORDS:", 9)) {
+                        *(c - 1) = 0;
+                        found_keywords = 1;
+                    }
+                    c--;
+                }
+
+                if (!found_keywords && *result->abstract && result->abstract[strlen(result->abstract) - 1] != '.') {
+                    *result->abstract = 0;
+                    first_page = 0;
+                }
 
-            break;
+                break;
+            }
         }
-    }
 
-    if (!first_page) {
-        uint32_t res;
+        t = stats_lap(STATS_ABSTRACT, t);
+
+        if (deadline_check(STATS_ABSTRACT)) goto end;
+    }
 
-        res = get_first_page_by_width(doc);
-        if (res) {
-            first_page = res;
-        } else {
+    if (stages & STAGE(STATS_PAGES)) {
+        if (!first_page) {
+            uint32_t res;
 
-            res = get_first_page_by_fonts(doc);
+            res = get_first_page_by_width(doc);
             if (res) {
                 first_page = res;
+            } else {
+
+                res = get_first_page_by_fonts(doc);
+                if (res) {
+                    first_page = res;
+                }
             }
         }
-    }
 
-    uint32_t start;
-    uint32_t first = 1;
-    uint32_t last = total_pages;
+        uint32_t start;
+        uint32_t first = 1;
+        uint32_t last = total_pages;
 
-    if (extract_pages(doc, &start, &first)) {
-        if (first == 1) {
-            first_page = start;
-        } else if (first == 2 && start >= 1) {
-            first_page = start - 1;
-            first = 1;
-        }
+        if (extract_pages(doc, &start, &first)) {
+            if (first == 1) {
+                first_page = start;
+            } else if (first == 2 && start >= 1) {
+                first_page = start - 1;
+                first = 1;
+            }
 
-        last = first + total_pages - first_page - 1;
+            last = first + total_pages - first_page - 1;
 
-        log_debug("pages: total: %d, start: %d, first: %d, last: %d\n", total_pages, start, first, last);
-    }
+            log_debug("pages: total: %d, start: %d, first: %d, last: %d\n", total_pages, start, first, last);
+        }
 
-    if (!*result->pages) {
-        if (first > 1) {
-            sprintf(result->pages, "%d-%d", first, last);
-        } else {
-            sprintf(result->pages, "%d", last);
+        if (!*result->pages) {
+            if (first > 1) {
+                sprintf(result->pages, "%d-%d", first, last);
+            } else {
+                sprintf(result->pages, "%d", last);
+            }
         }
+
+        log_debug("first page: %d", first_page);
+
+        t = stats_lap(STATS_PAGES, t);
+
+        if (deadline_check(STATS_PAGES)) goto end;
     }
 
-    log_debug("first page: %d", first_page);
+    if (stages & STAGE(STATS_HEADFOOT)) {
+        extract_from_headfoot(doc, result->container, result->volume, result->issue, result->year);
+
+        t = stats_lap(STATS_HEADFOOT, t);
+
+        if (deadline_check(STATS_HEADFOOT)) goto end;
+    }
 
-    page_t *page = &doc->pages[first_page];
+    if (stages & STAGE(STATS_TITLE_AUTHOR)) {
+        page_t *page = &doc->pages[first_page];
 
-    extract_from_headfoot(doc, result->container, result->volume, result->issue, result->year);
+        if (!extract_title_author(page, result->title, result->authors) && first_page == 0 && doc->pages_len >= 2) {
+            extract_title_author(&doc->pages[1], result->title, result->authors);
+        }
 
-    if (!extract_title_author(page, result->title, result->authors) && first_page == 0 && doc->pages_len >= 2) {
-        extract_title_author(&doc->pages[1], result->title, result->authors);
+        t = stats_lap(STATS_TITLE_AUTHOR, t);
     }
 
-    if (!*result->doi) {
+    if ((stages & STAGE(STATS_TITLE_TO_DOI)) && !*result->doi && !deadline_check(STATS_TITLE_AUTHOR)) {
         title_to_doi(doc, processed_text, processed_text_len, result->doi);
+        t = stats_lap(STATS_TITLE_TO_DOI, t);
     }
 
     uint32_t title_len = strlen(result->title);
@@ -766,3 +1077,45 @@ uint32_t recognize(json_t *body, res_metadata_t *result) {
 
     return 0;
 }
+
+// Checks some pages of a document that is still being uploaded for what decides the result
+// without the other pages: a JSTOR cover page, or a DOI confirmed by doidata. page_i is the
+// index of the body's first page in the document. Returns 1 if found
+uint32_t recognize_early(json_t *body, uint32_t page_i, res_metadata_t *result) {
+    memset(result, 0, sizeof(res_metadata_t));
+
+    strcpy(result->type, "journal-article");
+
+    uint64_t t = stats_now();
+
+    doc_t *doc = get_doc(body);
+
+    t = stats_lap(STATS_GET_DOC, t);
+
+    if (!doc) return 0;
+
+    uint32_t found = 0;
+
+    if (page_i == 0 && doc->pages_len && doc->pages[0].has_jstor_url) {
+        found = extract_jstor(&doc->pages[0], result);
+        t = stats_lap(STATS_JSTOR, t);
+    }
+
+    if (!found && doc->pages_len) {
+        uint8_t text[MAX_LOOKUP_TEXT_LEN];
+        uint32_t text_len = MAX_LOOKUP_TEXT_LEN;
+
+        // Unlike recognize(), the last page is included too
+        doc_to_text(doc, text, &text_len, MAX_LOOKUP_TEXT_LEN - 1, doc->pages_len + 1);
+
+        t = stats_lap(STATS_TEXT, t);
+
+        found = extract_doi(text, result->doi);
+
+        t = stats_lap(STATS_IDENTIFIERS, t);
+    }
+
+    destroy_doc(doc);
+
+    return found;
+}
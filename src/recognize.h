@@ -4,6 +4,19 @@
 #include <jansson.h>
 #include "defines.h"
 
+typedef struct font {
+    uint32_t font_id;
+    double font_size;
+    uint32_t count;
+} font_t;
+
+typedef struct fonts_info {
+    font_t *fonts;
+    uint32_t fonts_len;
+    uint32_t *table;
+    uint32_t table_size;
+} fonts_info_t;
+
 typedef struct word {
     double x_min;
     double x_max;
@@ -31,6 +44,8 @@ typedef struct line {
     double y_min;
     double y_max;
     uint32_t char_len;
+    uint32_t dominating_font;
+    double dominating_font_size;
 } line_t;
 
 typedef struct block {
@@ -52,6 +67,14 @@ typedef struct flow {
     uint32_t blocks_len;
 } flow_t;
 
+typedef struct page_number {
+    double x_min;
+    double x_max;
+    double y_min;
+    uint32_t value;
+    uint32_t next;
+} page_number_t;
+
 typedef struct page {
     flow_t *flows;
     uint32_t flows_len;
@@ -61,6 +84,13 @@ typedef struct page {
     double content_x_right;
     uint32_t fs_dist[1000];
     uint32_t fs_dist_len;
+    // Text length by font id, for first page detection
+    fonts_info_t font_ids;
+    uint8_t has_jstor_url;
+    page_number_t *numbers;
+    uint32_t numbers_len;
+    uint32_t numbers_size;
+    uint32_t numbers_buckets[PAGE_NUMBER_BUCKETS];
 } page_t;
 
 typedef struct doc {
@@ -85,6 +115,10 @@ typedef struct res_metadata {
     uint8_t issue[ISSUE_LEN + 1];
     uint8_t issn[ISSN_LEN + 1];
     uint8_t url[URL_LEN + 1];
+    // Set when the time budget ran out before all stages ran
+    uint8_t partial;
+    // Set when the stages after identifiers were skipped for a confirmed DOI
+    uint8_t early_exit;
 } res_metadata_t;
 
 typedef struct pdf_metadata {
@@ -93,6 +127,39 @@ typedef struct pdf_metadata {
     uint8_t authors[AUTHORS_LEN];
 } pdf_metadata_t;
 
-uint32_t recognize(json_t *body, res_metadata_t *result);
+doc_t *get_doc(json_t *body);
+
+uint32_t destroy_doc(doc_t *doc);
+
+uint32_t doc_to_text(doc_t *doc, uint8_t *text, uint32_t *text_len, uint32_t max_text_size, uint32_t total_pages);
+
+// Result fields as bits, in res_metadata_t order
+#define FIELD_TYPE (1u << 0)
+#define FIELD_TITLE (1u << 1)
+#define FIELD_AUTHORS (1u << 2)
+#define FIELD_DOI (1u << 3)
+#define FIELD_ISBN (1u << 4)
+#define FIELD_ARXIV (1u << 5)
+#define FIELD_ABSTRACT (1u << 6)
+#define FIELD_CONTAINER (1u << 7)
+#define FIELD_PUBLISHER (1u << 8)
+#define FIELD_YEAR (1u << 9)
+#define FIELD_PAGES (1u << 10)
+#define FIELD_VOLUME (1u << 11)
+#define FIELD_ISSUE (1u << 12)
+#define FIELD_ISSN (1u << 13)
+#define FIELD_URL (1u << 14)
+#define FIELDS_ALL ((1u << 15) - 1)
+
+typedef struct recognize_options {
+    // Requested fields. Stages that don't contribute to them are skipped
+    uint32_t fields;
+    // Return right after identifiers when a DOI is confirmed by doidata
+    uint8_t identifier_first;
+} recognize_options_t;
+
+uint32_t recognize(json_t *body, recognize_options_t *options, res_metadata_t *result);
+
+uint32_t recognize_early(json_t *body, uint32_t page_i, res_metadata_t *result);
 
 #endif //RECOGNIZER_SERVER_RECOGNIZE_H
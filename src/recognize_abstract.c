@@ -8,6 +8,11 @@
 #include "log.h"
 #include "recognize_abstract.h"
 
+// U8_APPEND doesn't check capacity for ASCII characters, and the separators after a character
+// are appended unchecked. Extraction gives up on an abstract that would be longer than the
+// buffer, instead of returning it cut off
+#define ABSTRACT_IS_FULL(len, size) ((len) + U8_MAX_LENGTH + 4 >= (size))
+
 uint32_t is_simple_abstract_name(uint8_t *text) {
     static uint8_t names[10][32] = {
             "abstract",
@@ -129,6 +134,11 @@ uint32_t extract_abstract_simple(page_t *page, uint8_t *abstract, uint32_t abstr
 //                                        return 0;
 //                                    }
 
+                                    if (ABSTRACT_IS_FULL(abstract_len, abstract_size)) {
+                                        *abstract = 0;
+                                        return 0;
+                                    }
+
                                     U8_APPEND(abstract, abstract_len, abstract_size - 1, c, error);
                                     if (error) {
                                         *abstract = 0;
@@ -335,6 +345,11 @@ uint32_t extract_abstract_structured(page_t *page, uint8_t *abstract, uint32_t a
 
                             if (!c) break;
 
+                            if (ABSTRACT_IS_FULL(abstract_len, abstract_size)) {
+                                *abstract = 0;
+                                return 0;
+                            }
+
                             U8_APPEND(abstract, abstract_len, abstract_size - 1, c, error);
                             if (error) {
                                 *abstract = 0;
@@ -7,54 +7,120 @@
 #include "log.h"
 #include "recognize_fonts.h"
 
-void increment_font(fonts_info_t *fonts_info, uint32_t font_id, double font_size, uint32_t value) {
-    for (uint32_t i = 0; i < fonts_info->fonts_len; i++) {
-        font_t *font = &fonts_info->fonts[i];
+// Fonts are kept in insertion order in fonts_info->fonts, and the open addressing
+// table maps (font_id, font_size) to font index + 1. Statistics keyed only by
+// font id use font_size 0, and statistics keyed only by size use font_id 0
+
+uint32_t get_font_slot(fonts_info_t *fonts_info, uint32_t font_id, double font_size) {
+    uint64_t size_bits;
+    memcpy(&size_bits, &font_size, sizeof(size_bits));
+    uint64_t h = ((uint64_t) font_id * 0x9E3779B97F4A7C15ull) ^ (size_bits * 0xC2B2AE3D27D4EB4Full);
+    return (uint32_t) (h ^ (h >> 32)) & (fonts_info->table_size - 1);
+}
+
+uint32_t init_fonts_info(fonts_info_t *fonts_info) {
+    memset(fonts_info, 0, sizeof(fonts_info_t));
+    return 1;
+}
+
+void clear_fonts_info(fonts_info_t *fonts_info) {
+    if (fonts_info->table_size) memset(fonts_info->table, 0, sizeof(uint32_t) * fonts_info->table_size);
+    fonts_info->fonts_len = 0;
+}
+
+void destroy_fonts_info(fonts_info_t *fonts_info) {
+    free(fonts_info->fonts);
+    free(fonts_info->table);
+    memset(fonts_info, 0, sizeof(fonts_info_t));
+}
+
+font_t *get_font(fonts_info_t *fonts_info, uint32_t font_id, double font_size) {
+    if (!fonts_info->table_size) return 0;
+
+    uint32_t slot = get_font_slot(fonts_info, font_id, font_size);
+    while (fonts_info->table[slot]) {
+        font_t *font = &fonts_info->fonts[fonts_info->table[slot] - 1];
         if (font->font_id == font_id && font->font_size == font_size) {
-            font->count += value;
-            return;
+            return font;
         }
+        slot = (slot + 1) & (fonts_info->table_size - 1);
     }
+    return 0;
+}
+
+uint32_t grow_fonts_info(fonts_info_t *fonts_info) {
+    uint32_t table_size = fonts_info->table_size ? fonts_info->table_size * 2 : 16;
 
-    fonts_info->fonts_len++;
+    free(fonts_info->table);
+    fonts_info->table = (uint32_t *) calloc(table_size, sizeof(uint32_t));
+    fonts_info->table_size = table_size;
+    fonts_info->fonts = (font_t *) realloc(fonts_info->fonts, sizeof(font_t) * table_size / 2);
 
-    if (fonts_info->fonts_len == 1) {
-        fonts_info->fonts = (font_t *) malloc(sizeof(font_t) * fonts_info->fonts_len);
-    } else {
-        fonts_info->fonts = (font_t *) realloc(fonts_info->fonts, sizeof(font_t) * fonts_info->fonts_len);
+    for (uint32_t i = 0; i < fonts_info->fonts_len; i++) {
+        font_t *font = &fonts_info->fonts[i];
+        uint32_t slot = get_font_slot(fonts_info, font->font_id, font->font_size);
+        while (fonts_info->table[slot]) slot = (slot + 1) & (table_size - 1);
+        fonts_info->table[slot] = i + 1;
     }
 
-    fonts_info->fonts[fonts_info->fonts_len - 1].font_id = font_id;
-    fonts_info->fonts[fonts_info->fonts_len - 1].font_size = font_size;
-    fonts_info->fonts[fonts_info->fonts_len - 1].count = value;
+    return 1;
 }
 
-uint32_t init_fonts_info(fonts_info_t *fonts_info, page_t *pages, uint32_t pages_len) {
+void increment_font(fonts_info_t *fonts_info, uint32_t font_id, double font_size, uint32_t value) {
+    font_t *font = get_font(fonts_info, font_id, font_size);
+    if (font) {
+        font->count += value;
+        return;
+    }
+
+    // Keep the load factor at most 1/2
+    if ((fonts_info->fonts_len + 1) * 2 > fonts_info->table_size) {
+        grow_fonts_info(fonts_info);
+    }
 
-    fonts_info->fonts_len = 0;
+    uint32_t slot = get_font_slot(fonts_info, font_id, font_size);
+    while (fonts_info->table[slot]) slot = (slot + 1) & (fonts_info->table_size - 1);
+    fonts_info->table[slot] = fonts_info->fonts_len + 1;
 
-    for (uint32_t page_i = 0; page_i < pages_len; page_i++) {
-        page_t *page = pages + page_i;
+    font = &fonts_info->fonts[fonts_info->fonts_len++];
+    font->font_id = font_id;
+    font->font_size = font_size;
+    font->count = value;
+}
 
-        for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
-            flow_t *flow = page->flows + flow_i;
+// Called for each word while the document is parsed, so that later stages
+// don't need to rescan pages to get font statistics
+uint32_t add_word_font(page_t *page, word_t *word) {
+    increment_font(&page->font_ids, word->font, 0, word->text_len);
 
-            for (uint32_t block_i = 0; block_i < flow->blocks_len; block_i++) {
-                block_t *block = flow->blocks + block_i;
+    uint32_t font_size = (uint32_t) word->font_size;
 
-                for (uint32_t line_i = 0; line_i < block->lines_len; line_i++) {
-                    line_t *line = block->lines + line_i;
+    if (font_size > 999) return 0;
+    page->fs_dist[font_size] += word->text_len; // Measure length in UTF-8 characters
 
-                    for (uint32_t word_i = 0; word_i < line->words_len; word_i++) {
-                        word_t *word = line->words + word_i;
+    if (font_size + 1 > page->fs_dist_len) page->fs_dist_len = font_size + 1;
 
-                        increment_font(fonts_info, word->font, word->font_size, word->text_len);
-                    }
-                }
-            }
-        }
+    return 1;
+}
+
+// Dominating font and font size are measured by text length.
+// line_font_ids and line_font_sizes are reused scratch tables
+uint32_t set_line_dominating_font(line_t *line, fonts_info_t *line_font_ids, fonts_info_t *line_font_sizes) {
+    clear_fonts_info(line_font_ids);
+    clear_fonts_info(line_font_sizes);
+
+    for (uint32_t word_i = 0; word_i < line->words_len; word_i++) {
+        word_t *word = &line->words[word_i];
+        increment_font(line_font_ids, word->font, 0, word->text_len);
+        increment_font(line_font_sizes, 0, word->font_size, word->text_len);
     }
 
+    font_t *font = get_main_font(line_font_ids);
+    line->dominating_font = font && font->count ? font->font_id : 0;
+
+    font = get_main_font(line_font_sizes);
+    line->dominating_font_size = font && font->count ? font->font_size : 0;
+
     return 1;
 }
 
@@ -62,7 +128,7 @@ void print_fonts_info(fonts_info_t *fonts_info) {
     log_debug("fonts:\n");
     for (uint32_t i = 0; i < fonts_info->fonts_len; i++) {
         font_t *font = &fonts_info->fonts[i];
-        log_debug("%f %u\n", font->font_size, font->count);
+        log_debug("%u %f %u\n", font->font_id, font->font_size, font->count);
     }
     log_debug("\n");
 }
@@ -1,19 +1,19 @@
-
 #ifndef RECOGNIZER_SERVER_RECOGNIZE_FONTS_H
 #define RECOGNIZER_SERVER_RECOGNIZE_FONTS_H
 
-typedef struct font {
-    uint32_t font_id;
-    double font_size;
-    uint32_t count;
-} font_t;
+uint32_t init_fonts_info(fonts_info_t *fonts_info);
+
+void clear_fonts_info(fonts_info_t *fonts_info);
+
+void destroy_fonts_info(fonts_info_t *fonts_info);
+
+font_t *get_font(fonts_info_t *fonts_info, uint32_t font_id, double font_size);
+
+void increment_font(fonts_info_t *fonts_info, uint32_t font_id, double font_size, uint32_t value);
 
-typedef struct fonts_info {
-    font_t *fonts;
-    uint32_t fonts_len;
-} fonts_info_t;
+uint32_t add_word_font(page_t *page, word_t *word);
 
-uint32_t init_fonts_info(fonts_info_t *fonts_info, page_t *pages, uint32_t pages_len);
+uint32_t set_line_dominating_font(line_t *line, fonts_info_t *line_font_ids, fonts_info_t *line_font_sizes);
 
 void print_fonts_info(fonts_info_t *fonts_info);
 
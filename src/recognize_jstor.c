@@ -52,6 +52,30 @@ uint32_t extract_jt(uint8_t *text, uint8_t *regText, uint8_t groups[][2048], uin
     return ret;
 }
 
+// Checks if the line text starts with JSTOR stable URL, without building the line string.
+// Used during ingest to skip extract_jstor for documents without JSTOR cover page
+uint32_t is_jstor_line(line_t *line) {
+    uint8_t *prefix = JSTOR_STABLE_URL;
+    uint32_t prefix_len = sizeof(JSTOR_STABLE_URL) - 1;
+    uint32_t len = 0;
+
+    for (uint32_t word_i = 0; word_i < line->words_len && len < prefix_len; word_i++) {
+        word_t *word = line->words + word_i;
+
+        uint32_t n = word->text_len;
+        if (n > prefix_len - len) n = prefix_len - len;
+        if (memcmp(word->text, prefix + len, n)) return 0;
+        len += n;
+
+        if (word->space && len < prefix_len) {
+            if (prefix[len] != ' ') return 0;
+            len++;
+        }
+    }
+
+    return len == prefix_len;
+}
+
 uint32_t get_jstor_data(page_t *page, uint8_t *text, uint32_t *text_len, uint32_t max_text_size) {
     line_block_t line_blocks[MAX_LINE_BLOCKS];
     uint32_t line_blocks_len = 0;
@@ -93,7 +117,7 @@ uint32_t get_jstor_data(page_t *page, uint8_t *text, uint32_t *text_len, uint32_
             text[(*text_len)++] = '\n';
 //                text[++(*text_len)] = 0;
 
-            if (!strncmp(line_str, "Stable URL: http://www.jstor.org/stable/", 40)) {
+            if (!strncmp(line_str, JSTOR_STABLE_URL, sizeof(JSTOR_STABLE_URL) - 1)) {
                 return 1;
             }
         }
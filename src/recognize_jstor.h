@@ -2,6 +2,10 @@
 #ifndef RECOGNIZER_SERVER_RECOGNIZE_JSTOR_H
 #define RECOGNIZER_SERVER_RECOGNIZE_JSTOR_H
 
+#define JSTOR_STABLE_URL "Stable URL: http://www.jstor.org/stable/"
+
+uint32_t is_jstor_line(line_t *line);
+
 uint32_t extract_jstor(page_t *page, res_metadata_t *result);
 
 #endif //RECOGNIZER_SERVER_RECOGNIZE_JSTOR_H
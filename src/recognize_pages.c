@@ -6,114 +6,92 @@
 #include <math.h>
 #include "recognize.h"
 #include "log.h"
+#include "deadline.h"
 #include "recognize_pages.h"
 
-uint32_t extract_pages(doc_t *doc, uint32_t *start, uint32_t *first) {
-    for (uint32_t page_i = 0; page_i + 2 < doc->pages_len; page_i++) {
-        page_t *page = doc->pages + page_i;
-
-        for (uint32_t flow_i = 0; flow_i < page->flows_len; flow_i++) {
-            flow_t *flow = page->flows + flow_i;
-
-            for (uint32_t block_i = 0; block_i < flow->blocks_len; block_i++) {
-                block_t *block = flow->blocks + block_i;
-
-                for (uint32_t line_i = 0; line_i < block->lines_len; line_i++) {
-                    line_t *line = block->lines + line_i;
-                    if (line->y_max < 100 || line->y_min > page->height - 100) {
-
-                        for (uint32_t word_i = 0; word_i < line->words_len; word_i++) {
-                            word_t *word = line->words + word_i;
-
-                            if (
-                                    !(fabs(page->content_x_left - word->x_min) < 5.0 ||
-                                      fabs(page->content_x_right - word->x_max) < 5.0 ||
-                                      fabs((page->content_x_right - page->content_x_left) / 2 -
-                                           (word->x_min + (word->x_max - word->x_min) / 2)) < 5.0))
-                                continue;
-
-                            page_t *page2 = doc->pages + page_i + 2;
-
-                            for (uint32_t flow2_i = 0; flow2_i < page2->flows_len; flow2_i++) {
-                                flow_t *flow2 = page2->flows + flow2_i;
-
-                                for (uint32_t block2_i = 0; block2_i < flow2->blocks_len; block2_i++) {
-                                    block_t *block2 = flow2->blocks + block2_i;
-
-                                    for (uint32_t line2_i = 0; line2_i < block2->lines_len; line2_i++) {
-                                        line_t *line2 = block2->lines + line2_i;
-                                        if (line2->y_max < 100 || line2->y_min > page2->height - 100) {
-
-                                            for (uint32_t word2_i = 0; word2_i < line2->words_len; word2_i++) {
-                                                word_t *word2 = line2->words + word2_i;
-
-                                                if (
-                                                        fabs(word->y_min - word2->y_min) < 1.0 &&
-                                                        fabs(word->x_min - word2->x_min) < 15.0) {
-                                                    //log_debug("detected: %s %s\n", word->text, word2->text);
-
-                                                    uint8_t *w1;
-                                                    uint8_t *w2;
-
-                                                    uint32_t n;
-
-                                                    n = 0;
-
-                                                    uint32_t skip = 0;
-
-                                                    for (uint32_t i = 0; i < word->text_len && n < 30; i++) {
-                                                        if (word->text[i] < '0' || word->text[i] > '9') {
-                                                            skip = 1;
-                                                            break;
-                                                        }
-                                                    }
-
-                                                    n = 0;
-                                                    for (uint32_t i = 0; i < word2->text_len && n < 30; i++) {
-                                                        if (word2->text[i] < '0' || word2->text[i] > '9') {
-                                                            skip = 1;
-                                                            break;
-                                                        }
-                                                    }
-
-                                                    if (skip) continue;
-
-                                                    w1 = word->text;
-                                                    w2 = word2->text;
+uint32_t get_page_number_bucket(int32_t cell_y) {
+    return (uint32_t) cell_y % PAGE_NUMBER_BUCKETS;
+}
 
+// Collects numeric words from the top and bottom page margins, bucketed by y_min,
+// so extract_pages can match page numbers between pages without rescanning them
+uint32_t add_page_numbers(page_t *page, line_t *line) {
+    if (!(line->y_max < 100 || line->y_min > page->height - 100)) return 0;
 
-                                                    log_debug("%s %s\n", w1, w2);
+    for (uint32_t word_i = 0; word_i < line->words_len; word_i++) {
+        word_t *word = line->words + word_i;
 
-                                                    uint32_t nr1 = atoi(w1);
-                                                    uint32_t nr2 = atoi(w2);
-//                                                    log_debug("found numbers: %d %d\n", nr1, nr2);
-                                                    if (nr1 > 0 && nr2 == nr1 + 1) {
-                                                        log_debug("found numbers: %d %d\n", nr1, nr2);
-                                                        *start = page_i;
-                                                        *first = nr1;
-                                                        return 1;
-                                                    }
+        uint32_t is_number = 1;
+        for (uint32_t i = 0; i < word->text_len; i++) {
+            if (word->text[i] < '0' || word->text[i] > '9') {
+                is_number = 0;
+                break;
+            }
+        }
 
-                                                }
+        if (!is_number) continue;
 
+        uint32_t value = atoi(word->text);
+        if (!value) continue;
 
-                                            }
+        if (page->numbers_len == page->numbers_size) {
+            page->numbers_size = page->numbers_size ? page->numbers_size * 2 : 16;
+            page->numbers = (page_number_t *) realloc(page->numbers, sizeof(page_number_t) * page->numbers_size);
+        }
 
-                                        }
-                                    }
+        page_number_t *number = &page->numbers[page->numbers_len];
+        number->x_min = word->x_min;
+        number->x_max = word->x_max;
+        number->y_min = word->y_min;
+        number->value = value;
 
-                                }
-                            }
+        // Bucket heads and chain links store number index + 1, zero terminates the chain
+        uint32_t bucket = get_page_number_bucket((int32_t) floor(word->y_min));
+        number->next = page->numbers_buckets[bucket];
+        page->numbers_buckets[bucket] = ++page->numbers_len;
+    }
 
+    return 1;
+}
 
-                        }
+uint32_t extract_pages(doc_t *doc, uint32_t *start, uint32_t *first) {
+    for (uint32_t page_i = 0; page_i + 2 < doc->pages_len; page_i++) {
+        if (deadline_check(STATS_PAGES)) break;
 
+        page_t *page = doc->pages + page_i;
+        page_t *page2 = doc->pages + page_i + 2;
+
+        for (uint32_t number_i = 0; number_i < page->numbers_len; number_i++) {
+            page_number_t *number = &page->numbers[number_i];
+
+            if (
+                    !(fabs(page->content_x_left - number->x_min) < 5.0 ||
+                      fabs(page->content_x_right - number->x_max) < 5.0 ||
+                      fabs((page->content_x_right - page->content_x_left) / 2 -
+                           (number->x_min + (number->x_max - number->x_min) / 2)) < 5.0))
+                continue;
+
+            int32_t cell_y = (int32_t) floor(number->y_min);
+
+            for (int32_t y = cell_y - 1; y <= cell_y + 1; y++) {
+                uint32_t n = page2->numbers_buckets[get_page_number_bucket(y)];
+
+                while (n) {
+                    page_number_t *number2 = &page2->numbers[n - 1];
+                    n = number2->next;
+
+                    if (
+                            fabs(number->y_min - number2->y_min) < 1.0 &&
+                            fabs(number->x_min - number2->x_min) < 15.0 &&
+                            number2->value == number->value + 1) {
+                        log_debug("found numbers: %d %d\n", number->value, number2->value);
+                        *start = page_i;
+                        *first = number->value;
+                        return 1;
                     }
                 }
-
             }
         }
-
     }
 
     return 0;
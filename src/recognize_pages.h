@@ -2,6 +2,10 @@
 #ifndef RECOGNIZER_SERVER_RECOGNIZE_PAGES_H
 #define RECOGNIZER_SERVER_RECOGNIZE_PAGES_H
 
+uint32_t get_page_number_bucket(int32_t cell_y);
+
+uint32_t add_page_numbers(page_t *page, line_t *line);
+
 uint32_t extract_pages(doc_t *doc, uint32_t *start, uint32_t *first);
 
 #endif //RECOGNIZER_SERVER_RECOGNIZE_PAGES_H
@@ -11,6 +11,7 @@
 #include "log.h"
 #include "recognize_title.h"
 #include "recognize_authors.h"
+#include "stats.h"
 
 int print_line(line_t *line) {
     printf("%g %g %g %g ", line->x_min, line->x_max, line->y_min, line->y_max);
@@ -60,78 +61,6 @@ line_block_to_text(line_block_t *line_block, uint32_t from, uint8_t *text, uint3
     return 1;
 }
 
-uint32_t get_line_dominating_font(line_t *line) {
-    uint32_t fonts[100] = {0};
-    uint32_t fonts_count[100] = {0};
-    uint32_t fonts_len = 0;
-
-    for (int k = 0; k < line->words_len; k++) {
-        word_t *word = &line->words[k];
-
-        uint32_t found = 0;
-        for (uint32_t i = 0; i < fonts_len; i++) {
-            if (fonts[i] == word->font) {
-                fonts_count[i] += word->text_len;
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            fonts[fonts_len] = word->font;
-            fonts_count[fonts_len] = word->text_len;
-            fonts_len++;
-        }
-    }
-
-    uint32_t dominating_font = 0;
-    uint32_t dominating_font_count = 0;
-
-    for (uint32_t i = 0; i < fonts_len; i++) {
-        if (fonts_count[i] > dominating_font_count) {
-            dominating_font = fonts[i];
-            dominating_font_count = fonts_count[i];
-        }
-    }
-
-    return dominating_font;
-}
-
-double get_line_dominating_font_size(line_t *line) {
-    double font_sizes[100] = {0};
-    uint32_t font_sizes_count[100] = {0};
-    uint32_t font_sizes_len = 0;
-
-    for (int k = 0; k < line->words_len; k++) {
-        word_t *word = &line->words[k];
-
-        uint32_t found = 0;
-        for (uint32_t i = 0; i < font_sizes_len; i++) {
-            if (font_sizes[i] == word->font_size) {
-                font_sizes_count[i] += word->text_len;
-                found = 1;
-                break;
-            }
-        }
-        if (!found) {
-            font_sizes[font_sizes_len] = word->font_size;
-            font_sizes_count[font_sizes_len] = word->text_len;
-            font_sizes_len++;
-        }
-    }
-
-    double dominating_font_size = 0;
-    uint32_t dominating_font_size_count = 0;
-
-    for (uint32_t i = 0; i < font_sizes_len; i++) {
-        if (font_sizes_count[i] > dominating_font_size_count) {
-            dominating_font_size = font_sizes[i];
-            dominating_font_size_count = font_sizes_count[i];
-        }
-    }
-
-    return dominating_font_size;
-}
-
 uint32_t is_line_upper(line_t *line) {
     uint32_t total_num = 0;
     uint32_t upper_num = 0;
@@ -222,8 +151,8 @@ int add_line(line_block_t *line_blocks, uint32_t *line_blocks_len, line_t *line,
 
     if (*line_blocks_len >= MAX_LINE_BLOCKS) return 0;
 
-    double max_font_size = get_line_dominating_font_size(line);
-    uint32_t line_dominating_font = get_line_dominating_font(line);
+    double max_font_size = line->dominating_font_size;
+    uint32_t line_dominating_font = line->dominating_font;
     uint8_t upper = is_line_upper(line);
 
     uint32_t n = *line_blocks_len;
@@ -311,12 +240,14 @@ get_line_blocks(page_t *page, line_block_t *line_blocks, uint32_t *line_blocks_l
             }
         }
     }
+
+    stats_count(STATS_LINE_BLOCKS, *line_blocks_len);
 }
 
 uint32_t print_block(line_block_t *gb) {
     for (int j = 0; j < gb->lines_len; j++) {
         line_t *line = gb->lines[j];
-        printf("%g %g %d %d %g ", get_line_dominating_font_size(line), gb->max_font_size, gb->upper, gb->bold,
+        printf("%g %g %d %d %g ", line->dominating_font_size, gb->max_font_size, gb->upper, gb->bold,
                line->y_min);
 //          printf("%g %g  %g %g  %g %g ",gb->x_min, gb->x_max, line->x_min, line->x_max, line->y_min, line->y_max);
         for (int k = 0; k < line->words_len; k++) {
@@ -630,6 +561,8 @@ uint8_t find_author(uint8_t *text, uint32_t text_len, uint32_t author_hash, uint
 }
 
 uint32_t get_doi_by_title(uint8_t *title, uint8_t *processed_text, uint32_t processed_text_len, uint8_t *doi) {
+    stats_count(STATS_GET_DOI_BY_TITLE_CALLS, 1);
+
     uint8_t output_text[MAX_LOOKUP_TEXT_LEN];
     uint32_t output_text_len = MAX_LOOKUP_TEXT_LEN;
     text_process(title, output_text, &output_text_len);
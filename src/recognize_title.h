@@ -20,6 +20,8 @@ typedef struct line_block {
 
 uint32_t print_block(line_block_t *gb);
 
+uint8_t find_author(uint8_t *text, uint32_t text_len, uint32_t author_hash, uint32_t author_len);
+
 uint32_t get_doi_by_title(uint8_t *title, uint8_t *processed_text, uint32_t processed_text_len, uint8_t *doi);
 
 uint32_t get_line_blocks(page_t *page, line_block_t *line_blocks, uint32_t *line_blocks_len);
@@ -11,6 +11,10 @@
 #include "journal.h"
 #include "recognize_various.h"
 
+#define XXH_STATIC_LINKING_ONLY
+
+#include "xxhash.h"
+
 uint32_t extract_doi(uint8_t *text, uint8_t *doi) {
     uint32_t ret = 0;
 
@@ -329,55 +333,127 @@ uint32_t extract_issn(uint8_t *text, uint8_t *issn) {
     return ret;
 }
 
+typedef struct journal_token {
+    uint32_t start;
+    uint32_t end;
+    uint32_t run;
+    uint8_t *processed;
+    uint32_t processed_len;
+} journal_token_t;
+
+uint32_t is_journal_token_char(UChar32 c) {
+    return u_isUAlphabetic(c) || c == '\'' || c == '.';
+}
+
+// Splits text into tokens of alphabetic characters, apostrophes and dots.
+// Tokens separated by a single whitespace character share the same run,
+// because a journal name can't span over punctuation, numbers or empty lines
+uint32_t get_journal_tokens(uint8_t *text, journal_token_t *tokens, uint32_t *tokens_len,
+                            uint8_t *processed, uint32_t processed_size) {
+    uint8_t token_text[MAX_LOOKUP_TEXT_LEN];
+    uint32_t processed_offset = 0;
+    uint32_t run = 0;
+    uint32_t separators = 0;
+
+    *tokens_len = 0;
+
+    int32_t s, i = 0;
+    UChar32 c;
+
+    while (1) {
+        s = i;
+        U8_NEXT(text, i, -1, c);
+        if (!c) break;
+
+        if (!is_journal_token_char(c)) {
+            if (u_isUWhiteSpace(c)) {
+                separators++;
+            } else {
+                separators = 2;
+            }
+            continue;
+        }
+
+        if (*tokens_len && separators != 1) run++;
+        separators = 0;
+
+        journal_token_t *token = &tokens[(*tokens_len)++];
+        token->start = s;
+        token->run = run;
+
+        while (1) {
+            s = i;
+            U8_NEXT(text, i, -1, c);
+            if (!c || !is_journal_token_char(c)) break;
+        }
+        i = s;
+        token->end = s;
+
+        uint32_t token_len = token->end - token->start;
+        if (token_len >= sizeof(token_text)) token_len = sizeof(token_text) - 1;
+        memcpy(token_text, text + token->start, token_len);
+        token_text[token_len] = 0;
+
+        token->processed = processed + processed_offset;
+        token->processed_len = processed_size - processed_offset;
+        if (!text_process(token_text, token->processed, &token->processed_len)) {
+            token->processed_len = 0;
+        }
+        processed_offset += token->processed_len + 1;
+        if (processed_offset + 1 >= processed_size) break;
+    }
+
+    return 1;
+}
+
+// Looks for journal names embedded anywhere in the text. Each journal name in
+// journal.dat is hashed from the processed (lowercased, alphabetic only) name,
+// and processing is concatenative, therefore the hash of a token window can be
+// extended token by token instead of reprocessing and rehashing each span
 uint32_t extract_journal(uint8_t *text, uint8_t *journal) {
-    UErrorCode errorCode = U_ZERO_ERROR;
     uint32_t text_len = strlen(text);
-    UConverter *conv = ucnv_open("UTF-8", &errorCode);
-    int32_t target_len = UCNV_GET_MAX_BYTES_FOR_STRING(text_len, ucnv_getMaxCharSize(conv));
-    UChar *uc = malloc(target_len);
-    ucnv_toUChars(conv, uc, target_len, text, text_len, &errorCode);
+    uint32_t ret = 0;
 
-    URegularExpression *regEx;
-    const char regText[] = "([\\p{Alphabetic}'.]+\\s)*[\\p{Alphabetic}'.]+";
-    UErrorCode uStatus = U_ZERO_ERROR;
+    journal_token_t *tokens = malloc(sizeof(journal_token_t) * (text_len / 2 + 1));
+    uint32_t tokens_len = 0;
 
-    regEx = uregex_openC(regText, 0, NULL, &uStatus);
-    uregex_setText(regEx, uc, -1, &uStatus);
+    uint32_t processed_size = text_len * 4 + 16;
+    uint8_t *processed = malloc(processed_size);
 
-    while (uregex_findNext(regEx, &uStatus)) {
-        int32_t start = uregex_start(regEx, 0, &uStatus);
-        int32_t end = uregex_end(regEx, 0, &uStatus);
+    get_journal_tokens(text, tokens, &tokens_len, processed, processed_size);
 
-        uint8_t res[2048];
-        ucnv_fromUChars(conv, res, sizeof(res), uc + start, end - start, &uStatus);
+    uint32_t best_start = 0;
+    uint32_t best_end = 0;
+    uint32_t best_tokens = 0;
 
-        uint8_t *s = res;
+    XXH64_state_t state;
 
-        uint8_t *e;
+    for (uint32_t i = 0; i < tokens_len; i++) {
+        XXH64_reset(&state, 0);
 
-        uint32_t tokens_num = 0;
+        for (uint32_t j = i; j < tokens_len && j - i < MAX_JOURNAL_TOKENS; j++) {
+            if (tokens[j].run != tokens[i].run) break;
 
-        while (*s) {
-            while (*s == ' ') s++;
-            e = s;
-            while (*e != ' ' && *e != 0) e++;
-            tokens_num++;
-            s = e;
-        }
+            XXH64_update(&state, tokens[j].processed, tokens[j].processed_len);
 
-        if (tokens_num < 2) continue;
+            // Single word journal names are too ambiguous
+            if (j == i) continue;
 
-        uint8_t processed_res[MAX_LOOKUP_TEXT_LEN];
-        uint32_t processed_res_len = MAX_LOOKUP_TEXT_LEN;
-        text_process(res, processed_res, &processed_res_len);
-
-        uint64_t title_hash = text_hash64(processed_res, processed_res_len);
-        if (journal_has(title_hash)) {
-            strcpy(journal, res);
+            if (journal_has(XXH64_digest(&state)) && j - i + 1 >= best_tokens) {
+                best_start = tokens[i].start;
+                best_end = tokens[j].end;
+                best_tokens = j - i + 1;
+            }
         }
     }
 
-    uregex_close(regEx);
-    free(uc);
-}
+    if (best_tokens && best_end - best_start <= CONTAINER_LEN) {
+        memcpy(journal, text + best_start, best_end - best_start);
+        journal[best_end - best_start] = 0;
+        ret = 1;
+    }
 
+    free(processed);
+    free(tokens);
+    return ret;
+}
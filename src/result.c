@@ -0,0 +1,223 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <jansson.h>
+#include "recognize.h"
+#include "stats.h"
+#include "writer.h"
+#include "result.h"
+
+#define RESULT_FIELD(name) {#name, offsetof(res_metadata_t, name), sizeof(((res_metadata_t *) 0)->name)}
+
+// Every res_metadata_t field, in declaration order
+result_field_t result_fields[] = {
+        RESULT_FIELD(type),
+        RESULT_FIELD(title),
+        RESULT_FIELD(authors),
+        RESULT_FIELD(doi),
+        RESULT_FIELD(isbn),
+        RESULT_FIELD(arxiv),
+        RESULT_FIELD(abstract),
+        RESULT_FIELD(container),
+        RESULT_FIELD(publisher),
+        RESULT_FIELD(year),
+        RESULT_FIELD(pages),
+        RESULT_FIELD(volume),
+        RESULT_FIELD(issue),
+        RESULT_FIELD(issn),
+        RESULT_FIELD(url)
+};
+
+uint32_t result_fields_len = sizeof(result_fields) / sizeof(result_field_t);
+
+// Fields that aren't valid UTF-8 are left out, as jansson did
+void result_write_string(writer_t *writer, const char *key, uint8_t *value, uint32_t value_len) {
+    if (!writer_is_utf8(value, value_len)) return;
+    writer_key(writer, key);
+    writer_string(writer, value, value_len);
+}
+
+// Authors are stored as "first names\tlast name\n" sequences
+void result_write_authors(writer_t *writer, uint8_t *authors) {
+    writer_key(writer, "authors");
+    writer_begin_array(writer);
+
+    uint8_t *p = authors;
+    uint8_t *s;
+
+    uint8_t *first_name = 0;
+    uint32_t first_name_len = 0;
+
+    while (1) {
+        while (*p == '\t' || *p == '\n') p++;
+        if (!*p) break;
+        s = p;
+        while (*p && *p != '\t' && *p != '\n') p++;
+
+        if (*p == '\t') {
+            first_name = s;
+            first_name_len = p - s;
+        } else {
+            writer_begin_object(writer);
+            if (first_name) result_write_string(writer, "firstName", first_name, first_name_len);
+            result_write_string(writer, "lastName", s, p - s);
+            writer_end_object(writer);
+            first_name = 0;
+        }
+
+        if (!*p) break;
+    }
+
+    writer_end_array(writer);
+}
+
+#define RESULT_WRITE(name) if (*result->name) result_write_string(writer, #name, result->name, strlen(result->name))
+
+// Writes the result fields into the currently open object. Full results always have
+// title and authors, even when empty, like before fields could be selected (FIELD_* bits)
+void result_write(res_metadata_t *result, uint32_t fields, writer_t *writer) {
+    RESULT_WRITE(type);
+    if (fields == FIELDS_ALL || *result->title) {
+        result_write_string(writer, "title", result->title, strlen(result->title));
+    }
+    if (fields == FIELDS_ALL || *result->authors) result_write_authors(writer, result->authors);
+    RESULT_WRITE(doi);
+    RESULT_WRITE(isbn);
+    RESULT_WRITE(arxiv);
+    RESULT_WRITE(abstract);
+    RESULT_WRITE(year);
+    RESULT_WRITE(container);
+    RESULT_WRITE(publisher);
+    RESULT_WRITE(pages);
+    RESULT_WRITE(volume);
+    RESULT_WRITE(issue);
+    RESULT_WRITE(issn);
+    RESULT_WRITE(url);
+
+    if (result->partial) {
+        writer_key(writer, "partial");
+        writer_boolean(writer, 1);
+    }
+
+    if (result->early_exit) {
+        writer_key(writer, "earlyExit");
+        writer_boolean(writer, 1);
+    }
+}
+
+// Parses a comma separated list of field names into FIELD_* bits. Returns 0 for unknown fields
+uint32_t result_parse_fields(const char *str, uint32_t *fields) {
+    *fields = 0;
+
+    const char *p = str;
+    while (*p) {
+        const char *s = p;
+        while (*p && *p != ',') p++;
+
+        uint32_t len = p - s;
+        if (len) {
+            uint32_t field_i = 0;
+            for (; field_i < result_fields_len; field_i++) {
+                if (strlen(result_fields[field_i].name) == len && !strncmp(result_fields[field_i].name, s, len)) break;
+            }
+            if (field_i == result_fields_len) return 0;
+            *fields |= 1u << field_i;
+        }
+
+        if (*p) p++;
+    }
+
+    return 1;
+}
+
+// Clears the fields that weren't requested, but were filled by the stages that ran anyway
+void result_keep_fields(res_metadata_t *result, uint32_t fields) {
+    for (uint32_t i = 0; i < result_fields_len; i++) {
+        if (!(fields & (1u << i))) *result_get_field(result, i) = 0;
+    }
+}
+
+json_t *timings_to_json(stats_request_t *stats_request) {
+    json_t *json_timings = json_object();
+    json_t *json_stages = json_object();
+    json_t *json_counts = json_object();
+
+    for (uint32_t i = 0; i < STATS_STAGES_LEN; i++) {
+        if (!stats_request->stages[i]) continue;
+        json_object_set_new(json_stages, stats_get_stage_name(i), json_integer(stats_request->stages[i]));
+    }
+
+    for (uint32_t i = 0; i < STATS_REQUEST_COUNTERS_LEN; i++) {
+        json_object_set_new(json_counts, stats_get_counter_name(i), json_integer(stats_request->counters[i]));
+    }
+
+    json_object_set_new(json_timings, "stages", json_stages);
+    json_object_set_new(json_timings, "counts", json_counts);
+    return json_timings;
+}
+
+uint8_t *result_get_field(res_metadata_t *result, uint32_t field_i) {
+    return (uint8_t *) result + result_fields[field_i].offset;
+}
+
+// Golden output keeps every field as the raw string, so comparisons don't depend on response formatting
+void result_to_golden_json(res_metadata_t *result, json_t *obj) {
+    for (uint32_t i = 0; i < result_fields_len; i++) {
+        json_object_set_new(obj, result_fields[i].name, json_string(result_get_field(result, i)));
+    }
+}
+
+// Packs the fields as consecutive zero terminated strings followed by the early exit
+// flag, which is much smaller than res_metadata_t. Returns the packed length, or 0 if buf is too small
+uint32_t result_pack(res_metadata_t *result, uint8_t *buf, uint32_t buf_size) {
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < result_fields_len; i++) {
+        uint8_t *field = result_get_field(result, i);
+        uint32_t field_len = strnlen((char *) field, result_fields[i].size - 1) + 1;
+        if (len + field_len > buf_size) return 0;
+        memcpy(buf + len, field, field_len - 1);
+        buf[len + field_len - 1] = 0;
+        len += field_len;
+    }
+    if (len + 1 > buf_size) return 0;
+    buf[len++] = result->early_exit;
+    return len;
+}
+
+uint32_t result_unpack(uint8_t *buf, uint32_t buf_len, res_metadata_t *result) {
+    memset(result, 0, sizeof(res_metadata_t));
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < result_fields_len; i++) {
+        uint8_t *end = memchr(buf + pos, 0, buf_len - pos);
+        if (!end) return 0;
+        uint32_t field_len = end - (buf + pos);
+        if (field_len >= result_fields[i].size) return 0;
+        memcpy(result_get_field(result, i), buf + pos, field_len);
+        pos += field_len + 1;
+    }
+    if (pos + 1 != buf_len) return 0;
+    result->early_exit = buf[pos];
+    return 1;
+}
@@ -0,0 +1,36 @@
+#ifndef RECOGNIZER_SERVER_RESULT_H
+#define RECOGNIZER_SERVER_RESULT_H
+
+#include <stdint.h>
+#include <jansson.h>
+#include "recognize.h"
+#include "stats.h"
+#include "writer.h"
+
+typedef struct result_field {
+    char *name;
+    uint32_t offset;
+    uint32_t size;
+} result_field_t;
+
+extern result_field_t result_fields[];
+
+extern uint32_t result_fields_len;
+
+void result_write(res_metadata_t *result, uint32_t fields, writer_t *writer);
+
+json_t *timings_to_json(stats_request_t *stats_request);
+
+uint8_t *result_get_field(res_metadata_t *result, uint32_t field_i);
+
+void result_to_golden_json(res_metadata_t *result, json_t *obj);
+
+uint32_t result_parse_fields(const char *str, uint32_t *fields);
+
+void result_keep_fields(res_metadata_t *result, uint32_t fields);
+
+uint32_t result_pack(res_metadata_t *result, uint8_t *buf, uint32_t buf_size);
+
+uint32_t result_unpack(uint8_t *buf, uint32_t buf_len, res_metadata_t *result);
+
+#endif //RECOGNIZER_SERVER_RESULT_H
@@ -0,0 +1,151 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <jemalloc/jemalloc.h>
+#include "stats.h"
+#include "xxhash.h"
+#include "log.h"
+#include "session.h"
+
+#define SESSION_BUCKETS 256
+
+pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+session_t *session_buckets[SESSION_BUCKETS] = {0};
+uint32_t session_count = 0;
+uint64_t session_counter = 0;
+uint64_t session_expired_at = 0;
+// Session ids are hashed with a random key, so clients can't guess each other's
+uint64_t session_key = 0;
+
+uint32_t session_init() {
+    FILE *fp = fopen("/dev/urandom", "rb");
+    if (!fp) {
+        log_error("failed to open /dev/urandom");
+        return 0;
+    }
+    uint32_t ok = fread(&session_key, sizeof(session_key), 1, fp) == 1;
+    fclose(fp);
+    return ok;
+}
+
+// Drops idle sessions, and must be called with session_mutex held. Runs on each create
+// and get, so idle sessions don't keep their pages until the session table is full
+void session_expire(uint64_t now) {
+    if (now - session_expired_at < SESSION_EXPIRE_INTERVAL_SECONDS * 1000000000ull) return;
+    session_expired_at = now;
+
+    for (uint32_t i = 0; i < SESSION_BUCKETS; i++) {
+        session_t **session = &session_buckets[i];
+        while (*session) {
+            session_t *s = *session;
+            if (!s->busy && now - s->last_used > SESSION_TIMEOUT_SECONDS * 1000000000ull) {
+                *session = s->next;
+                json_decref(s->body);
+                free(s);
+                session_count--;
+            } else {
+                session = &s->next;
+            }
+        }
+    }
+}
+
+// Starts a session that keeps the body, and returns it busy.
+// Returns 0 when there are too many sessions
+session_t *session_create(json_t *body) {
+    session_t *session = calloc(1, sizeof(session_t));
+    if (!session) return 0;
+
+    uint64_t now = stats_now();
+
+    pthread_mutex_lock(&session_mutex);
+
+    session_expire(now);
+    if (session_count >= SESSION_MAX) {
+        pthread_mutex_unlock(&session_mutex);
+        free(session);
+        return 0;
+    }
+
+    uint64_t counter = ++session_counter;
+    session->id = XXH64(&counter, sizeof(counter), session_key);
+    session->body = json_incref(body);
+    session->last_used = now;
+    session->busy = 1;
+
+    session_t **bucket = &session_buckets[session->id % SESSION_BUCKETS];
+    session->next = *bucket;
+    *bucket = session;
+    session_count++;
+
+    pthread_mutex_unlock(&session_mutex);
+    return session;
+}
+
+// Returns the session marked busy, or 0 if it doesn't exist or another request
+// works on it, in which case *busy is set
+session_t *session_get(uint64_t id, uint8_t *busy) {
+    *busy = 0;
+
+    pthread_mutex_lock(&session_mutex);
+
+    session_expire(stats_now());
+
+    session_t *session = session_buckets[id % SESSION_BUCKETS];
+    while (session && session->id != id) session = session->next;
+
+    if (session && session->busy) {
+        *busy = 1;
+        session = 0;
+    }
+    if (session) session->busy = 1;
+
+    pthread_mutex_unlock(&session_mutex);
+    return session;
+}
+
+void session_release(session_t *session) {
+    pthread_mutex_lock(&session_mutex);
+    session->last_used = stats_now();
+    session->busy = 0;
+    pthread_mutex_unlock(&session_mutex);
+}
+
+// Ends a busy session
+void session_destroy(session_t *session) {
+    pthread_mutex_lock(&session_mutex);
+
+    session_t **bucket = &session_buckets[session->id % SESSION_BUCKETS];
+    while (*bucket != session) bucket = &(*bucket)->next;
+    *bucket = session->next;
+    session_count--;
+
+    pthread_mutex_unlock(&session_mutex);
+
+    json_decref(session->body);
+    free(session);
+}
@@ -0,0 +1,38 @@
+#ifndef RECOGNIZER_SERVER_SESSION_H
+#define RECOGNIZER_SERVER_SESSION_H
+
+#include <stdint.h>
+#include <jansson.h>
+#include "recognize.h"
+
+// Sessions that weren't used for this long are dropped
+#define SESSION_TIMEOUT_SECONDS 60
+#define SESSION_MAX 1024
+// Idle sessions are looked for at most this often
+#define SESSION_EXPIRE_INTERVAL_SECONDS 1
+
+// A document uploaded in several requests
+typedef struct session {
+    uint64_t id;
+    // Metadata, totalPages and the pages received so far
+    json_t *body;
+    // Set when the pages received so far were enough
+    uint8_t found;
+    res_metadata_t early;
+    uint64_t last_used;
+    // Set while a request works on the session
+    uint8_t busy;
+    struct session *next;
+} session_t;
+
+uint32_t session_init();
+
+session_t *session_create(json_t *body);
+
+session_t *session_get(uint64_t id, uint8_t *busy);
+
+void session_release(session_t *session);
+
+void session_destroy(session_t *session);
+
+#endif //RECOGNIZER_SERVER_SESSION_H
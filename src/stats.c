@@ -0,0 +1,321 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <jemalloc/jemalloc.h>
+#include "stats.h"
+
+static const char *stats_stage_names[STATS_STAGES_LEN] = {
+        "decompress",
+        "json_parse",
+        "recognize",
+        "get_doc",
+        "extract_jstor",
+        "text",
+        "identifiers",
+        "abstract",
+        "pages",
+        "headfoot",
+        "title_author",
+        "title_to_doi",
+        "doidata_get",
+        "doidata_has_doi",
+        "queue_wait"
+};
+
+static const char *stats_counter_names[STATS_COUNTERS_LEN] = {
+        "words",
+        "line_blocks",
+        "get_doi_by_title_calls",
+        "doidata_get_calls",
+        "doidata_has_doi_calls",
+        "rejected_requests",
+        "cache_hits",
+        "cache_disk_hits",
+        "cache_misses",
+        "coalesced_requests",
+        "sessions",
+        "session_early_exits",
+        "identifier_first_exits",
+        "task_groups",
+        "task_items_helped",
+        "stolen_jobs"
+};
+
+static const char *stats_gauge_names[STATS_GAUGES_LEN] = {
+        "queued_requests",
+        "running_requests",
+        "cache_entries",
+        "cache_bytes"
+};
+
+static __thread stats_thread_t *stats_thread = 0;
+static __thread stats_request_t *stats_request = 0;
+static stats_thread_t *stats_threads = 0;
+static pthread_key_t stats_thread_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static int64_t stats_gauges[STATS_GAUGES_LEN] = {0};
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The totals of an exited thread still count, so its stats are only handed over to the next new thread
+void stats_release_thread(void *ptr) {
+    stats_thread_t *thread = ptr;
+    __atomic_store_n(&thread->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void stats_create_key() {
+    pthread_key_create(&stats_thread_key, stats_release_thread);
+}
+
+stats_thread_t *stats_get_thread() {
+    if (stats_thread) return stats_thread;
+
+    pthread_once(&stats_once, stats_create_key);
+
+    stats_thread_t *thread = __atomic_load_n(&stats_threads, __ATOMIC_ACQUIRE);
+    for (; thread; thread = thread->next) {
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&thread->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+
+    if (!thread) {
+        thread = (stats_thread_t *) calloc(1, sizeof(stats_thread_t));
+        thread->in_use = 1;
+
+        // Threads are only added, never removed, so a lock-free push is enough
+        stats_thread_t *head = __atomic_load_n(&stats_threads, __ATOMIC_ACQUIRE);
+        do {
+            thread->next = head;
+        } while (!__atomic_compare_exchange_n(&stats_threads, &head, thread, 0,
+                                              __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    }
+
+    pthread_setspecific(stats_thread_key, thread);
+    stats_thread = thread;
+    return thread;
+}
+
+uint32_t stats_get_bucket(uint64_t ns) {
+    if (ns < (1ull << STATS_MIN_EXP)) return 0;
+
+    uint32_t exp = 63 - __builtin_clzll(ns);
+    if (exp >= STATS_MAX_EXP) return STATS_BUCKETS - 1;
+
+    uint32_t sub = (ns >> (exp - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return 1 + (exp - STATS_MIN_EXP) * STATS_SUB_BUCKETS + sub;
+}
+
+// Returns the exclusive upper limit of the bucket in nanoseconds, or 0 for the overflow bucket
+uint64_t stats_get_bucket_limit(uint32_t bucket) {
+    if (bucket == 0) return 1ull << STATS_MIN_EXP;
+    if (bucket >= STATS_BUCKETS - 1) return 0;
+
+    uint32_t exp = STATS_MIN_EXP + (bucket - 1) / STATS_SUB_BUCKETS;
+    uint32_t sub = (bucket - 1) % STATS_SUB_BUCKETS;
+    return (uint64_t) (STATS_SUB_BUCKETS + sub + 1) << (exp - STATS_SUB_BITS);
+}
+
+void stats_histogram_add(stats_histogram_t *histogram, uint64_t value) {
+    uint32_t bucket = stats_get_bucket(value);
+    __atomic_store_n(&histogram->buckets[bucket], histogram->buckets[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+}
+
+void stats_histogram_merge(stats_histogram_t *dst, stats_histogram_t *src) {
+    for (uint32_t i = 0; i < STATS_BUCKETS; i++) {
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+}
+
+void stats_add(stats_stage_t stage, uint64_t ns) {
+    stats_histogram_add(&stats_get_thread()->stages[stage], ns);
+    if (stats_request) __atomic_add_fetch(&stats_request->stages[stage], ns, __ATOMIC_RELAXED);
+}
+
+void stats_count(stats_counter_t counter, uint64_t value) {
+    stats_thread_t *thread = stats_get_thread();
+    __atomic_store_n(&thread->counters[counter], thread->counters[counter] + value, __ATOMIC_RELAXED);
+    if (stats_request) __atomic_add_fetch(&stats_request->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+// Total of a counter over all threads
+uint64_t stats_get_counter(stats_counter_t counter) {
+    uint64_t value = 0;
+    stats_thread_t *thread = __atomic_load_n(&stats_threads, __ATOMIC_ACQUIRE);
+    while (thread) {
+        value += __atomic_load_n(&thread->counters[counter], __ATOMIC_RELAXED);
+        thread = thread->next;
+    }
+    return value;
+}
+
+void stats_exhaust(stats_stage_t stage) {
+    stats_thread_t *thread = stats_get_thread();
+    __atomic_store_n(&thread->exhausted[stage], thread->exhausted[stage] + 1, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_get_exhausted(stats_stage_t stage) {
+    uint64_t value = 0;
+    stats_thread_t *thread = __atomic_load_n(&stats_threads, __ATOMIC_ACQUIRE);
+    while (thread) {
+        value += __atomic_load_n(&thread->exhausted[stage], __ATOMIC_RELAXED);
+        thread = thread->next;
+    }
+    return value;
+}
+
+void stats_gauge_add(stats_gauge_t gauge, int64_t value) {
+    __atomic_add_fetch(&stats_gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+int64_t stats_get_gauge(stats_gauge_t gauge) {
+    return __atomic_load_n(&stats_gauges[gauge], __ATOMIC_RELAXED);
+}
+
+// Until stats_end_request, all stages and counters recorded by the current thread
+// are also added to the request. Task helpers add to the request concurrently
+void stats_begin_request(stats_request_t *request) {
+    stats_request = request;
+}
+
+void stats_end_request() {
+    stats_request = 0;
+}
+
+stats_request_t *stats_get_request() {
+    return stats_request;
+}
+
+const char *stats_get_stage_name(stats_stage_t stage) {
+    return stats_stage_names[stage];
+}
+
+const char *stats_get_counter_name(stats_counter_t counter) {
+    return stats_counter_names[counter];
+}
+
+// Records the time passed since start and returns the current time,
+// which allows to time consecutive stages with a single clock read each
+uint64_t stats_lap(stats_stage_t stage, uint64_t start) {
+    uint64_t now = stats_now();
+    stats_add(stage, now - start);
+    return now;
+}
+
+void stats_print_histogram(FILE *fp, const char *name, const char *label, stats_histogram_t *histogram) {
+    uint64_t cumulative = 0;
+    for (uint32_t i = 0; i < STATS_BUCKETS - 1; i++) {
+        cumulative += histogram->buckets[i];
+        fprintf(fp, "%s_bucket{%s,le=\"%g\"} %lu\n", name, label, stats_get_bucket_limit(i) / 1e9, cumulative);
+    }
+    cumulative += histogram->buckets[STATS_BUCKETS - 1];
+    fprintf(fp, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, label, cumulative);
+    fprintf(fp, "%s_sum{%s} %.9f\n", name, label, histogram->sum / 1e9);
+    fprintf(fp, "%s_count{%s} %lu\n", name, label, histogram->count);
+}
+
+// Returns all metrics in Prometheus text exposition format. The caller must free the result
+char *stats_get_prometheus() {
+    char *text = 0;
+    size_t text_len = 0;
+    FILE *fp = open_memstream(&text, &text_len);
+    if (!fp) return 0;
+
+    stats_histogram_t *stages = (stats_histogram_t *) calloc(STATS_STAGES_LEN, sizeof(stats_histogram_t));
+    uint64_t counters[STATS_COUNTERS_LEN] = {0};
+    uint64_t exhausted[STATS_STAGES_LEN] = {0};
+
+    stats_thread_t *thread = __atomic_load_n(&stats_threads, __ATOMIC_ACQUIRE);
+    while (thread) {
+        for (uint32_t i = 0; i < STATS_STAGES_LEN; i++) {
+            stats_histogram_merge(&stages[i], &thread->stages[i]);
+            exhausted[i] += __atomic_load_n(&thread->exhausted[i], __ATOMIC_RELAXED);
+        }
+        for (uint32_t i = 0; i < STATS_COUNTERS_LEN; i++) {
+            counters[i] += __atomic_load_n(&thread->counters[i], __ATOMIC_RELAXED);
+        }
+        thread = thread->next;
+    }
+
+    for (uint32_t i = 0; i < STATS_COUNTERS_LEN; i++) {
+        fprintf(fp, "# TYPE recognizer_%s_total counter\n", stats_counter_names[i]);
+        fprintf(fp, "recognizer_%s_total %lu\n", stats_counter_names[i], counters[i]);
+    }
+
+    for (uint32_t i = 0; i < STATS_GAUGES_LEN; i++) {
+        fprintf(fp, "# TYPE recognizer_%s gauge\n", stats_gauge_names[i]);
+        fprintf(fp, "recognizer_%s %ld\n", stats_gauge_names[i], stats_get_gauge(i));
+    }
+
+    fprintf(fp, "# HELP recognizer_deadline_exhausted_total Requests that ran out of time budget in each stage\n");
+    fprintf(fp, "# TYPE recognizer_deadline_exhausted_total counter\n");
+    for (uint32_t i = 0; i < STATS_STAGES_LEN; i++) {
+        if (!exhausted[i]) continue;
+        fprintf(fp, "recognizer_deadline_exhausted_total{stage=\"%s\"} %lu\n", stats_stage_names[i], exhausted[i]);
+    }
+
+    fprintf(fp, "# HELP recognizer_stage_duration_seconds Time spent in each recognition stage\n");
+    fprintf(fp, "# TYPE recognizer_stage_duration_seconds histogram\n");
+    // Stages that never ran are left out until they do, like labeled histograms in client libraries
+    for (uint32_t i = 0; i < STATS_STAGES_LEN; i++) {
+        if (!stages[i].count) continue;
+        char label[64];
+        snprintf(label, sizeof(label), "stage=\"%s\"", stats_stage_names[i]);
+        stats_print_histogram(fp, "recognizer_stage_duration_seconds", label, &stages[i]);
+    }
+
+    free(stages);
+    fclose(fp);
+    return text;
+}
+
+int stats_compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+void stats_sort_latencies(uint64_t *latencies, uint32_t latencies_len) {
+    qsort(latencies, latencies_len, sizeof(uint64_t), stats_compare_latencies);
+}
+
+// Nearest-rank percentile of sorted latencies
+uint64_t stats_get_percentile(uint64_t *latencies, uint32_t latencies_len, double p) {
+    if (!latencies_len) return 0;
+    uint32_t i = (uint32_t) (p * latencies_len + 0.999999);
+    if (i) i--;
+    if (i >= latencies_len) i = latencies_len - 1;
+    return latencies[i];
+}
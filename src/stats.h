@@ -0,0 +1,131 @@
+#ifndef RECOGNIZER_SERVER_STATS_H
+#define RECOGNIZER_SERVER_STATS_H
+
+#include <stdint.h>
+
+// Latency histograms are log-linear: each power of two between
+// 2^STATS_MIN_EXP and 2^STATS_MAX_EXP nanoseconds is split into
+// 2^STATS_SUB_BITS buckets, plus one bucket below and one above the range.
+// A bucket spans at most 1/8 of its lower limit, which bounds the error of
+// percentiles estimated from the buckets
+#define STATS_MIN_EXP 10
+#define STATS_MAX_EXP 36
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((STATS_MAX_EXP - STATS_MIN_EXP) * STATS_SUB_BUCKETS + 2)
+
+typedef enum stats_stage {
+    STATS_DECOMPRESS,
+    STATS_JSON_PARSE,
+    STATS_RECOGNIZE,
+    STATS_GET_DOC,
+    STATS_JSTOR,
+    STATS_TEXT,
+    STATS_IDENTIFIERS,
+    STATS_ABSTRACT,
+    STATS_PAGES,
+    STATS_HEADFOOT,
+    STATS_TITLE_AUTHOR,
+    STATS_TITLE_TO_DOI,
+    STATS_DOIDATA_GET,
+    STATS_DOIDATA_HAS_DOI,
+    STATS_QUEUE_WAIT,
+    STATS_STAGES_LEN
+} stats_stage_t;
+
+typedef enum stats_counter {
+    STATS_WORDS,
+    STATS_LINE_BLOCKS,
+    STATS_GET_DOI_BY_TITLE_CALLS,
+    STATS_DOIDATA_GET_CALLS,
+    STATS_DOIDATA_HAS_DOI_CALLS,
+    // Counters above describe the work done for a document, and are the ones in per request timings.
+    // Those below count server events
+    STATS_REJECTED_REQUESTS,
+    STATS_CACHE_HITS,
+    STATS_CACHE_DISK_HITS,
+    STATS_CACHE_MISSES,
+    STATS_COALESCED_REQUESTS,
+    STATS_SESSIONS,
+    STATS_SESSION_EARLY_EXITS,
+    STATS_IDENTIFIER_FIRST_EXITS,
+    STATS_TASK_GROUPS,
+    STATS_TASK_ITEMS_HELPED,
+    STATS_STOLEN_JOBS,
+    STATS_COUNTERS_LEN
+} stats_counter_t;
+
+#define STATS_REQUEST_COUNTERS_LEN STATS_REJECTED_REQUESTS
+
+// Gauges are process wide values that go up and down, unlike the per thread counters
+typedef enum stats_gauge {
+    STATS_QUEUED_REQUESTS,
+    STATS_RUNNING_REQUESTS,
+    STATS_CACHE_ENTRIES,
+    STATS_CACHE_BYTES,
+    STATS_GAUGES_LEN
+} stats_gauge_t;
+
+typedef struct stats_histogram {
+    uint64_t buckets[STATS_BUCKETS];
+    uint64_t sum;
+    uint64_t count;
+} stats_histogram_t;
+
+// Each thread only writes to its own stats, and readers merge all threads,
+// so recording needs neither locks nor atomic read-modify-write operations
+typedef struct stats_thread {
+    stats_histogram_t stages[STATS_STAGES_LEN];
+    uint64_t counters[STATS_COUNTERS_LEN];
+    // Requests that ran out of time in each stage
+    uint64_t exhausted[STATS_STAGES_LEN];
+    // Stats of exited threads are kept, and reused by new threads
+    uint32_t in_use;
+    struct stats_thread *next;
+} stats_thread_t;
+
+// Per request breakdown, collected by the threads that run the request
+typedef struct stats_request {
+    uint64_t stages[STATS_STAGES_LEN];
+    uint64_t counters[STATS_COUNTERS_LEN];
+} stats_request_t;
+
+uint64_t stats_now();
+
+void stats_add(stats_stage_t stage, uint64_t ns);
+
+uint64_t stats_lap(stats_stage_t stage, uint64_t start);
+
+void stats_count(stats_counter_t counter, uint64_t value);
+
+uint64_t stats_get_counter(stats_counter_t counter);
+
+void stats_exhaust(stats_stage_t stage);
+
+uint64_t stats_get_exhausted(stats_stage_t stage);
+
+void stats_gauge_add(stats_gauge_t gauge, int64_t value);
+
+int64_t stats_get_gauge(stats_gauge_t gauge);
+
+void stats_begin_request(stats_request_t *request);
+
+void stats_end_request();
+
+stats_request_t *stats_get_request();
+
+const char *stats_get_stage_name(stats_stage_t stage);
+
+const char *stats_get_counter_name(stats_counter_t counter);
+
+uint32_t stats_get_bucket(uint64_t ns);
+
+uint64_t stats_get_bucket_limit(uint32_t bucket);
+
+char *stats_get_prometheus();
+
+void stats_sort_latencies(uint64_t *latencies, uint32_t latencies_len);
+
+uint64_t stats_get_percentile(uint64_t *latencies, uint32_t latencies_len, double p);
+
+#endif //RECOGNIZER_SERVER_STATS_H
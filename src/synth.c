@@ -0,0 +1,306 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "synth.h"
+
+#define SYNTH_FIRST_NAMES 5000
+#define SYNTH_LAST_NAMES 500000
+
+// Separate streams for each kind of generated value
+#define SYNTH_STREAM_WORD 0x1000000000000000ULL
+#define SYNTH_STREAM_FIRST_NAME 0x2000000000000000ULL
+#define SYNTH_STREAM_LAST_NAME 0x3000000000000000ULL
+#define SYNTH_STREAM_JOURNAL 0x4000000000000000ULL
+#define SYNTH_STREAM_TITLE 0x5000000000000000ULL
+#define SYNTH_STREAM_ARTICLE 0x6000000000000000ULL
+
+// Function words come first, so they get the highest frequencies
+#define SYNTH_FUNCTION_WORDS 20
+
+const char *synth_words[] = {
+        "the", "of", "and", "in", "a", "for", "on", "with", "to", "from",
+        "by", "at", "as", "an", "its", "their", "between", "under", "during", "into",
+        "analysis", "study", "effects", "model", "approach", "dynamic", "systems", "protein", "cell", "growth",
+        "theory", "learning", "network", "quantum", "evidence", "data", "method", "results", "structure", "function",
+        "role", "large", "scale", "high", "low", "temperature", "response", "review", "clinical", "patients",
+        "treatment", "social", "economic", "policy", "development", "health", "risk", "energy", "water", "human",
+        "expression", "gene", "control", "design", "performance", "evaluation", "properties", "surface", "molecular", "environmental",
+        "changes", "factors", "impact", "management", "children", "women", "disease", "cancer", "brain", "species",
+        "population", "climate", "soil", "plant", "acid", "membrane", "thermal", "optical", "magnetic", "electronic",
+        "linear", "nonlinear", "stochastic", "numerical", "experimental", "comparative", "early", "modern", "urban", "rural"
+};
+
+const char *synth_syllables[] = {
+        "ka", "lo", "mi", "ne", "ra", "to", "su", "vi", "ber", "con", "dis", "el", "fa", "gor", "hal", "in",
+        "jo", "ker", "lan", "mar", "nor", "ost", "pre", "qui", "ros", "sen", "tor", "ul", "ven", "wal", "xi", "zen",
+        "an", "bi", "ce", "do", "er", "fi", "ge", "ho", "is", "ju", "ko", "li", "mo", "nu", "or", "pa"
+};
+
+const char *synth_first_names[] = {
+        "John", "Mary", "Peter", "Anna", "David", "Laura", "Michael", "Sarah", "Thomas", "Elena",
+        "Robert", "Julia", "Martin", "Sofia", "Daniel", "James", "Maria", "William", "Emma", "Richard",
+        "Linda", "Joseph", "Susan", "Charles", "Karen", "Wei", "Li", "Hiroshi", "Yuki", "Ahmed",
+        "Fatima", "Carlos", "Ana", "Pierre", "Marie", "Hans", "Eva", "Giovanni", "Chiara", "Ivan",
+        "Olga", "Raj", "Priya", "Jan", "Katarzyna", "Lars", "Ingrid", "Paulo", "Lucia", "Andrew"
+};
+
+const char *synth_last_names[] = {
+        "Smith", "Johnson", "Williams", "Brown", "Miller", "Davis", "Garcia", "Wilson", "Anderson", "Taylor",
+        "Moore", "Jackson", "Martin", "Thompson", "White", "Harris", "Clark", "Lewis", "Walker", "Young",
+        "Wang", "Li", "Zhang", "Liu", "Chen", "Yang", "Huang", "Zhao", "Wu", "Zhou",
+        "Kim", "Lee", "Park", "Nguyen", "Tanaka", "Suzuki", "Sato", "Kumar", "Singh", "Sharma",
+        "Müller", "Schmidt", "Schneider", "Fischer", "Weber", "Rossi", "Russo", "Ferrari", "Dubois", "Martínez",
+        "López", "González", "Rodríguez", "Fernández", "Silva", "Santos", "Novák", "Kowalski", "Ivanov", "Petrov"
+};
+
+const char *synth_generic_titles[] = {
+        "Editorial", "Introduction", "Book Reviews", "Erratum", "Letters to the Editor",
+        "Index", "Preface", "Contents", "Front Matter", "Correspondence"
+};
+
+#define SYNTH_LEN(a) (sizeof(a) / sizeof(a[0]))
+
+void synth_seed(synth_rng_t *rng, uint64_t seed) {
+    rng->state = seed;
+    // Decorrelate nearby seeds
+    synth_next(rng);
+}
+
+// splitmix64
+uint64_t synth_next(synth_rng_t *rng) {
+    uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+uint64_t synth_below(synth_rng_t *rng, uint64_t n) {
+    if (!n) return 0;
+    return synth_next(rng) % n;
+}
+
+double synth_uniform(synth_rng_t *rng) {
+    return (synth_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Log-uniform id in [0, n), which approximates a Zipf distribution with s = 1
+uint64_t synth_zipf(synth_rng_t *rng, uint64_t n) {
+    if (n <= 1) return 0;
+    uint64_t id = (uint64_t) exp(synth_uniform(rng) * log((double) n + 1)) - 1;
+    return id < n ? id : n - 1;
+}
+
+void synth_stream(synth_rng_t *rng, uint64_t seed, uint64_t stream, uint64_t id) {
+    synth_seed(rng, seed ^ stream ^ (id * 0xD1B54A32D192ED03ULL));
+}
+
+uint32_t synth_append(uint8_t *text, uint32_t text_len, uint32_t text_size, const char *str) {
+    uint32_t len = strlen(str);
+    if (text_len + len >= text_size) len = text_size - text_len - 1;
+    memcpy(text + text_len, str, len);
+    text[text_len + len] = 0;
+    return text_len + len;
+}
+
+uint32_t synth_append_syllables(synth_rng_t *rng, uint32_t min, uint32_t max,
+                                uint8_t *text, uint32_t text_len, uint32_t text_size) {
+    uint32_t n = min + synth_below(rng, max - min + 1);
+    for (uint32_t i = 0; i < n; i++) {
+        text_len = synth_append(text, text_len, text_size, synth_syllables[synth_below(rng, SYNTH_LEN(synth_syllables))]);
+    }
+    return text_len;
+}
+
+void synth_capitalize(uint8_t *text) {
+    if (*text >= 'a' && *text <= 'z') *text -= 'a' - 'A';
+}
+
+// Words past the built-in vocabulary are made of random syllables
+uint32_t synth_word(uint64_t seed, uint64_t id, uint8_t *word, uint32_t word_size) {
+    *word = 0;
+    if (id < SYNTH_LEN(synth_words)) return synth_append(word, 0, word_size, synth_words[id]);
+    synth_rng_t rng;
+    synth_stream(&rng, seed, SYNTH_STREAM_WORD, id);
+    return synth_append_syllables(&rng, 2, 4, word, 0, word_size);
+}
+
+uint32_t synth_first_name(uint64_t seed, uint64_t id, uint8_t *name, uint32_t name_size) {
+    *name = 0;
+    if (id < SYNTH_LEN(synth_first_names)) return synth_append(name, 0, name_size, synth_first_names[id]);
+    synth_rng_t rng;
+    synth_stream(&rng, seed, SYNTH_STREAM_FIRST_NAME, id);
+    uint32_t name_len = synth_append_syllables(&rng, 2, 3, name, 0, name_size);
+    synth_capitalize(name);
+    return name_len;
+}
+
+uint32_t synth_last_name(uint64_t seed, uint64_t id, uint8_t *name, uint32_t name_size) {
+    *name = 0;
+    if (id < SYNTH_LEN(synth_last_names)) return synth_append(name, 0, name_size, synth_last_names[id]);
+    synth_rng_t rng;
+    synth_stream(&rng, seed, SYNTH_STREAM_LAST_NAME, id);
+    uint32_t name_len = synth_append_syllables(&rng, 2, 4, name, 0, name_size);
+    synth_capitalize(name);
+    return name_len;
+}
+
+uint32_t synth_append_word(synth_rng_t *rng, uint64_t seed,
+                           uint8_t *text, uint32_t text_len, uint32_t text_size) {
+    uint8_t word[64];
+    synth_word(seed, SYNTH_FUNCTION_WORDS + synth_zipf(rng, 5000), word, sizeof(word));
+    synth_capitalize(word);
+    return synth_append(text, text_len, text_size, word);
+}
+
+uint32_t synth_journal(uint64_t seed, uint64_t id, uint8_t *journal, uint32_t journal_size) {
+    synth_rng_t rng;
+    synth_stream(&rng, seed, SYNTH_STREAM_JOURNAL, id);
+
+    uint32_t len = 0;
+    *journal = 0;
+
+    switch (synth_below(&rng, 7)) {
+        case 0:
+            len = synth_append(journal, len, journal_size, "Journal of ");
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            break;
+        case 1:
+            len = synth_append(journal, len, journal_size, "Journal of ");
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            len = synth_append(journal, len, journal_size, " and ");
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            break;
+        case 2:
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            len = synth_append(journal, len, journal_size, " ");
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            len = synth_append(journal, len, journal_size, " Letters");
+            break;
+        case 3:
+            len = synth_append(journal, len, journal_size, "International Journal of ");
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            len = synth_append(journal, len, journal_size, " ");
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            break;
+        case 4:
+            len = synth_append(journal, len, journal_size, "Annals of ");
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            break;
+        case 5:
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            len = synth_append(journal, len, journal_size, " Review");
+            break;
+        default:
+            len = synth_append(journal, len, journal_size, "Proceedings of the ");
+            len = synth_append_word(&rng, seed, journal, len, journal_size);
+            len = synth_append(journal, len, journal_size, " Society");
+            break;
+    }
+    return len;
+}
+
+uint32_t synth_sentence(synth_config_t *config, synth_rng_t *rng, uint32_t words_len, uint8_t *text, uint32_t text_size) {
+    uint32_t len = 0;
+    *text = 0;
+    for (uint32_t i = 0; i < words_len; i++) {
+        uint8_t word[64];
+        synth_word(config->seed, synth_zipf(rng, config->words_len), word, sizeof(word));
+        if (i) len = synth_append(text, len, text_size, " ");
+        len = synth_append(text, len, text_size, word);
+    }
+    return len;
+}
+
+void synth_title(synth_config_t *config, uint64_t title_id, uint8_t *title, uint32_t title_size) {
+    synth_rng_t rng;
+    synth_stream(&rng, config->seed, SYNTH_STREAM_TITLE, title_id);
+
+    uint32_t words_len = 5 + synth_below(&rng, 10);
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < words_len; i++) {
+        uint8_t word[64];
+        uint64_t word_id = synth_zipf(&rng, config->words_len);
+        // Titles don't start with a function word
+        if (!i && word_id < SYNTH_FUNCTION_WORDS) word_id += SYNTH_FUNCTION_WORDS;
+        synth_word(config->seed, word_id, word, sizeof(word));
+        if (i) len = synth_append(title, len, title_size, " ");
+        len = synth_append(title, len, title_size, word);
+    }
+    synth_capitalize(title);
+}
+
+void synth_article(synth_config_t *config, uint64_t id, synth_article_t *article) {
+    synth_rng_t rng;
+    synth_stream(&rng, config->seed, SYNTH_STREAM_ARTICLE, id);
+
+    memset(article, 0, sizeof(synth_article_t));
+    article->id = id;
+
+    double u = synth_uniform(&rng);
+    uint64_t title_id = synth_next(&rng);
+    if (u < config->generic_fraction) {
+        synth_append(article->title, 0, sizeof(article->title), synth_generic_titles[title_id % SYNTH_LEN(synth_generic_titles)]);
+    } else {
+        // A duplicate shares the title of an earlier article but has its own authors and DOI
+        if (id && u < config->generic_fraction + config->duplicate_fraction) title_id = title_id % id;
+        else title_id = id;
+        synth_title(config, title_id, article->title, sizeof(article->title));
+    }
+
+    article->authors_len = 1 + synth_below(&rng, 3);
+    if (synth_uniform(&rng) < 0.2) article->authors_len += synth_below(&rng, SYNTH_MAX_AUTHORS - 2);
+    for (uint32_t i = 0; i < article->authors_len; i++) {
+        synth_author_t *author = &article->authors[i];
+        synth_first_name(config->seed, synth_zipf(&rng, SYNTH_FIRST_NAMES), author->first_name, SYNTH_NAME_LEN);
+        synth_last_name(config->seed, synth_zipf(&rng, SYNTH_LAST_NAMES), author->last_name, SYNTH_NAME_LEN);
+    }
+
+    article->journal_id = synth_zipf(&rng, config->journals_len);
+    synth_journal(config->seed, article->journal_id, article->journal, sizeof(article->journal));
+
+    article->year = 2020 - synth_zipf(&rng, 70);
+    article->volume = 1 + (article->year + article->journal_id) % 120;
+    article->issue = 1 + synth_below(&rng, 12);
+    article->first_page = 1 + synth_below(&rng, 2000);
+    article->last_page = article->first_page + 2 + synth_below(&rng, 30);
+
+    // Publishers have their own DOI prefixes and suffix styles
+    uint32_t prefix = 1000 + article->journal_id % 9000;
+    switch (article->journal_id % 3) {
+        case 0:
+            snprintf(article->doi, sizeof(article->doi), "10.%u/j.%u.%03u.%llu",
+                     prefix, article->year, article->issue, (unsigned long long) id);
+            break;
+        case 1:
+            snprintf(article->doi, sizeof(article->doi), "10.%u/%u-%llu",
+                     prefix, article->volume, (unsigned long long) id);
+            break;
+        default:
+            snprintf(article->doi, sizeof(article->doi), "10.%u/s%llu",
+                     prefix, (unsigned long long) id);
+            break;
+    }
+}
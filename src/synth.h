@@ -0,0 +1,71 @@
+#ifndef RECOGNIZER_SERVER_SYNTH_H
+#define RECOGNIZER_SERVER_SYNTH_H
+
+#include <stdint.h>
+#include "defines.h"
+
+#define SYNTH_MAX_AUTHORS 6
+#define SYNTH_NAME_LEN 64
+
+// Deterministic generator of synthetic articles shared by recognizer-gendata and recognizer-gendoc.
+// An article is fully derived from (seed, id), so documents generated for an id match
+// the doidata rows generated for it without storing anything in between
+
+typedef struct synth_rng {
+    uint64_t state;
+} synth_rng_t;
+
+typedef struct synth_config {
+    uint64_t seed;
+    uint64_t articles_len;
+    uint64_t words_len;
+    uint64_t journals_len;
+    // Fraction of articles reusing the title of an earlier article
+    double duplicate_fraction;
+    // Fraction of articles with a generic title like "Editorial"
+    double generic_fraction;
+} synth_config_t;
+
+typedef struct synth_author {
+    uint8_t first_name[SYNTH_NAME_LEN];
+    uint8_t last_name[SYNTH_NAME_LEN];
+} synth_author_t;
+
+typedef struct synth_article {
+    uint64_t id;
+    uint8_t title[TITLE_LEN];
+    synth_author_t authors[SYNTH_MAX_AUTHORS];
+    uint32_t authors_len;
+    uint8_t doi[DOI_LEN];
+    uint64_t journal_id;
+    uint8_t journal[CONTAINER_LEN];
+    uint32_t year;
+    uint32_t volume;
+    uint32_t issue;
+    uint32_t first_page;
+    uint32_t last_page;
+} synth_article_t;
+
+void synth_seed(synth_rng_t *rng, uint64_t seed);
+
+uint64_t synth_next(synth_rng_t *rng);
+
+uint64_t synth_below(synth_rng_t *rng, uint64_t n);
+
+double synth_uniform(synth_rng_t *rng);
+
+uint64_t synth_zipf(synth_rng_t *rng, uint64_t n);
+
+uint32_t synth_word(uint64_t seed, uint64_t id, uint8_t *word, uint32_t word_size);
+
+uint32_t synth_first_name(uint64_t seed, uint64_t id, uint8_t *name, uint32_t name_size);
+
+uint32_t synth_last_name(uint64_t seed, uint64_t id, uint8_t *name, uint32_t name_size);
+
+uint32_t synth_journal(uint64_t seed, uint64_t id, uint8_t *journal, uint32_t journal_size);
+
+uint32_t synth_sentence(synth_config_t *config, synth_rng_t *rng, uint32_t words_len, uint8_t *text, uint32_t text_size);
+
+void synth_article(synth_config_t *config, uint64_t id, synth_article_t *article);
+
+#endif //RECOGNIZER_SERVER_SYNTH_H
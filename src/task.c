@@ -0,0 +1,131 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "stats.h"
+#include "log.h"
+#include "deadline.h"
+#include "task.h"
+
+// Spreads the per page work of a single request over idle cores. The requesting thread
+// claims items of its group like the helpers do, so it never waits for a helper to start,
+// and a group nobody helps with just runs on the requesting thread. Items write their
+// results by index, which keeps the merged result independent of who ran what
+pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t task_done_cond = PTHREAD_COND_INITIALIZER;
+task_group_t *task_groups = 0;
+uint32_t task_helpers = 0;
+uint32_t task_max_running = 0;
+
+// Runs items until all of the group's items are claimed. Returns the number of items run
+uint32_t task_claim(task_group_t *group) {
+    uint32_t n = 0;
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&group->next, 1, __ATOMIC_RELAXED)) < group->len) {
+        group->func(group->arg, i);
+        n++;
+    }
+    return n;
+}
+
+void *task_helper(void *arg) {
+    pthread_mutex_lock(&task_mutex);
+
+    while (1) {
+        task_group_t *group = task_groups;
+        while (group && __atomic_load_n(&group->next, __ATOMIC_RELAXED) >= group->len) group = group->next_group;
+
+        if (!group) {
+            pthread_cond_wait(&task_cond, &task_mutex);
+            continue;
+        }
+
+        group->helpers++;
+        pthread_mutex_unlock(&task_mutex);
+
+        stats_begin_request(group->stats_request);
+        deadline_join(group->deadline, group->deadline_exhausted);
+        uint32_t n = task_claim(group);
+        if (n) stats_count(STATS_TASK_ITEMS_HELPED, n);
+        deadline_end();
+        stats_end_request();
+
+        pthread_mutex_lock(&task_mutex);
+        if (!--group->helpers) pthread_cond_broadcast(&task_done_cond);
+    }
+
+    return 0;
+}
+
+// Starts helper threads. Work is only spread while at most max_running requests are
+// being recognized, so under load each request keeps to its own worker
+uint32_t task_init(uint32_t helpers, uint32_t max_running) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, TASK_STACK_SIZE);
+
+    for (uint32_t i = 0; i < helpers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, task_helper, 0)) {
+            log_error("failed to start task helper");
+            pthread_attr_destroy(&attr);
+            return 0;
+        }
+        pthread_detach(thread);
+        task_helpers++;
+    }
+
+    pthread_attr_destroy(&attr);
+    task_max_running = max_running;
+    return 1;
+}
+
+// Runs func for items 0 to len - 1 on the calling thread and idle helpers, and returns once
+// all items are done. Returns 0 without running anything if there are no helpers, or they
+// aren't needed, in which case the caller runs the items itself
+uint32_t task_run(task_func_t func, void *arg, uint32_t len) {
+    if (!task_helpers || len < 2) return 0;
+    if (stats_get_gauge(STATS_RUNNING_REQUESTS) > task_max_running) return 0;
+
+    task_group_t group = {func, arg, len, 0, 0, stats_get_request(), deadline_get(), deadline_get_exhausted(), 0};
+
+    pthread_mutex_lock(&task_mutex);
+    group.next_group = task_groups;
+    task_groups = &group;
+    pthread_cond_broadcast(&task_cond);
+    pthread_mutex_unlock(&task_mutex);
+
+    stats_count(STATS_TASK_GROUPS, 1);
+    task_claim(&group);
+
+    // All items are claimed, but helpers may still be running theirs
+    pthread_mutex_lock(&task_mutex);
+    task_group_t **g = &task_groups;
+    while (*g != &group) g = &(*g)->next_group;
+    *g = group.next_group;
+    while (group.helpers) pthread_cond_wait(&task_done_cond, &task_mutex);
+    pthread_mutex_unlock(&task_mutex);
+
+    return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef RECOGNIZER_SERVER_TASK_H
+#define RECOGNIZER_SERVER_TASK_H
+
+#include <stdint.h>
+#include "stats.h"
+
+// Helpers run recognize() code, which keeps large arrays on the stack
+#define TASK_STACK_SIZE (16 * 1024 * 1024)
+
+typedef void (*task_func_t)(void *arg, uint32_t i);
+
+// Items of one task_run call, which idle helpers take a share of
+typedef struct task_group {
+    task_func_t func;
+    void *arg;
+    uint32_t len;
+    // Next item to claim
+    uint32_t next;
+    // Helpers running items of the group
+    uint32_t helpers;
+    // Request and deadline of the submitting thread, which helpers take over while running items
+    stats_request_t *stats_request;
+    uint64_t deadline;
+    uint8_t *deadline_exhausted;
+    struct task_group *next_group;
+} task_group_t;
+
+uint32_t task_init(uint32_t helpers, uint32_t max_running);
+
+uint32_t task_run(task_func_t func, void *arg, uint32_t len);
+
+#endif //RECOGNIZER_SERVER_TASK_H
@@ -0,0 +1,282 @@
+/*
+ ***** BEGIN LICENSE BLOCK *****
+
+ Copyright © 2018 Zotero
+ https://www.zotero.org
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU Affero General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU Affero General Public License for more details.
+
+ You should have received a copy of the GNU Affero General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ ***** END LICENSE BLOCK *****
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <jansson.h>
+#include <jemalloc/jemalloc.h>
+#include "writer.h"
+
+#define WRITER_INITIAL_SIZE 16384
+
+// Each thread reuses its buffer for every response, and it's freed when the thread exits
+pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+pthread_key_t writer_thread_key;
+
+void writer_destroy(void *ptr) {
+    writer_t *writer = ptr;
+    free(writer->data);
+    free(writer);
+}
+
+void writer_create_key() {
+    pthread_key_create(&writer_thread_key, writer_destroy);
+}
+
+// Returns the calling thread's writer, emptied
+writer_t *writer_get_thread(uint32_t indent) {
+    pthread_once(&writer_once, writer_create_key);
+
+    writer_t *writer = pthread_getspecific(writer_thread_key);
+    if (!writer) {
+        writer = calloc(1, sizeof(writer_t));
+        if (!writer) return 0;
+        pthread_setspecific(writer_thread_key, writer);
+    }
+
+    writer->len = 0;
+    writer->indent = indent;
+    writer->depth = 0;
+    writer->after_key = 0;
+    writer->failed = 0;
+    return writer;
+}
+
+uint32_t writer_reserve(writer_t *writer, uint32_t len) {
+    if (writer->failed) return 0;
+    if (writer->len + len + 1 <= writer->size) return 1;
+
+    uint32_t size = writer->size ? writer->size : WRITER_INITIAL_SIZE;
+    while (writer->len + len + 1 > size) size *= 2;
+
+    char *data = realloc(writer->data, size);
+    if (!data) {
+        writer->failed = 1;
+        return 0;
+    }
+
+    writer->data = data;
+    writer->size = size;
+    return 1;
+}
+
+void writer_append(writer_t *writer, const char *str, uint32_t str_len) {
+    if (!writer_reserve(writer, str_len)) return;
+    memcpy(writer->data + writer->len, str, str_len);
+    writer->len += str_len;
+    writer->data[writer->len] = 0;
+}
+
+void writer_newline(writer_t *writer) {
+    if (!writer->indent) return;
+    uint32_t spaces = writer->depth * writer->indent;
+    if (!writer_reserve(writer, spaces + 1)) return;
+    writer->data[writer->len++] = '\n';
+    memset(writer->data + writer->len, ' ', spaces);
+    writer->len += spaces;
+    writer->data[writer->len] = 0;
+}
+
+// Separates a value from the previous one in the same container,
+// unless it follows a key
+void writer_separate(writer_t *writer) {
+    if (writer->after_key) {
+        writer->after_key = 0;
+        return;
+    }
+    if (!writer->depth) return;
+    if (!writer->empty[writer->depth]) writer_append(writer, ",", 1);
+    writer->empty[writer->depth] = 0;
+    writer_newline(writer);
+}
+
+void writer_begin(writer_t *writer, char *bracket) {
+    writer_separate(writer);
+    writer_append(writer, bracket, 1);
+    if (writer->depth + 1 >= WRITER_MAX_DEPTH) {
+        writer->failed = 1;
+        return;
+    }
+    writer->empty[++writer->depth] = 1;
+}
+
+void writer_end(writer_t *writer, char *bracket) {
+    if (!writer->depth) return;
+    uint8_t empty = writer->empty[writer->depth--];
+    if (!empty) writer_newline(writer);
+    writer_append(writer, bracket, 1);
+}
+
+void writer_begin_object(writer_t *writer) {
+    writer_begin(writer, "{");
+}
+
+void writer_end_object(writer_t *writer) {
+    writer_end(writer, "}");
+}
+
+void writer_begin_array(writer_t *writer) {
+    writer_begin(writer, "[");
+}
+
+void writer_end_array(writer_t *writer) {
+    writer_end(writer, "]");
+}
+
+// Escapes like jansson: quotes, backslashes and control characters
+void writer_escape(writer_t *writer, const uint8_t *str, uint32_t str_len) {
+    // Worst case is \u00XX for every byte
+    if (!writer_reserve(writer, str_len * 6 + 2)) return;
+
+    char *out = writer->data + writer->len;
+    *out++ = '"';
+    for (uint32_t i = 0; i < str_len; i++) {
+        uint8_t c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            *out++ = c;
+            continue;
+        }
+
+        *out++ = '\\';
+        switch (c) {
+            case '"':
+                *out++ = '"';
+                break;
+            case '\\':
+                *out++ = '\\';
+                break;
+            case '\b':
+                *out++ = 'b';
+                break;
+            case '\f':
+                *out++ = 'f';
+                break;
+            case '\n':
+                *out++ = 'n';
+                break;
+            case '\r':
+                *out++ = 'r';
+                break;
+            case '\t':
+                *out++ = 't';
+                break;
+            default:
+                out += sprintf(out, "u%04X", c);
+        }
+    }
+    *out++ = '"';
+    *out = 0;
+    writer->len = out - writer->data;
+}
+
+void writer_key(writer_t *writer, const char *key) {
+    writer_separate(writer);
+    writer_escape(writer, (const uint8_t *) key, strlen(key));
+    if (writer->indent) writer_append(writer, ": ", 2);
+    else writer_append(writer, ":", 1);
+    writer->after_key = 1;
+}
+
+// The string must be valid UTF-8, see writer_is_utf8
+void writer_string(writer_t *writer, const uint8_t *str, uint32_t str_len) {
+    writer_separate(writer);
+    writer_escape(writer, str, str_len);
+}
+
+void writer_integer(writer_t *writer, int64_t value) {
+    writer_separate(writer);
+    if (!writer_reserve(writer, 24)) return;
+    writer->len += sprintf(writer->data + writer->len, "%lld", (long long) value);
+}
+
+void writer_boolean(writer_t *writer, uint32_t value) {
+    writer_separate(writer);
+    if (!writer_reserve(writer, 5)) return;
+    writer->len += sprintf(writer->data + writer->len, "%s", value ? "true" : "false");
+}
+
+// For the few values that are already jansson objects
+void writer_json(writer_t *writer, json_t *value) {
+    if (json_is_integer(value)) {
+        writer_integer(writer, json_integer_value(value));
+        return;
+    }
+
+    if (json_is_string(value)) {
+        writer_string(writer, (const uint8_t *) json_string_value(value), json_string_length(value));
+        return;
+    }
+
+    writer_separate(writer);
+    char *str = json_dumps(value, JSON_ENCODE_ANY | JSON_COMPACT | JSON_PRESERVE_ORDER);
+    if (!str) {
+        writer_append(writer, "null", 4);
+        return;
+    }
+    writer_append(writer, str, strlen(str));
+    free(str);
+}
+
+// Same rules as jansson, which refuses strings that aren't valid UTF-8
+uint32_t writer_is_utf8(const uint8_t *str, uint32_t str_len) {
+    uint32_t i = 0;
+    while (i < str_len) {
+        uint8_t c = str[i];
+        if (c < 0x80) {
+            if (!c) return 0;
+            i++;
+            continue;
+        }
+
+        uint32_t n;
+        uint32_t value;
+        if ((c & 0xE0) == 0xC0) {
+            n = 2;
+            value = c & 0x1F;
+        } else if ((c & 0xF0) == 0xE0) {
+            n = 3;
+            value = c & 0x0F;
+        } else if ((c & 0xF8) == 0xF0) {
+            n = 4;
+            value = c & 0x07;
+        } else {
+            return 0;
+        }
+
+        if (i + n > str_len) return 0;
+        for (uint32_t j = 1; j < n; j++) {
+            if ((str[i + j] & 0xC0) != 0x80) return 0;
+            value = (value << 6) | (str[i + j] & 0x3F);
+        }
+
+        // Overlong forms, surrogates and values beyond Unicode
+        if ((n == 2 && value < 0x80) || (n == 3 && value < 0x800) || (n == 4 && value < 0x10000) ||
+            (value >= 0xD800 && value <= 0xDFFF) || value > 0x10FFFF) {
+            return 0;
+        }
+
+        i += n;
+    }
+    return 1;
+}
@@ -0,0 +1,45 @@
+#ifndef RECOGNIZER_SERVER_WRITER_H
+#define RECOGNIZER_SERVER_WRITER_H
+
+#include <stdint.h>
+#include <jansson.h>
+
+#define WRITER_MAX_DEPTH 32
+
+// Streams JSON into a growing buffer, without building a jansson tree
+typedef struct writer {
+    char *data;
+    uint32_t len;
+    uint32_t size;
+    // Spaces per level, 0 for compact output
+    uint32_t indent;
+    uint32_t depth;
+    // Whether the container at each depth has no values yet
+    uint8_t empty[WRITER_MAX_DEPTH];
+    uint8_t after_key;
+    uint8_t failed;
+} writer_t;
+
+writer_t *writer_get_thread(uint32_t indent);
+
+void writer_begin_object(writer_t *writer);
+
+void writer_end_object(writer_t *writer);
+
+void writer_begin_array(writer_t *writer);
+
+void writer_end_array(writer_t *writer);
+
+void writer_key(writer_t *writer, const char *key);
+
+void writer_string(writer_t *writer, const uint8_t *str, uint32_t str_len);
+
+void writer_integer(writer_t *writer, int64_t value);
+
+void writer_boolean(writer_t *writer, uint32_t value);
+
+void writer_json(writer_t *writer, json_t *value);
+
+uint32_t writer_is_utf8(const uint8_t *str, uint32_t str_len);
+
+#endif //RECOGNIZER_SERVER_WRITER_H